@@ -28,13 +28,26 @@
 #endif
 #include "cfg_file.h"
 #include "cache.h"
+#include "cache_async.h"
+#include "cluster.h"
+#include "lcache.h"
 #include "hiredis.h"
+#include "resolver.h"
 #include "rmilter.h"
 #include "upstream.h"
 #include "util.h"
+#include "utlist.h"
+#include "xxhash.h"
 #include <assert.h>
+#include <stdarg.h>
+#include <netinet/tcp.h>
 
 #define DEFAULT_REDIS_PORT 6379
+#define MAX_CLUSTER_REDIRECTS 3
+/* Keys written recently are read from master as replicas might lag behind */
+#define REPLICA_FRESH_SLOTS 4096
+#define REPLICA_FRESH_TIME 10
+#define REPLICA_FRESH_SEED 0x3c9e7a51ULL
 
 #ifdef WITH_MEMCACHED
 static inline bool compat_memcached_success(int rc)
@@ -66,6 +79,58 @@ static inline bool compat_memcached_fatal(int rc)
 }
 #endif
 
+static redisReply *rmilter_redis_command (struct config_file *cfg,
+		struct cache_server *serv, struct mlfi_priv *priv, const char *fmt, ...);
+
+/*
+ * Returns cluster node that owns the key, slots map is (re)loaded from one of
+ * the seeds if needed
+ */
+static struct cache_server *
+rmilter_get_cluster_server (struct config_file *cfg, struct cache_server *seeds,
+		unsigned int nseeds, const unsigned char *key, size_t keylen,
+		struct mlfi_priv *priv)
+{
+	struct rmilter_cluster *cl;
+	struct cache_server *seed;
+	redisReply *r;
+	bool ok = false;
+
+	cl = rmilter_cluster_get (seeds, nseeds);
+
+	if (cl == NULL) {
+		return NULL;
+	}
+
+	if (rmilter_cluster_refresh_start (cl)) {
+		seed = (struct cache_server *)get_random_upstream (seeds, nseeds,
+				sizeof (*seed), time (NULL),
+				cfg->cache_error_time, cfg->cache_dead_time,
+				cfg->cache_maxerrors, priv);
+
+		if (seed) {
+			r = rmilter_redis_command (cfg, seed, priv, "CLUSTER SLOTS");
+
+			if (r) {
+				ok = rmilter_cluster_update (cl, r, seed);
+
+				if (!ok) {
+					msg_err ("<%s>; cannot load cluster slots from %s:%d: %s",
+							priv->mlfi_id, seed->addr, (int)seed->port,
+							r->type == REDIS_REPLY_ERROR ?
+									r->str : "invalid reply");
+				}
+
+				freeReplyObject (r);
+			}
+		}
+
+		rmilter_cluster_refresh_done (cl, ok);
+	}
+
+	return rmilter_cluster_route (cl, rmilter_cluster_keyslot (key, keylen));
+}
+
 static struct cache_server *
 rmilter_get_server (struct config_file *cfg, enum rmilter_query_type type,
 		const unsigned char *key, size_t keylen, struct mlfi_priv *priv)
@@ -105,16 +170,94 @@ rmilter_get_server (struct config_file *cfg, enum rmilter_query_type type,
 		break;
 	}
 
-	if (ptr) {
-		serv = (struct cache_server *)get_upstream_by_hash (ptr, mlen,
-				sizeof (*serv), time (NULL),
-				cfg->cache_error_time, cfg->cache_dead_time,
-				cfg->cache_maxerrors, key, keylen, priv);
+	if (ptr && cfg->cache_cluster && cfg->cache_use_redis) {
+		serv = rmilter_get_cluster_server (cfg, ptr, mlen, key, keylen, priv);
+	}
+
+	if (ptr && serv == NULL) {
+		/* Unknown slots are requested from seeds and redirected if needed */
+		if (cfg->cache_hashing == HASHING_RENDEZVOUS) {
+			serv = (struct cache_server *)get_upstream_by_rendezvous (ptr,
+					mlen, sizeof (*serv), time (NULL),
+					cfg->cache_error_time, cfg->cache_dead_time,
+					cfg->cache_maxerrors, key, keylen, priv);
+		}
+		else {
+			serv = (struct cache_server *)get_upstream_by_hash (ptr, mlen,
+					sizeof (*serv), time (NULL),
+					cfg->cache_error_time, cfg->cache_dead_time,
+					cfg->cache_maxerrors, key, keylen, priv);
+		}
 	}
 
 	return serv;
 }
 
+/*
+ * Time of the last write per key hash, collisions only cause extra reads from
+ * master. Only writes of this process are known here, so keys written by other
+ * milter processes can still be read stale from replicas, see
+ * rmilter_replica_recheck
+ */
+static uint32_t replica_fresh[REPLICA_FRESH_SLOTS];
+
+static unsigned int
+rmilter_replica_slot (enum rmilter_query_type type, const unsigned char *key,
+		size_t keylen)
+{
+	return XXH64 (key, keylen, REPLICA_FRESH_SEED + type) % REPLICA_FRESH_SLOTS;
+}
+
+static void
+rmilter_replica_written (struct cache_server *serv, enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen)
+{
+	if (serv->nreplicas > 0) {
+		replica_fresh[rmilter_replica_slot (type, key, keylen)] = time (NULL);
+	}
+}
+
+static bool
+rmilter_replica_fresh (enum rmilter_query_type type, const unsigned char *key,
+		size_t keylen)
+{
+	uint32_t written;
+
+	written = replica_fresh[rmilter_replica_slot (type, key, keylen)];
+
+	return written != 0 && (uint32_t)time (NULL) - written < REPLICA_FRESH_TIME;
+}
+
+/*
+ * Misses of greylisting records on replicas are rechecked on master, as
+ * records written by other milters might have not been replicated yet and
+ * missing records cause messages to be greylisted again
+ */
+static bool
+rmilter_replica_recheck (enum rmilter_query_type type)
+{
+	return type == RMILTER_QUERY_GREYLIST || type == RMILTER_QUERY_WHITELIST;
+}
+
+/*
+ * Selects replica to read from: the faster of two random alive replicas is
+ * used, so load is spread over replicas and slow ones get less requests.
+ * NULL is returned if server has no alive replicas.
+ */
+static struct cache_server *
+rmilter_get_replica (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv)
+{
+	if (serv->nreplicas == 0 || serv->cluster || !cfg->cache_use_redis) {
+		return NULL;
+	}
+
+	return (struct cache_server *)get_upstream_by_latency (serv->replicas,
+			serv->nreplicas, sizeof (struct cache_server), time (NULL),
+			cfg->cache_error_time, cfg->cache_dead_time,
+			cfg->cache_maxerrors, priv);
+}
+
 static struct cache_server *
 rmilter_get_publish_server (struct config_file *cfg, enum rmilter_publish_type type,
 		struct mlfi_priv *priv)
@@ -129,180 +272,1777 @@ rmilter_get_publish_server (struct config_file *cfg, enum rmilter_publish_type t
 			ptr = cfg->cache_servers_copy;
 			mlen = cfg->cache_servers_copy_num;
 		}
-		break;
-	case RMILTER_PUBLISH_SPAM:
-		if (cfg->cache_servers_spam_num > 0) {
-			ptr = cfg->cache_servers_spam;
-			mlen = cfg->cache_servers_spam_num;
+		break;
+	case RMILTER_PUBLISH_SPAM:
+		if (cfg->cache_servers_spam_num > 0) {
+			ptr = cfg->cache_servers_spam;
+			mlen = cfg->cache_servers_spam_num;
+		}
+		break;
+	}
+
+	if (ptr) {
+		serv = (struct cache_server *)get_upstream_master_slave (ptr, mlen,
+				sizeof (*serv), time (NULL),
+				cfg->cache_error_time, cfg->cache_dead_time,
+				cfg->cache_maxerrors, priv);
+	}
+
+	return serv;
+}
+
+#ifdef WITH_MEMCACHED
+static void
+rmilter_format_libmemcached_config (struct config_file *cfg,
+		struct cache_server *serv,
+		memcached_st *ctx)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (serv->addr[0] == '/' || serv->addr[0] == '.') {
+		/* Assume unix socket */
+		memcached_server_add_unix_socket (ctx, serv->addr);
+	}
+	else if (rmilter_resolver_addr (serv->resolved, addr, sizeof (addr))) {
+		memcached_server_add (ctx, addr, serv->port);
+	}
+	else {
+		memcached_server_add (ctx, serv->addr, serv->port);
+	}
+
+	memcached_behavior_set (ctx, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+			cfg->cache_connect_timeout);
+	memcached_behavior_set (ctx, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+				cfg->cache_connect_timeout);
+
+	if (cfg->cache_memcached_binary) {
+		memcached_behavior_set (ctx, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+	}
+}
+#endif
+
+/*
+ * Persistent redis (and memcached) connections: every milter worker thread
+ * keeps its own list of connections (one per cache server), so no locking is
+ * needed on the request path. The whole list is dropped when the
+ * configuration is reloaded.
+ */
+struct rmilter_redis_conn {
+	const struct cache_server *serv;
+	redisContext *redis;
+#ifdef WITH_MEMCACHED
+	memcached_st *mctx;
+#endif
+	time_t last_used;
+	struct rmilter_redis_conn *next;
+};
+
+struct rmilter_redis_pool {
+	struct rmilter_redis_conn *conns;
+	unsigned int serial;
+};
+
+static pthread_key_t redis_pool_key;
+static pthread_once_t redis_pool_once = PTHREAD_ONCE_INIT;
+static struct rmilter_cache_stat cache_stat;
+
+#define CACHE_STAT_INC(field) __sync_fetch_and_add (&cache_stat.field, 1)
+
+/*
+ * Circuit breaker: after `breaker_failures` consecutive failures or when
+ * `breaker_error_rate` percent of requests fail during a window, the breaker
+ * opens and requests to the server fail immediately. After
+ * `breaker_open_time` a single probe request is let through, its result
+ * either closes the breaker or opens it again. Counters are updated without
+ * locking, so concurrent requests may be slightly miscounted.
+ */
+#define BREAKER_WINDOW 10000
+/* Error rate is not checked until this number of requests in the window */
+#define BREAKER_MIN_REQUESTS 20
+
+static uint64_t
+rmilter_breaker_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static inline bool
+rmilter_breaker_enabled (struct config_file *cfg)
+{
+	return cfg->cache_breaker_failures > 0 || cfg->cache_breaker_error_rate > 0;
+}
+
+/*
+ * Returns false if request to the server should fail without being sent
+ */
+static bool
+rmilter_breaker_allow (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv)
+{
+	struct rmilter_breaker *br = &serv->breaker;
+	uint64_t now, changed;
+	unsigned int state;
+
+	if (!rmilter_breaker_enabled (cfg)) {
+		return true;
+	}
+
+	state = __sync_fetch_and_add (&br->state, 0);
+
+	if (state == BREAKER_CLOSED) {
+		return true;
+	}
+
+	now = rmilter_breaker_now ();
+	changed = __sync_fetch_and_add (&br->changed, 0);
+
+	/* Probe is also resent if the previous one has not been completed */
+	if (now - changed >= cfg->cache_breaker_open_time &&
+			__sync_bool_compare_and_swap (&br->changed, changed, now)) {
+		__sync_lock_test_and_set (&br->state, BREAKER_HALF_OPEN);
+		msg_info ("<%s>; circuit breaker of %s:%d is half-open, probing",
+				priv->mlfi_id, serv->addr, (int)serv->port);
+
+		return true;
+	}
+
+	CACHE_STAT_INC (breaker_rejects);
+
+	return false;
+}
+
+static void
+rmilter_breaker_trip (struct config_file *cfg, struct cache_server *serv,
+		unsigned int from, struct mlfi_priv *priv)
+{
+	struct rmilter_breaker *br = &serv->breaker;
+
+	if (__sync_fetch_and_add (&br->state, 0) != from) {
+		return;
+	}
+
+	/* Time is stored first, so open breaker is never seen with old time */
+	__sync_lock_test_and_set (&br->changed, rmilter_breaker_now ());
+
+	if (__sync_bool_compare_and_swap (&br->state, from, BREAKER_OPEN)) {
+		if (from == BREAKER_CLOSED) {
+			CACHE_STAT_INC (breaker_trips);
+			msg_warn ("<%s>; circuit breaker of %s:%d is open after %u "
+					"consecutive failures, %u of %u requests failed",
+					priv->mlfi_id, serv->addr, (int)serv->port,
+					br->failures, br->errors, br->requests);
+		}
+		else {
+			msg_info ("<%s>; circuit breaker of %s:%d: probe failed, "
+					"keep it open", priv->mlfi_id, serv->addr,
+					(int)serv->port);
+		}
+	}
+}
+
+/*
+ * Updates breaker with the result of request to the server
+ */
+static void
+rmilter_breaker_result (struct config_file *cfg, struct cache_server *serv,
+		bool ok, struct mlfi_priv *priv)
+{
+	struct rmilter_breaker *br = &serv->breaker;
+	unsigned int state, failures, requests, errors;
+	uint64_t now, start;
+
+	if (!rmilter_breaker_enabled (cfg)) {
+		return;
+	}
+
+	state = __sync_fetch_and_add (&br->state, 0);
+
+	if (state == BREAKER_HALF_OPEN) {
+		if (!ok) {
+			rmilter_breaker_trip (cfg, serv, BREAKER_HALF_OPEN, priv);
+		}
+		else if (__sync_bool_compare_and_swap (&br->state, BREAKER_HALF_OPEN,
+				BREAKER_CLOSED)) {
+			__sync_lock_test_and_set (&br->failures, 0);
+			__sync_lock_test_and_set (&br->requests, 0);
+			__sync_lock_test_and_set (&br->errors, 0);
+			__sync_lock_test_and_set (&br->window_start, rmilter_breaker_now ());
+			msg_info ("<%s>; circuit breaker of %s:%d is closed",
+					priv->mlfi_id, serv->addr, (int)serv->port);
+		}
+
+		return;
+	}
+	else if (state != BREAKER_CLOSED) {
+		return;
+	}
+
+	now = rmilter_breaker_now ();
+	start = __sync_fetch_and_add (&br->window_start, 0);
+
+	if (now - start >= BREAKER_WINDOW &&
+			__sync_bool_compare_and_swap (&br->window_start, start, now)) {
+		__sync_lock_test_and_set (&br->requests, 0);
+		__sync_lock_test_and_set (&br->errors, 0);
+	}
+
+	requests = __sync_add_and_fetch (&br->requests, 1);
+
+	if (ok) {
+		__sync_lock_test_and_set (&br->failures, 0);
+
+		return;
+	}
+
+	failures = __sync_add_and_fetch (&br->failures, 1);
+	errors = __sync_add_and_fetch (&br->errors, 1);
+
+	if ((cfg->cache_breaker_failures > 0 &&
+			failures >= cfg->cache_breaker_failures) ||
+			(cfg->cache_breaker_error_rate > 0 &&
+			requests >= BREAKER_MIN_REQUESTS &&
+			errors * 100 >= cfg->cache_breaker_error_rate * requests)) {
+		rmilter_breaker_trip (cfg, serv, BREAKER_CLOSED, priv);
+	}
+}
+
+/*
+ * Call these functions instead of upstream_ok/upstream_fail for cache servers
+ */
+static void
+rmilter_cache_ok (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv)
+{
+	upstream_ok (&serv->up, time (NULL));
+	rmilter_breaker_result (cfg, serv, true, priv);
+}
+
+static void
+rmilter_cache_fail (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv)
+{
+	upstream_fail (&serv->up, time (NULL));
+	rmilter_breaker_result (cfg, serv, false, priv);
+}
+
+static void
+rmilter_redis_pool_flush (struct rmilter_redis_pool *pool)
+{
+	struct rmilter_redis_conn *conn, *tmp;
+
+	LL_FOREACH_SAFE (pool->conns, conn, tmp) {
+		if (conn->redis) {
+			redisFree (conn->redis);
+		}
+#ifdef WITH_MEMCACHED
+		if (conn->mctx) {
+			memcached_free (conn->mctx);
+		}
+#endif
+		free (conn);
+	}
+
+	pool->conns = NULL;
+}
+
+static void
+rmilter_redis_pool_dtor (void *p)
+{
+	struct rmilter_redis_pool *pool = p;
+
+	rmilter_redis_pool_flush (pool);
+	free (pool);
+}
+
+static void
+rmilter_redis_pool_init (void)
+{
+	pthread_key_create (&redis_pool_key, rmilter_redis_pool_dtor);
+}
+
+static struct rmilter_redis_conn *
+rmilter_redis_pool_conn (struct config_file *cfg, const struct cache_server *serv)
+{
+	struct rmilter_redis_pool *pool;
+	struct rmilter_redis_conn *conn;
+
+	pthread_once (&redis_pool_once, rmilter_redis_pool_init);
+	pool = pthread_getspecific (redis_pool_key);
+
+	if (pool == NULL) {
+		pool = calloc (1, sizeof (*pool));
+
+		if (pool == NULL) {
+			return NULL;
+		}
+
+		pool->serial = cfg->serial;
+		pthread_setspecific (redis_pool_key, pool);
+	}
+	else if (pool->serial != cfg->serial) {
+		/* Servers array has been replaced, connections are no longer valid */
+		rmilter_redis_pool_flush (pool);
+		pool->serial = cfg->serial;
+	}
+
+	LL_FOREACH (pool->conns, conn) {
+		if (conn->serv == serv) {
+			return conn;
+		}
+	}
+
+	conn = calloc (1, sizeof (*conn));
+
+	if (conn) {
+		conn->serv = serv;
+		LL_PREPEND (pool->conns, conn);
+	}
+
+	return conn;
+}
+
+static bool
+rmilter_redis_prepare (struct config_file *cfg, redisContext *redis)
+{
+	redisReply *r;
+	int rep = 0;
+
+	if (cfg->cache_password) {
+		redisAppendCommand (redis, "AUTH %s", cfg->cache_password);
+		rep ++;
+	}
+	/* Redis cluster supports database 0 only */
+	if (cfg->cache_dbname && !cfg->cache_cluster) {
+		redisAppendCommand (redis, "SELECT %s", cfg->cache_dbname);
+		rep ++;
+	}
+
+	while (rep > 0) {
+		r = NULL;
+
+		if (redisGetReply (redis, (void **)&r) != REDIS_OK || r == NULL) {
+			return false;
+		}
+
+		if (r->type == REDIS_REPLY_ERROR) {
+			if (redis->err == 0) {
+				redis->err = REDIS_ERR_OTHER;
+				rmilter_strlcpy (redis->errstr, r->str, sizeof (redis->errstr));
+			}
+
+			freeReplyObject (r);
+			return false;
+		}
+
+		freeReplyObject (r);
+		rep --;
+	}
+
+	return true;
+}
+
+/*
+ * Returns a ready to use (authenticated and with database selected)
+ * connection to the specified server. If `pooled` is set to true, then the
+ * connection has been used before and might be closed by the server side.
+ */
+static redisContext *
+rmilter_redis_get (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, bool *pooled)
+{
+	struct rmilter_redis_conn *conn;
+	redisContext *redis = NULL;
+	struct timeval tv;
+	int s, ofl, on = 1;
+	time_t now;
+
+	*pooled = false;
+	now = time (NULL);
+	conn = rmilter_redis_pool_conn (cfg, serv);
+
+	if (conn && conn->redis) {
+		if (conn->redis->err == 0 &&
+				now - conn->last_used < cfg->cache_idle_timeout / 1000) {
+			CACHE_STAT_INC (pool_hits);
+			conn->last_used = now;
+			*pooled = true;
+
+			return conn->redis;
+		}
+
+		/* Broken or stale connection */
+		redisFree (conn->redis);
+		conn->redis = NULL;
+		CACHE_STAT_INC (pool_reconnects);
+	}
+	else {
+		CACHE_STAT_INC (pool_misses);
+	}
+
+	/* Special workaround */
+	if (serv->port == DEFAULT_MEMCACHED_PORT) {
+		serv->port = DEFAULT_REDIS_PORT;
+	}
+
+	msec_to_tv (cfg->cache_connect_timeout, &tv);
+
+	if (serv->addr[0] == '/' || serv->addr[0] == '.') {
+		redis = redisConnectUnixWithTimeout (serv->addr, tv);
+	}
+	else {
+		/* Connect to cached address, hiredis would resolve name again */
+		s = rmilter_resolver_connect (serv->resolved, serv->addr, serv->port,
+				cfg->cache_connect_timeout, priv);
+
+		if (s == -1) {
+			return NULL;
+		}
+
+		/* hiredis expects blocking socket */
+		ofl = fcntl (s, F_GETFL, 0);
+		fcntl (s, F_SETFL, ofl & ~O_NONBLOCK);
+		setsockopt (s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+		redis = redisConnectFd (s);
+
+		if (redis == NULL) {
+			close (s);
+		}
+	}
+
+	if (redis == NULL || redis->err != 0) {
+		msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
+				(int)serv->port, redis ? redis->errstr : "unknown error");
+
+		if (redis) {
+			redisFree (redis);
+		}
+
+		return NULL;
+	}
+
+	/* Connect timeout is also used for commands */
+	redisSetTimeout (redis, tv);
+
+	if (!rmilter_redis_prepare (cfg, redis)) {
+		msg_err ("<%s>; cannot setup connection to %s:%d: %s", priv->mlfi_id,
+				serv->addr, (int)serv->port, redis->errstr);
+		redisFree (redis);
+
+		return NULL;
+	}
+
+	if (conn) {
+		conn->redis = redis;
+		conn->last_used = now;
+	}
+
+	return redis;
+}
+
+/*
+ * Marks connection as done: broken connections are closed and removed from
+ * the pool, good ones are left for the subsequent requests
+ */
+static void
+rmilter_redis_release (struct config_file *cfg, struct cache_server *serv,
+		redisContext *redis, bool broken)
+{
+	struct rmilter_redis_conn *conn;
+
+	conn = rmilter_redis_pool_conn (cfg, serv);
+
+	if (conn == NULL || conn->redis != redis) {
+		/* Not pooled */
+		redisFree (redis);
+		return;
+	}
+
+	if (broken) {
+		CACHE_STAT_INC (pool_errors);
+		redisFree (redis);
+		conn->redis = NULL;
+	}
+}
+
+#ifdef WITH_MEMCACHED
+/*
+ * Returns memcached context for the specified server, contexts are kept per
+ * thread and are configured once per config serial; libmemcached itself
+ * restores connections broken. NULL is returned on error or if the circuit
+ * breaker of server is open
+ */
+static memcached_st *
+rmilter_memcached_get (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv)
+{
+	struct rmilter_redis_conn *conn;
+
+	if (!rmilter_breaker_allow (cfg, serv, priv)) {
+		return NULL;
+	}
+
+	conn = rmilter_redis_pool_conn (cfg, serv);
+
+	if (conn == NULL) {
+		rmilter_cache_fail (cfg, serv, priv);
+		return NULL;
+	}
+
+	if (conn->mctx) {
+		CACHE_STAT_INC (pool_hits);
+
+		return conn->mctx;
+	}
+
+	CACHE_STAT_INC (pool_misses);
+	conn->mctx = memcached_create (NULL);
+
+	if (conn->mctx == NULL) {
+		msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id,
+				serv->addr, (int)serv->port, strerror (errno));
+		rmilter_cache_fail (cfg, serv, priv);
+
+		return NULL;
+	}
+
+	rmilter_format_libmemcached_config (cfg, serv, conn->mctx);
+
+	return conn->mctx;
+}
+
+/*
+ * Closes connection after fatal error, it is reopened on the next request
+ */
+static void
+rmilter_memcached_error (memcached_st *mctx)
+{
+	CACHE_STAT_INC (pool_errors);
+	memcached_quit (mctx);
+}
+#endif
+
+/*
+ * Returns true if pooled connection has been closed by the server before any
+ * reply has been read, so commands have not been executed and can be resent.
+ * Timeouts are never retried as the server might have run commands already.
+ */
+static bool
+rmilter_redis_conn_closed (redisContext *redis, int err)
+{
+	if (redis->reader != NULL && redis->reader->len > 0) {
+		return false;
+	}
+
+	return redis->err == REDIS_ERR_EOF ||
+			(redis->err == REDIS_ERR_IO && (err == ECONNRESET || err == EPIPE));
+}
+
+/*
+ * Sends preformatted pipeline of `ncmds` commands to the specified server and
+ * reads all replies to the `replies` array, reusing persistent connection if
+ * possible. If a pooled connection has been closed by the server before
+ * replying, the pipeline is resent once using a fresh connection. The caller
+ * should free the replies returned.
+ */
+static bool
+rmilter_redis_send_pipeline (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, const char *cmd, size_t len,
+		unsigned int ncmds, redisReply **replies)
+{
+	redisContext *redis;
+	bool pooled, ret = false;
+	unsigned int i;
+	int attempt, err = 0;
+
+	if (cfg->cache_use_async) {
+		/* Special workaround */
+		if (serv->port == DEFAULT_MEMCACHED_PORT) {
+			serv->port = DEFAULT_REDIS_PORT;
+		}
+
+		ret = rmilter_cache_async_pipeline (cfg, serv, priv, cmd, len, ncmds,
+				replies);
+	}
+
+	for (attempt = 0; attempt < 2 && !ret && !cfg->cache_use_async;
+			attempt ++) {
+		redis = rmilter_redis_get (cfg, serv, priv, &pooled);
+
+		if (redis == NULL) {
+			break;
+		}
+
+		redisAppendFormattedCommand (redis, cmd, len);
+
+		for (i = 0; i < ncmds; i ++) {
+			replies[i] = NULL;
+
+			if (redisGetReply (redis, (void **)&replies[i]) != REDIS_OK ||
+					replies[i] == NULL) {
+				err = errno;
+				break;
+			}
+		}
+
+		if (i == ncmds) {
+			rmilter_redis_release (cfg, serv, redis, false);
+			ret = true;
+			break;
+		}
+
+		if (!pooled || i > 0 || !rmilter_redis_conn_closed (redis, err)) {
+			while (i > 0) {
+				freeReplyObject (replies[--i]);
+			}
+
+			msg_err ("<%s>; cannot query %s:%d: %s", priv->mlfi_id, serv->addr,
+					(int)serv->port, redis->errstr);
+			rmilter_redis_release (cfg, serv, redis, true);
+			break;
+		}
+
+		msg_info ("<%s>; persistent connection to %s:%d is broken: %s, "
+				"reconnecting", priv->mlfi_id, serv->addr,
+				(int)serv->port, redis->errstr);
+		rmilter_redis_release (cfg, serv, redis, true);
+	}
+
+	if (!ret) {
+		rmilter_cache_fail (cfg, serv, priv);
+	}
+	else {
+		rmilter_cache_ok (cfg, serv, priv);
+	}
+
+	return ret;
+}
+
+/*
+ * Resends commands that have been answered with cluster redirections to the
+ * nodes specified, replies are replaced in place
+ */
+static void
+rmilter_redis_follow_redirects (struct config_file *cfg,
+		struct cache_server *serv, struct mlfi_priv *priv, const char *cmd,
+		size_t len, unsigned int ncmds, redisReply **replies)
+{
+	static const char asking[] = "*1\r\n$6\r\nASKING\r\n";
+	struct cache_server *target;
+	redisReply *r[2];
+	const char *p = cmd;
+	char *buf;
+	size_t clen;
+	unsigned int i;
+	int depth;
+	bool ask;
+
+	for (i = 0; i < ncmds; i ++) {
+		clen = rmilter_resp_cmdlen (p, len - (p - cmd));
+
+		if (clen == 0) {
+			break;
+		}
+
+		for (depth = 0; depth < MAX_CLUSTER_REDIRECTS &&
+				replies[i]->type == REDIS_REPLY_ERROR; depth ++) {
+			target = rmilter_cluster_redirect (serv->cluster, replies[i]->str,
+					&ask);
+
+			if (target == NULL) {
+				break;
+			}
+
+			msg_debug ("<%s>; redirected from %s:%d to %s:%d: %s",
+					priv->mlfi_id, serv->addr, (int)serv->port,
+					target->addr, (int)target->port, replies[i]->str);
+
+			if (ask) {
+				/* Importing node accepts the command only after ASKING */
+				buf = malloc (sizeof (asking) - 1 + clen);
+
+				if (buf == NULL) {
+					break;
+				}
+
+				memcpy (buf, asking, sizeof (asking) - 1);
+				memcpy (buf + sizeof (asking) - 1, p, clen);
+
+				if (!rmilter_redis_send_pipeline (cfg, target, priv, buf,
+						sizeof (asking) - 1 + clen, 2, r)) {
+					free (buf);
+					rmilter_cluster_set_stale (serv->cluster);
+					break;
+				}
+
+				free (buf);
+				freeReplyObject (r[0]);
+				r[0] = r[1];
+			}
+			else if (!rmilter_redis_send_pipeline (cfg, target, priv, p, clen,
+					1, r)) {
+				rmilter_cluster_set_stale (serv->cluster);
+				break;
+			}
+
+			freeReplyObject (replies[i]);
+			replies[i] = r[0];
+		}
+
+		p += clen;
+	}
+}
+
+/*
+ * Sends pipeline to the server following cluster redirections if needed,
+ * fails at once if the circuit breaker of server is open
+ */
+static bool
+rmilter_redis_pipeline (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, const char *cmd, size_t len,
+		unsigned int ncmds, redisReply **replies)
+{
+	struct timeval tv;
+	bool ret;
+
+	if (!rmilter_breaker_allow (cfg, serv, priv)) {
+		return false;
+	}
+
+	upstream_start (&serv->up, &tv);
+	ret = rmilter_redis_send_pipeline (cfg, serv, priv, cmd, len, ncmds,
+			replies);
+	upstream_done (&serv->up, &tv, ret);
+
+	if (!ret) {
+		if (serv->cluster) {
+			/* Node might have failed over */
+			rmilter_cluster_set_stale (serv->cluster);
+		}
+
+		return false;
+	}
+
+	if (serv->cluster) {
+		rmilter_redis_follow_redirects (cfg, serv, priv, cmd, len, ncmds,
+				replies);
+	}
+
+	return true;
+}
+
+static redisReply *
+rmilter_redis_exec (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, const char *cmd, int len)
+{
+	redisReply *r;
+
+	if (!rmilter_redis_pipeline (cfg, serv, priv, cmd, len, 1, &r)) {
+		return NULL;
+	}
+
+	return r;
+}
+
+static redisReply *
+rmilter_redis_command (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, const char *fmt, ...)
+{
+	redisReply *r;
+	char *cmd;
+	va_list ap;
+	int len;
+
+	va_start (ap, fmt);
+	len = redisvFormatCommand (&cmd, fmt, ap);
+	va_end (ap);
+
+	if (len == -1) {
+		msg_err ("<%s>; cannot format redis command", priv->mlfi_id);
+		return NULL;
+	}
+
+	r = rmilter_redis_exec (cfg, serv, priv, cmd, len);
+	redisFreeCommand (cmd);
+
+	return r;
+}
+
+static redisReply *
+rmilter_redis_command_argv (struct config_file *cfg, struct cache_server *serv,
+		struct mlfi_priv *priv, int argc, const char **argv,
+		const size_t *argvlen)
+{
+	redisReply *r;
+	char *cmd;
+	int len;
+
+	len = redisFormatCommandArgv (&cmd, argc, argv, argvlen);
+
+	if (len == -1) {
+		msg_err ("<%s>; cannot format redis command", priv->mlfi_id);
+		return NULL;
+	}
+
+	r = rmilter_redis_exec (cfg, serv, priv, cmd, len);
+	redisFreeCommand (cmd);
+
+	return r;
+}
+
+void
+rmilter_cache_get_stat (struct rmilter_cache_stat *st)
+{
+	rmilter_stat_snapshot (st, &cache_stat, sizeof (*st));
+}
+
+bool
+rmilter_query_cache (struct config_file *cfg, enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen,
+		unsigned char **data, size_t *datalen, struct mlfi_priv *priv)
+{
+	struct cache_server *serv, *replica;
+	redisReply *r = NULL;
+	size_t dlen;
+	bool ret = false, local;
+
+	local = rmilter_lcache_eligible (cfg, type);
+
+	if (local && rmilter_lcache_lookup (type, key, keylen, data, &dlen)) {
+		if (datalen) {
+			*datalen = dlen;
+		}
+
+		return true;
+	}
+
+	serv = rmilter_get_server (cfg, type, key, keylen, priv);
+
+	if (serv) {
+		if (cfg->cache_use_redis) {
+			replica = rmilter_get_replica (cfg, serv, priv);
+
+			if (replica && !rmilter_replica_fresh (type, key, keylen)) {
+				r = rmilter_redis_command (cfg, replica, priv, "GET %b", key,
+						keylen);
+
+				if (r && r->type == REDIS_REPLY_NIL &&
+						rmilter_replica_recheck (type)) {
+					freeReplyObject (r);
+					r = NULL;
+				}
+			}
+
+			if (r == NULL) {
+				/* No replicas, fresh key, replica miss or failure */
+				r = rmilter_redis_command (cfg, serv, priv, "GET %b", key,
+						keylen);
+			}
+
+			if (r == NULL) {
+				return false;
+			}
+
+			if (r->type == REDIS_REPLY_STRING && r->len > 0) {
+				*data = malloc (r->len);
+				if (*data) {
+					memcpy (*data, r->str, r->len);
+					ret = true;
+					if (datalen) {
+						*datalen = r->len;
+					}
+				}
+			}
+
+			freeReplyObject (r);
+		}
+		else {
+#ifdef WITH_MEMCACHED
+			char *kval;
+			size_t value_len = 0;
+			uint32_t mflags;
+			int mret;
+			memcached_st *mctx;
+
+			mctx = rmilter_memcached_get (cfg, serv, priv);
+
+			if (mctx == NULL) {
+				return false;
+			}
+
+			kval = memcached_get (mctx, key, keylen,
+					&value_len, &mflags, &mret);
+
+			if (!compat_memcached_success (mret)) {
+				if (kval) {
+					free (kval);
+				}
+				*datalen = 0;
+
+				if (compat_memcached_fatal (mret)) {
+					msg_err ("<%s>; cannot get key on %s:%d: %s", priv->mlfi_id, serv->addr,
+						(int)serv->port, memcached_strerror (mctx, mret));
+					rmilter_memcached_error (mctx);
+					rmilter_cache_fail (cfg, serv, priv);
+				}
+				else {
+					rmilter_cache_ok (cfg, serv, priv);
+				}
+			}
+			else {
+				*data = kval;
+				*datalen = value_len;
+				rmilter_cache_ok (cfg, serv, priv);
+				ret = true;
+			}
+#else
+			msg_err ("<%s>; memcached query requested when memcached support is"
+					" not compiled", priv->mlfi_id);
+#endif
+		}
+	}
+
+	if (ret && local && datalen) {
+		rmilter_lcache_insert (cfg, type, key, keylen, *data, *datalen, 0);
+	}
+
+	return ret;
+}
+
+/*
+ * Appends formatted command to the pipeline buffer
+ */
+static bool
+rmilter_pipeline_append (char **buf, size_t *len, size_t *allocated,
+		const char *cmd, int cmdlen)
+{
+	char *nbuf;
+	size_t nlen;
+
+	if (cmdlen < 0) {
+		return false;
+	}
+
+	if (*len + cmdlen > *allocated) {
+		nlen = *allocated * 2;
+
+		if (nlen < *len + cmdlen) {
+			nlen = *len + cmdlen;
+		}
+
+		nbuf = realloc (*buf, nlen);
+
+		if (nbuf == NULL) {
+			return false;
+		}
+
+		*buf = nbuf;
+		*allocated = nlen;
+	}
+
+	memcpy (*buf + *len, cmd, cmdlen);
+	*len += cmdlen;
+
+	return true;
+}
+
+/*
+ * Copies string reply to the query result, values of plain keys are also
+ * cached locally if allowed
+ */
+static bool
+rmilter_query_set_result (struct config_file *cfg,
+		struct rmilter_cache_query *q, redisReply *elt)
+{
+	if (elt->type != REDIS_REPLY_STRING || elt->len == 0) {
+		return false;
+	}
+
+	q->data = malloc (elt->len);
+
+	if (q->data == NULL) {
+		return false;
+	}
+
+	memcpy (q->data, elt->str, elt->len);
+	q->datalen = elt->len;
+
+	if (q->field == NULL && rmilter_lcache_eligible (cfg, q->type)) {
+		rmilter_lcache_insert (cfg, q->type, q->key, q->keylen, q->data,
+				q->datalen, 0);
+	}
+
+	return true;
+}
+
+/*
+ * Requests queries listed in `grp` from the server by a single pipeline,
+ * returns number of values found or -1 if the server has failed
+ */
+static int
+rmilter_query_cache_server (struct config_file *cfg, struct cache_server *serv,
+		struct rmilter_cache_query *queries, const unsigned int *grp,
+		unsigned int ngrp, struct mlfi_priv *priv)
+{
+	redisReply *r, **replies = NULL;
+	const char **argv = NULL;
+	size_t *argvlen = NULL, buflen = 0, allocated = 0;
+	unsigned int j, nkeys = 0, nfields = 0, *idx = NULL, *fidx = NULL;
+	struct rmilter_cache_query *q;
+	char *buf = NULL, *cmd;
+	int found = -1, cmdlen;
+	bool ok = true;
+
+	argv = malloc ((ngrp + 1) * sizeof (*argv));
+	argvlen = malloc ((ngrp + 1) * sizeof (*argvlen));
+	idx = malloc (ngrp * sizeof (*idx));
+	fidx = malloc (ngrp * sizeof (*fidx));
+	replies = malloc ((ngrp + 1) * sizeof (*replies));
+
+	if (argv == NULL || argvlen == NULL || idx == NULL || fidx == NULL ||
+			replies == NULL) {
+		msg_err ("<%s>; malloc failed: %s", priv->mlfi_id, strerror (errno));
+		goto end;
+	}
+
+	/*
+	 * Plain keys are requested by a single MGET, hash fields are requested
+	 * by HGET commands sent in the same pipeline. Redis cluster refuses MGET
+	 * for keys from different slots, so plain keys are requested by GET there
+	 */
+	argv[0] = "MGET";
+	argvlen[0] = sizeof ("MGET") - 1;
+
+	for (j = 0; j < ngrp && ok; j ++) {
+		q = &queries[grp[j]];
+
+		if (q->field || cfg->cache_cluster) {
+			if (q->field) {
+				cmdlen = redisFormatCommand (&cmd, "HGET %b %b",
+						q->key, q->keylen, q->field, q->fieldlen);
+			}
+			else {
+				cmdlen = redisFormatCommand (&cmd, "GET %b",
+						q->key, q->keylen);
+			}
+
+			ok = rmilter_pipeline_append (&buf, &buflen, &allocated, cmd,
+					cmdlen);
+
+			if (cmdlen >= 0) {
+				redisFreeCommand (cmd);
+			}
+
+			fidx[nfields ++] = grp[j];
+		}
+		else {
+			argv[nkeys + 1] = (const char *)q->key;
+			argvlen[nkeys + 1] = q->keylen;
+			idx[nkeys ++] = grp[j];
+		}
+	}
+
+	if (ok && nkeys > 0) {
+		/* MGET reply follows replies for hash fields */
+		cmdlen = redisFormatCommandArgv (&cmd, nkeys + 1, argv, argvlen);
+		ok = rmilter_pipeline_append (&buf, &buflen, &allocated, cmd,
+				cmdlen);
+
+		if (cmdlen >= 0) {
+			redisFreeCommand (cmd);
+		}
+	}
+
+	if (!ok) {
+		msg_err ("<%s>; cannot format redis pipeline", priv->mlfi_id);
+		goto end;
+	}
+
+	if (!rmilter_redis_pipeline (cfg, serv, priv, buf, buflen,
+			nfields + (nkeys > 0 ? 1 : 0), replies)) {
+		goto end;
+	}
+
+	found = 0;
+
+	for (j = 0; j < nfields; j ++) {
+		if (rmilter_query_set_result (cfg, &queries[fidx[j]],
+				replies[j])) {
+			found ++;
+		}
+
+		freeReplyObject (replies[j]);
+	}
+
+	if (nkeys > 0) {
+		r = replies[nfields];
+
+		if (r->type == REDIS_REPLY_ARRAY && r->elements == nkeys) {
+			for (j = 0; j < nkeys; j ++) {
+				if (rmilter_query_set_result (cfg, &queries[idx[j]],
+						r->element[j])) {
+					found ++;
+				}
+			}
+		}
+		else {
+			msg_err ("<%s>; invalid reply for MGET from %s:%d",
+					priv->mlfi_id, serv->addr, (int)serv->port);
+		}
+
+		freeReplyObject (r);
+	}
+
+end:
+	free (argv);
+	free (argvlen);
+	free (idx);
+	free (fidx);
+	free (replies);
+	free (buf);
+
+	return found;
+}
+
+/*
+ * If `first_only` is true, then no more requests are sent after some key
+ * has been found
+ */
+static int
+rmilter_query_cache_multi_common (struct config_file *cfg,
+		struct rmilter_cache_query *queries, unsigned int nqueries,
+		bool first_only, struct mlfi_priv *priv)
+{
+	struct cache_server *serv, *replica;
+	unsigned int i, j, ngrp, nreplica, tmp, *grp;
+	int found = 0, ret;
+
+	for (i = 0; i < nqueries; i ++) {
+		queries[i].data = NULL;
+		queries[i].datalen = 0;
+
+		if (first_only && found > 0) {
+			queries[i].serv = NULL;
+			queries[i].done = true;
+			continue;
+		}
+
+		if (queries[i].field == NULL &&
+				rmilter_lcache_eligible (cfg, queries[i].type) &&
+				rmilter_lcache_lookup (queries[i].type, queries[i].key,
+						queries[i].keylen, &queries[i].data,
+						&queries[i].datalen)) {
+			queries[i].serv = NULL;
+			queries[i].done = true;
+			found ++;
+			continue;
+		}
+
+		queries[i].serv = rmilter_get_server (cfg, queries[i].type,
+				queries[i].key, queries[i].keylen, priv);
+		queries[i].done = (queries[i].serv == NULL);
+	}
+
+	if (first_only && found > 0) {
+		return found;
+	}
+
+	if (!cfg->cache_use_redis) {
+		/* Memcached has no pipelining here, fall back to single queries */
+		for (i = 0; i < nqueries && !(first_only && found > 0); i ++) {
+			if (!queries[i].done && queries[i].field == NULL &&
+					rmilter_query_cache (cfg, queries[i].type,
+					queries[i].key, queries[i].keylen,
+					&queries[i].data, &queries[i].datalen, priv)) {
+				found ++;
+			}
+		}
+
+		return found;
+	}
+
+	grp = malloc (nqueries * sizeof (*grp));
+
+	if (grp == NULL) {
+		msg_err ("<%s>; malloc failed: %s", priv->mlfi_id, strerror (errno));
+		return found;
+	}
+
+	for (i = 0; i < nqueries && !(first_only && found > 0); i ++) {
+		if (queries[i].done) {
+			continue;
+		}
+
+		/* Collect all keys that belong to the same server */
+		serv = queries[i].serv;
+		ngrp = 0;
+
+		for (j = i; j < nqueries; j ++) {
+			if (!queries[j].done && queries[j].serv == serv) {
+				grp[ngrp ++] = j;
+				queries[j].done = true;
+			}
+		}
+
+		replica = rmilter_get_replica (cfg, serv, priv);
+		nreplica = 0;
+
+		if (replica) {
+			/* Keys written recently are moved to the tail and read from master */
+			for (j = 0; j < ngrp; j ++) {
+				if (!rmilter_replica_fresh (queries[grp[j]].type,
+						queries[grp[j]].key, queries[grp[j]].keylen)) {
+					tmp = grp[nreplica];
+					grp[nreplica ++] = grp[j];
+					grp[j] = tmp;
+				}
+			}
+
+			if (nreplica > 0) {
+				ret = rmilter_query_cache_server (cfg, replica, queries, grp,
+						nreplica, priv);
+
+				if (ret >= 0) {
+					found += ret;
+
+					/* Misses that might be not replicated are moved to master */
+					for (j = nreplica; j > 0; j --) {
+						if (queries[grp[j - 1]].data == NULL &&
+								rmilter_replica_recheck (
+								queries[grp[j - 1]].type)) {
+							tmp = grp[-- nreplica];
+							grp[nreplica] = grp[j - 1];
+							grp[j - 1] = tmp;
+						}
+					}
+				}
+				else {
+					/* Replica has failed, read everything from master */
+					nreplica = 0;
+				}
+			}
+		}
+
+		if (nreplica < ngrp) {
+			ret = rmilter_query_cache_server (cfg, serv, queries,
+					grp + nreplica, ngrp - nreplica, priv);
+
+			if (ret > 0) {
+				found += ret;
+			}
+		}
+	}
+
+	free (grp);
+
+	return found;
+}
+
+int
+rmilter_query_cache_multi (struct config_file *cfg,
+		struct rmilter_cache_query *queries, unsigned int nqueries,
+		struct mlfi_priv *priv)
+{
+	return rmilter_query_cache_multi_common (cfg, queries, nqueries, false,
+			priv);
+}
+
+int
+rmilter_query_cache_first (struct config_file *cfg,
+		struct rmilter_cache_query *queries, unsigned int nqueries,
+		struct mlfi_priv *priv)
+{
+	unsigned int i;
+
+	if (rmilter_query_cache_multi_common (cfg, queries, nqueries, true,
+			priv) > 0) {
+		for (i = 0; i < nqueries; i ++) {
+			if (queries[i].data) {
+				return i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+static pthread_mutex_t script_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static bool
+rmilter_redis_load_script (struct config_file *cfg, struct cache_server *serv,
+		struct rmilter_cache_script *script, struct mlfi_priv *priv)
+{
+	redisReply *r;
+	bool ret = false;
+
+	r = rmilter_redis_command (cfg, serv, priv, "SCRIPT LOAD %s", script->body);
+
+	if (r == NULL) {
+		return false;
+	}
+
+	if (r->type == REDIS_REPLY_STRING && r->len == sizeof (script->sha) - 1) {
+		pthread_mutex_lock (&script_mtx);
+		memcpy (script->sha, r->str, r->len);
+		script->sha[r->len] = '\0';
+		pthread_mutex_unlock (&script_mtx);
+		ret = true;
+	}
+	else {
+		msg_err ("<%s>; cannot load script to %s:%d: %s", priv->mlfi_id,
+				serv->addr, (int)serv->port,
+				r->type == REDIS_REPLY_ERROR ? r->str : "invalid reply");
+	}
+
+	freeReplyObject (r);
+
+	return ret;
+}
+
+bool
+rmilter_eval_cache (struct config_file *cfg, enum rmilter_query_type type,
+		struct rmilter_cache_script *script,
+		const unsigned char *key, size_t keylen,
+		unsigned int nargs, const char **args,
+		unsigned char **data, size_t *datalen, struct mlfi_priv *priv)
+{
+	struct cache_server *serv;
+	redisReply *r = NULL;
+	const char *argv[MAX_CACHE_SCRIPT_ARGS + 4];
+	size_t argvlen[MAX_CACHE_SCRIPT_ARGS + 4];
+	char sha[sizeof (script->sha)];
+	unsigned int i;
+	int attempt;
+	bool ret = false;
+
+	assert (nargs <= MAX_CACHE_SCRIPT_ARGS);
+
+	if (!cfg->cache_use_redis) {
+		msg_err ("<%s>; scripts are available only for redis", priv->mlfi_id);
+		return false;
+	}
+
+	serv = rmilter_get_server (cfg, type, key, keylen, priv);
+
+	if (serv == NULL) {
+		return false;
+	}
+
+	argv[0] = "EVALSHA";
+	argvlen[0] = sizeof ("EVALSHA") - 1;
+	argv[1] = sha;
+	argvlen[1] = sizeof (sha) - 1;
+	argv[2] = "1";
+	argvlen[2] = 1;
+	argv[3] = (const char *)key;
+	argvlen[3] = keylen;
+
+	for (i = 0; i < nargs; i ++) {
+		argv[i + 4] = args[i];
+		argvlen[i + 4] = strlen (args[i]);
+	}
+
+	/* The second attempt is done after (re)loading script */
+	for (attempt = 0; attempt < 2; attempt ++) {
+		pthread_mutex_lock (&script_mtx);
+		memcpy (sha, script->sha, sizeof (sha));
+		pthread_mutex_unlock (&script_mtx);
+
+		if (sha[0] == '\0') {
+			if (!rmilter_redis_load_script (cfg, serv, script, priv)) {
+				return false;
+			}
+
+			continue;
+		}
+
+		r = rmilter_redis_command_argv (cfg, serv, priv, nargs + 4, argv,
+				argvlen);
+
+		if (r == NULL) {
+			return false;
+		}
+
+		if (r->type == REDIS_REPLY_ERROR &&
+				strncmp (r->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0) {
+			/* Server has been restarted or script cache has been flushed */
+			freeReplyObject (r);
+			r = NULL;
+
+			if (!rmilter_redis_load_script (cfg, serv, script, priv)) {
+				return false;
+			}
+
+			continue;
+		}
+
+		break;
+	}
+
+	if (r == NULL) {
+		return false;
+	}
+
+	if (r->type == REDIS_REPLY_STRING) {
+		*data = malloc (r->len + 1);
+
+		if (*data) {
+			memcpy (*data, r->str, r->len);
+			(*data)[r->len] = '\0';
+			*datalen = r->len;
+			ret = true;
+		}
+	}
+	else if (r->type == REDIS_REPLY_ERROR) {
+		msg_err ("<%s>; cannot run script on %s:%d: %s", priv->mlfi_id,
+				serv->addr, (int)serv->port, r->str);
+	}
+
+	freeReplyObject (r);
+
+	return ret;
+}
+
+int
+rmilter_set_cache_multi (struct config_file *cfg,
+		struct rmilter_cache_update *updates, unsigned int nupdates,
+		struct mlfi_priv *priv)
+{
+	struct cache_server *serv;
+	struct rmilter_cache_update **owners = NULL;
+	redisReply **replies = NULL;
+	char *buf = NULL, *cmd;
+	size_t buflen, allocated = 0;
+	unsigned int i, j, ncmds;
+	int done = 0, cmdlen;
+	bool ok, aux;
+
+	for (i = 0; i < nupdates; i ++) {
+		/* Values are cached locally once they are stored on the server */
+		if (updates[i].field == NULL && updates[i].data == NULL &&
+				rmilter_lcache_eligible (cfg, updates[i].type)) {
+			rmilter_lcache_remove (updates[i].type, updates[i].key,
+					updates[i].keylen);
+		}
+
+		updates[i].serv = rmilter_get_server (cfg, updates[i].type,
+				updates[i].key, updates[i].keylen, priv);
+		updates[i].done = (updates[i].serv == NULL);
+
+		if (updates[i].serv && cfg->cache_use_redis) {
+			rmilter_replica_written (updates[i].serv, updates[i].type,
+					updates[i].key, updates[i].keylen);
+		}
+	}
+
+	if (!cfg->cache_use_redis) {
+		for (i = 0; i < nupdates; i ++) {
+			if (updates[i].done || updates[i].field) {
+				/* Hashes are not supported by memcached */
+				continue;
+			}
+
+			if (updates[i].data) {
+				ok = rmilter_set_cache (cfg, updates[i].type,
+						updates[i].key, updates[i].keylen,
+						updates[i].data, updates[i].datalen,
+						updates[i].expire, priv);
+			}
+			else {
+				ok = rmilter_delete_cache (cfg, updates[i].type,
+						updates[i].key, updates[i].keylen, priv);
+			}
+
+			if (ok) {
+				done ++;
+			}
+		}
+
+		return done;
+	}
+
+	/* Each update needs two commands at most */
+	replies = malloc (nupdates * 2 * sizeof (*replies));
+	owners = malloc (nupdates * 2 * sizeof (*owners));
+
+	if (replies == NULL || owners == NULL) {
+		msg_err ("<%s>; malloc failed: %s", priv->mlfi_id, strerror (errno));
+		free (replies);
+		free (owners);
+		return 0;
+	}
+
+	for (i = 0; i < nupdates; i ++) {
+		if (updates[i].done) {
+			continue;
+		}
+
+		/* Pipeline all updates that belong to the same server */
+		serv = updates[i].serv;
+		buflen = 0;
+		ncmds = 0;
+		ok = true;
+
+		for (j = i; j < nupdates && ok; j ++) {
+			if (updates[j].done || updates[j].serv != serv) {
+				continue;
+			}
+
+			aux = false;
+
+			if (updates[j].field) {
+				/*
+				 * Hash fields cannot expire, so the whole hash expires in
+				 * `expire` seconds, callers must pass a fixed deadline
+				 * rather than a constant to let the hash expire at all
+				 */
+				if (updates[j].data == NULL) {
+					cmdlen = redisFormatCommand (&cmd, "HDEL %b %b",
+							updates[j].key, updates[j].keylen,
+							updates[j].field, updates[j].fieldlen);
+				}
+				else {
+					cmdlen = redisFormatCommand (&cmd, "HSET %b %b %b",
+							updates[j].key, updates[j].keylen,
+							updates[j].field, updates[j].fieldlen,
+							updates[j].data, updates[j].datalen);
+
+					if (cmdlen >= 0 && updates[j].expire > 0) {
+						ok = rmilter_pipeline_append (&buf, &buflen,
+								&allocated, cmd, cmdlen);
+						redisFreeCommand (cmd);
+						owners[ncmds ++] = &updates[j];
+						aux = true;
+						cmdlen = redisFormatCommand (&cmd, "EXPIRE %b %d",
+								updates[j].key, updates[j].keylen,
+								updates[j].expire);
+					}
+				}
+			}
+			else if (updates[j].data == NULL) {
+				cmdlen = redisFormatCommand (&cmd, "DEL %b",
+						updates[j].key, updates[j].keylen);
+			}
+			else if (updates[j].expire > 0) {
+				cmdlen = redisFormatCommand (&cmd, "SETEX %b %d %b",
+						updates[j].key, updates[j].keylen, updates[j].expire,
+						updates[j].data, updates[j].datalen);
+			}
+			else {
+				cmdlen = redisFormatCommand (&cmd, "SET %b %b",
+						updates[j].key, updates[j].keylen,
+						updates[j].data, updates[j].datalen);
+			}
+
+			ok = ok && rmilter_pipeline_append (&buf, &buflen, &allocated,
+					cmd, cmdlen);
+
+			if (cmdlen >= 0) {
+				redisFreeCommand (cmd);
+			}
+
+			updates[j].done = true;
+			owners[ncmds ++] = aux ? NULL : &updates[j];
+		}
+
+		if (!ok) {
+			msg_err ("<%s>; cannot format redis pipeline", priv->mlfi_id);
+			break;
+		}
+
+		if (rmilter_redis_pipeline (cfg, serv, priv, buf, buflen, ncmds,
+				replies)) {
+			for (j = 0; j < ncmds; j ++) {
+				/* Auxiliary commands have no owner */
+				if (owners[j] && replies[j]->type != REDIS_REPLY_ERROR) {
+					done ++;
+
+					if (owners[j]->data && owners[j]->field == NULL &&
+							rmilter_lcache_eligible (cfg, owners[j]->type)) {
+						rmilter_lcache_insert (cfg, owners[j]->type,
+								owners[j]->key, owners[j]->keylen,
+								owners[j]->data, owners[j]->datalen,
+								owners[j]->expire);
+					}
+				}
+
+				freeReplyObject (replies[j]);
+			}
 		}
-		break;
 	}
 
-	if (ptr) {
-		serv = (struct cache_server *)get_upstream_master_slave (ptr, mlen,
-				sizeof (*serv), time (NULL),
-				cfg->cache_error_time, cfg->cache_dead_time,
-				cfg->cache_maxerrors, priv);
-	}
+	free (buf);
+	free (replies);
+	free (owners);
 
-	return serv;
+	return done;
 }
 
-#ifdef WITH_MEMCACHED
-static void
-rmilter_format_libmemcached_config (struct config_file *cfg,
-		struct cache_server *serv,
-		memcached_st *ctx)
+int
+rmilter_eval_cache_multi (struct config_file *cfg, enum rmilter_query_type type,
+		struct rmilter_cache_script *script,
+		struct rmilter_cache_eval *evals, unsigned int nevals,
+		struct mlfi_priv *priv)
 {
-	if (serv->addr[0] == '/' || serv->addr[0] == '.') {
-		/* Assume unix socket */
-		memcached_server_add_unix_socket (ctx, serv->addr);
+	struct cache_server *serv;
+	redisReply **replies = NULL;
+	const char *argv[MAX_CACHE_SCRIPT_ARGS + 4];
+	size_t argvlen[MAX_CACHE_SCRIPT_ARGS + 4];
+	char sha[sizeof (script->sha)], *buf = NULL, *cmd;
+	size_t buflen, allocated = 0;
+	unsigned int i, j, k, ncmds, *idx = NULL;
+	int done = 0, cmdlen, attempt;
+	bool ok, noscript;
+
+	if (!cfg->cache_use_redis) {
+		msg_err ("<%s>; scripts are available only for redis", priv->mlfi_id);
+		return 0;
 	}
-	else {
-		memcached_server_add (ctx, serv->addr, serv->port);
+
+	for (i = 0; i < nevals; i ++) {
+		assert (evals[i].nargs <= MAX_CACHE_SCRIPT_ARGS);
+		evals[i].data = NULL;
+		evals[i].datalen = 0;
+		evals[i].serv = rmilter_get_server (cfg, type,
+				evals[i].key, evals[i].keylen, priv);
+		evals[i].done = (evals[i].serv == NULL);
 	}
 
-	memcached_behavior_set (ctx, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
-			cfg->cache_connect_timeout);
-	memcached_behavior_set (ctx, MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
-				cfg->cache_connect_timeout);
-}
-#endif
+	replies = malloc (nevals * sizeof (*replies));
+	idx = malloc (nevals * sizeof (*idx));
 
-bool
-rmilter_query_cache (struct config_file *cfg, enum rmilter_query_type type,
-		const unsigned char *key, size_t keylen,
-		unsigned char **data, size_t *datalen, struct mlfi_priv *priv)
-{
-	struct cache_server *serv;
-	redisContext *redis;
-	redisReply *r = NULL;
-	struct timeval tv;
-	bool ret = false;
-	size_t nelems = 1;
-	int rep;
+	if (replies == NULL || idx == NULL) {
+		msg_err ("<%s>; malloc failed: %s", priv->mlfi_id, strerror (errno));
+		goto end;
+	}
 
-	serv = rmilter_get_server (cfg, type, key, keylen, priv);
+	argv[0] = "EVALSHA";
+	argvlen[0] = sizeof ("EVALSHA") - 1;
+	argv[1] = sha;
+	argvlen[1] = sizeof (sha) - 1;
+	argv[2] = "1";
+	argvlen[2] = 1;
 
-	if (serv) {
-		if (cfg->cache_use_redis) {
-			/* Special workaround */
-			if (serv->port == DEFAULT_MEMCACHED_PORT) {
-				serv->port = DEFAULT_REDIS_PORT;
-			}
+	for (i = 0; i < nevals; i ++) {
+		if (evals[i].done) {
+			continue;
+		}
 
-			msec_to_tv (cfg->cache_connect_timeout, &tv);
-			redis = redisConnectWithTimeout (serv->addr, serv->port, tv);
+		serv = evals[i].serv;
 
-			if (redis == NULL || redis->err != 0) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-					(int)serv->port, redis ? redis->errstr : "unknown error");
-				upstream_fail (&serv->up, time (NULL));
+		/* The second attempt is done after (re)loading script */
+		for (attempt = 0; attempt < 2; attempt ++) {
+			pthread_mutex_lock (&script_mtx);
+			memcpy (sha, script->sha, sizeof (sha));
+			pthread_mutex_unlock (&script_mtx);
 
-				if (redis) {
-					redisFree (redis);
+			if (sha[0] == '\0') {
+				if (!rmilter_redis_load_script (cfg, serv, script, priv)) {
+					goto end;
 				}
 
-				return false;
+				continue;
 			}
-			else {
-				rep = 1;
-				if (cfg->cache_password) {
-					redisAppendCommand (redis, "AUTH %s",
-							cfg->cache_password);
-					rep ++;
-				}
-				if (cfg->cache_dbname) {
-					redisAppendCommand (redis, "SELECT %s",
-							cfg->cache_dbname);
-					rep ++;
-				}
 
-				redisAppendCommand (redis, "GET %b", key, keylen);
+			buflen = 0;
+			ncmds = 0;
+			ok = true;
+
+			for (j = i; j < nevals && ok; j ++) {
+				if (evals[j].done || evals[j].serv != serv ||
+						evals[j].data != NULL) {
+					continue;
+				}
 
-				while (rep > 0) {
-					redisGetReply (redis, (void **)&r);
+				argv[3] = (const char *)evals[j].key;
+				argvlen[3] = evals[j].keylen;
 
-					/* Ignore all replies but the last one */
-					if (r != NULL && rep != 1) {
-						freeReplyObject (r);
-						r = NULL;
-					}
-					rep --;
+				for (k = 0; k < evals[j].nargs; k ++) {
+					argv[k + 4] = evals[j].args[k];
+					argvlen[k + 4] = strlen (evals[j].args[k]);
 				}
 
-				if (r != NULL) {
-					if (r->type == REDIS_REPLY_STRING && r->len > 0) {
-						*data = malloc (r->len);
-						if (*data) {
-							memcpy (*data, r->str, r->len);
-							ret = true;
-							if (*datalen) {
-								*datalen = r->len;
-							}
-						}
-					}
+				cmdlen = redisFormatCommandArgv (&cmd, evals[j].nargs + 4,
+						argv, argvlen);
+				ok = rmilter_pipeline_append (&buf, &buflen, &allocated, cmd,
+						cmdlen);
 
-					freeReplyObject (r);
+				if (cmdlen >= 0) {
+					redisFreeCommand (cmd);
 				}
 
-				redisFree (redis);
-				upstream_ok (&serv->up, time (NULL));
+				idx[ncmds ++] = j;
 			}
-		}
-		else {
-#ifdef WITH_MEMCACHED
-			char *kval;
-			size_t value_len = 0;
-			uint32_t mflags;
-			int mret;
-			memcached_st *mctx;
-
-			mctx = memcached_create (NULL);
-			rmilter_format_libmemcached_config (cfg, serv, mctx);
 
-			if (mctx == NULL) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-					(int)serv->port, strerror (errno));
-				upstream_fail (&serv->up, time (NULL));
+			if (!ok) {
+				msg_err ("<%s>; cannot format redis pipeline", priv->mlfi_id);
+				goto end;
+			}
 
-				return false;
+			if (!rmilter_redis_pipeline (cfg, serv, priv, buf, buflen, ncmds,
+					replies)) {
+				break;
 			}
 
-			kval = memcached_get (mctx, key, keylen,
-					&value_len, &mflags, &mret);
+			noscript = false;
 
-			if (!compat_memcached_success (mret)) {
-				if (kval) {
-					free (kval);
-				}
-				*datalen = 0;
+			for (j = 0; j < ncmds; j ++) {
+				struct rmilter_cache_eval *ev = &evals[idx[j]];
+				redisReply *r = replies[j];
 
-				if (compat_memcached_fatal (mret)) {
-					msg_err ("<%s>; cannot get key on %s:%d: %s", priv->mlfi_id, serv->addr,
-						(int)serv->port, memcached_strerror (mctx, mret));
-					upstream_fail (&serv->up, time (NULL));
+				if (r->type == REDIS_REPLY_STRING) {
+					/* Script has run, so it must not be run again anyway */
+					ev->done = true;
+					ev->data = malloc (r->len + 1);
+
+					if (ev->data) {
+						memcpy (ev->data, r->str, r->len);
+						ev->data[r->len] = '\0';
+						ev->datalen = r->len;
+						done ++;
+					}
+				}
+				else if (r->type == REDIS_REPLY_ERROR &&
+						strncmp (r->str, "NOSCRIPT", sizeof ("NOSCRIPT") - 1) == 0) {
+					/* Leave it for the second attempt */
+					noscript = true;
 				}
 				else {
-					upstream_ok (&serv->up, time (NULL));
+					ev->done = true;
+
+					if (r->type == REDIS_REPLY_ERROR) {
+						msg_err ("<%s>; cannot run script on %s:%d: %s",
+								priv->mlfi_id, serv->addr, (int)serv->port,
+								r->str);
+					}
 				}
+
+				freeReplyObject (r);
 			}
-			else {
-				*data = kval;
-				*datalen = value_len;
-				upstream_ok (&serv->up, time (NULL));
-				ret = true;
+
+			if (!noscript ||
+					!rmilter_redis_load_script (cfg, serv, script, priv)) {
+				break;
 			}
+		}
 
-			memcached_free (mctx);
-#else
-			msg_err ("<%s>; memcached query requested when memcached support is"
-					" not compiled", priv->mlfi_id);
-#endif
+		/* Skip the rest of evals for this server */
+		for (j = i; j < nevals; j ++) {
+			if (evals[j].serv == serv) {
+				evals[j].done = true;
+			}
 		}
 	}
 
-	return ret;
+end:
+	free (buf);
+	free (replies);
+	free (idx);
+
+	return done;
 }
 
 bool
@@ -312,110 +2052,78 @@ rmilter_set_cache (struct config_file *cfg, enum rmilter_query_type type ,
 		unsigned expire, struct mlfi_priv *priv)
 {
 	struct cache_server *serv;
-	redisContext *redis;
-	redisReply *r = NULL;
-	struct timeval tv;
-	size_t nelems = 1;
-	int rep;
+	redisReply *r;
+	bool ok;
 
 	serv = rmilter_get_server (cfg, type, key, keylen, priv);
 
 	if (serv) {
 		if (cfg->cache_use_redis) {
-			if (serv->port == DEFAULT_MEMCACHED_PORT) {
-				serv->port = DEFAULT_REDIS_PORT;
-			}
-
-			msec_to_tv (cfg->cache_connect_timeout, &tv);
-			redis = redisConnectWithTimeout (serv->addr, serv->port, tv);
-
-			if (redis == NULL || redis->err != 0) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-					(int)serv->port, redis ? redis->errstr : "unknown error");
-				upstream_fail (&serv->up, time (NULL));
+			rmilter_replica_written (serv, type, key, keylen);
 
-				if (redis) {
-					redisFree (redis);
-				}
-
-				return false;
+			if (expire > 0) {
+				r = rmilter_redis_command (cfg, serv, priv, "SETEX %b %d %b",
+						key, keylen, expire, data, datalen);
 			}
 			else {
-				rep = 1;
-				if (cfg->cache_password) {
-					redisAppendCommand (redis, "AUTH %s",
-							cfg->cache_password);
-					rep ++;
-				}
-				if (cfg->cache_dbname) {
-					redisAppendCommand (redis, "SELECT %s",
-							cfg->cache_dbname);
-					rep ++;
-				}
-
-				if (expire > 0) {
-					redisAppendCommand (redis, "SETEX %b %d %b", key, keylen,
-							expire, data, datalen);
-				}
-				else {
-					redisAppendCommand (redis, "SET %b %b", key, keylen,
-							data, datalen);
-				}
-
-				while (rep > 0) {
-					redisGetReply (redis, (void **)&r);
+				r = rmilter_redis_command (cfg, serv, priv, "SET %b %b",
+						key, keylen, data, datalen);
+			}
 
-					/* Ignore all replies but the last one */
-					if (r != NULL && rep != 1) {
-						freeReplyObject (r);
-						r = NULL;
-					}
-					rep --;
-				}
+			if (r == NULL) {
+				return false;
+			}
 
-				if (r != NULL) {
-					freeReplyObject (r);
-				}
+			ok = r->type != REDIS_REPLY_ERROR;
+			freeReplyObject (r);
 
-				redisFree (redis);
-				upstream_ok (&serv->up, time (NULL));
+			if (!ok) {
+				/* Not stored, so it must not be cached locally either */
+				return true;
 			}
 		}
 		else {
 #ifdef WITH_MEMCACHED
-			char *kval;
 			size_t value_len = 0;
 			uint32_t mflags;
 			int mret;
 			memcached_st *mctx;
+			bool noreply;
 
-			mctx = memcached_create (NULL);
-			rmilter_format_libmemcached_config (cfg, serv, mctx);
+			mctx = rmilter_memcached_get (cfg, serv, priv);
 
 			if (mctx == NULL) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-					(int)serv->port, strerror (errno));
-				upstream_fail (&serv->up, time (NULL));
-
 				return false;
 			}
 
+			/*
+			 * Ratelimit buckets are updated on each message and losing an
+			 * update is harmless, so we do not wait for confirmation
+			 */
+			noreply = (type == RMILTER_QUERY_RATELIMIT);
+
+			if (noreply) {
+				memcached_behavior_set (mctx, MEMCACHED_BEHAVIOR_NOREPLY, 1);
+			}
+
 			mret = memcached_set (mctx, key, keylen, data, datalen,
 					expire, 0);
 
+			if (noreply) {
+				memcached_behavior_set (mctx, MEMCACHED_BEHAVIOR_NOREPLY, 0);
+			}
+
 			if (!compat_memcached_success (mret)) {
 				msg_err ("<%s>; cannot set key on %s:%d: %s", priv->mlfi_id, serv->addr,
 					    (int)serv->port, memcached_strerror (mctx, mret));
-				upstream_fail (&serv->up, time (NULL));
-				memcached_free (mctx);
+				rmilter_memcached_error (mctx);
+				rmilter_cache_fail (cfg, serv, priv);
 
 				return false;
 			}
 			else {
-				upstream_ok (&serv->up, time (NULL));
+				rmilter_cache_ok (cfg, serv, priv);
 			}
-
-			memcached_free (mctx);
 #else
 		msg_err ("<%s>; memcached query requested when memcached support is"
 				" not compiled", priv->mlfi_id);
@@ -423,6 +2131,11 @@ rmilter_set_cache (struct config_file *cfg, enum rmilter_query_type type ,
 		}
 	}
 
+	/* Inserted after the write only, so other nodes see the same value */
+	if (rmilter_lcache_eligible (cfg, type)) {
+		rmilter_lcache_insert (cfg, type, key, keylen, data, datalen, expire);
+	}
+
 	return true;
 }
 
@@ -431,68 +2144,24 @@ rmilter_delete_cache (struct config_file *cfg, enum rmilter_query_type type ,
 		const unsigned char *key, size_t keylen, struct mlfi_priv *priv)
 {
 	struct cache_server *serv;
-	redisContext *redis;
-	redisReply *r = NULL;
-	struct timeval tv;
-	size_t nelems = 1;
-	int rep;
+	redisReply *r;
+
+	if (rmilter_lcache_eligible (cfg, type)) {
+		rmilter_lcache_remove (type, key, keylen);
+	}
 
 	serv = rmilter_get_server (cfg, type, key, keylen, priv);
 
 	if (serv) {
 		if (cfg->cache_use_redis) {
-			if (serv->port == DEFAULT_MEMCACHED_PORT) {
-				serv->port = DEFAULT_REDIS_PORT;
-			}
-
-			msec_to_tv (cfg->cache_connect_timeout, &tv);
-			redis = redisConnectWithTimeout (serv->addr, serv->port, tv);
-
-			if (redis == NULL || redis->err != 0) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-						(int)serv->port, redis ? redis->errstr : "unknown error");
-				upstream_fail (&serv->up, time (NULL));
-
-				if (redis) {
-					redisFree (redis);
-				}
+			rmilter_replica_written (serv, type, key, keylen);
+			r = rmilter_redis_command (cfg, serv, priv, "DEL %b", key, keylen);
 
+			if (r == NULL) {
 				return false;
 			}
-			else {
-
-				rep = 1;
-				if (cfg->cache_password) {
-					redisAppendCommand (redis, "AUTH %s",
-							cfg->cache_password);
-					rep ++;
-				}
-				if (cfg->cache_dbname) {
-					redisAppendCommand (redis, "SELECT %s",
-							cfg->cache_dbname);
-					rep ++;
-				}
-
-				redisAppendCommand (redis, "DELETE %b", key, keylen);
-
-				while (rep > 0) {
-					redisGetReply (redis, (void **)&r);
-
-					/* Ignore all replies but the last one */
-					if (r != NULL && rep != 1) {
-						freeReplyObject (r);
-						r = NULL;
-					}
-					rep --;
-				}
-
-				if (r != NULL) {
-					freeReplyObject (r);
-				}
 
-				redisFree (redis);
-				upstream_ok (&serv->up, time (NULL));
-			}
+			freeReplyObject (r);
 		}
 		else {
 #ifdef WITH_MEMCACHED
@@ -502,14 +2171,9 @@ rmilter_delete_cache (struct config_file *cfg, enum rmilter_query_type type ,
 			int mret;
 			memcached_st *mctx;
 
-			mctx = memcached_create (NULL);
-			rmilter_format_libmemcached_config (cfg, serv, mctx);
+			mctx = rmilter_memcached_get (cfg, serv, priv);
 
 			if (mctx == NULL) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-						(int)serv->port, strerror (errno));
-				upstream_fail (&serv->up, time (NULL));
-
 				return false;
 			}
 
@@ -519,15 +2183,14 @@ rmilter_delete_cache (struct config_file *cfg, enum rmilter_query_type type ,
 				if (compat_memcached_fatal (mret)) {
 					msg_err ("<%s>; cannot delete key on %s:%d: %s", priv->mlfi_id, serv->addr,
 							(int)serv->port, memcached_strerror (mctx, mret));
-					upstream_fail (&serv->up, time (NULL));
-					memcached_free (mctx);
+					rmilter_memcached_error (mctx);
+					rmilter_cache_fail (cfg, serv, priv);
 
 					return false;
 				}
 			}
 
-			upstream_ok (&serv->up, time (NULL));
-			memcached_free (mctx);
+			rmilter_cache_ok (cfg, serv, priv);
 #else
 			msg_err ("<%s>; memcached query requested when memcached support is"
 					" not compiled", priv->mlfi_id);
@@ -546,70 +2209,212 @@ rmilter_publish_cache (struct config_file *cfg, enum rmilter_publish_type type,
 		struct mlfi_priv *priv)
 {
 	struct cache_server *serv;
-	redisContext *redis;
-	redisReply *r = NULL;
-	struct timeval tv;
-	size_t nelems = 1;
-	int rep, n = 0;
+	redisReply *r;
+	int n = 0;
 
 	serv = rmilter_get_publish_server (cfg, type, priv);
 
 	if (serv) {
 		if (cfg->cache_use_redis) {
-			if (serv->port == DEFAULT_MEMCACHED_PORT) {
-				serv->port = DEFAULT_REDIS_PORT;
+			r = rmilter_redis_command (cfg, serv, priv, "PUBLISH %b %b",
+					channel, channel_len, data, datalen);
+
+			if (r == NULL) {
+				return -1;
 			}
 
-			msec_to_tv (cfg->cache_connect_timeout, &tv);
-			redis = redisConnectWithTimeout (serv->addr, serv->port, tv);
+			n = r->integer;
+			freeReplyObject (r);
+		}
+		else {
+			msg_err ("<%s>; memcached query requested when pubsub is available "
+					"only for redis", priv->mlfi_id);
 
-			if (redis == NULL || redis->err != 0) {
-				msg_err ("<%s>; cannot connect to %s:%d: %s", priv->mlfi_id, serv->addr,
-					(int)serv->port, redis ? redis->errstr : "unknown error");
-				upstream_fail (&serv->up, time (NULL));
+			return -1;
+		}
+	}
 
-				if (redis) {
-					redisFree (redis);
-				}
+	return n;
+}
 
-				return -1;
+/*
+ * Writes `len` bytes of file `fd` to socket `sock` without copying them to
+ * the user space when possible
+ */
+static bool
+rmilter_redis_send_file (int sock, int fd, size_t len)
+{
+#if defined(FREEBSD) && defined(HAVE_SENDFILE)
+	off_t off = 0, sent;
+
+	while ((size_t)off < len) {
+		sent = 0;
+
+		if (sendfile (fd, sock, off, len - off, NULL, &sent, 0) != 0 &&
+				errno != EINTR) {
+			return false;
+		}
+
+		if (sent == 0 && errno != EINTR) {
+			errno = EPIPE;
+			return false;
+		}
+
+		off += sent;
+	}
+
+	return true;
+#elif defined(LINUX) && defined(HAVE_SENDFILE)
+	off_t off = 0;
+	ssize_t r;
+
+	while ((size_t)off < len) {
+		r = sendfile (sock, fd, &off, len - off);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
-			else {
-				rep = 1;
-				if (cfg->cache_password) {
-					redisAppendCommand (redis, "AUTH %s",
-							cfg->cache_password);
-					rep ++;
-				}
-				if (cfg->cache_dbname) {
-					redisAppendCommand (redis, "SELECT %s",
-							cfg->cache_dbname);
-					rep ++;
-				}
 
+			return false;
+		}
+		else if (r == 0) {
+			errno = EPIPE;
+			return false;
+		}
+	}
+
+	return true;
+#else
+	void *map;
+	bool ret;
 
-				redisAppendCommand (redis, "PUBLISH %b %b", channel, channel_len,
-						data, datalen);
+	map = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
 
-				while (rep > 0) {
-					redisGetReply (redis, (void **)&r);
+	if (map == MAP_FAILED) {
+		return false;
+	}
 
-					/* Ignore all replies but the last one */
-					if (r != NULL && rep != 1) {
-						freeReplyObject (r);
-						r = NULL;
-					}
-					rep --;
-				}
+	ret = rmilter_atomic_write (sock, map, len) != -1;
+	munmap (map, len);
 
-				if (r != NULL) {
-					n = r->integer;
-					freeReplyObject (r);
-				}
+	return ret;
+#endif
+}
+
+/*
+ * Sends PUBLISH command with the content of the file as the message. The
+ * command header is written to the socket directly, then the file is sent
+ * by sendfile, so the message is never copied to the command buffer.
+ */
+static redisReply *
+rmilter_redis_publish_file (struct config_file *cfg, struct cache_server *serv,
+		const unsigned char *channel, size_t channel_len, int fd, size_t len,
+		struct mlfi_priv *priv)
+{
+	redisContext *redis;
+	redisReply *r = NULL;
+	char *hdr;
+	size_t hdrlen, allocated;
+	int attempt, err = 0;
+	bool pooled, ok;
+
+	if (!rmilter_breaker_allow (cfg, serv, priv)) {
+		return NULL;
+	}
+
+	allocated = channel_len + 64;
+	hdr = malloc (allocated);
+
+	if (hdr == NULL) {
+		return NULL;
+	}
+
+	hdrlen = snprintf (hdr, allocated, "*3\r\n$7\r\nPUBLISH\r\n$%zu\r\n",
+			channel_len);
+	memcpy (hdr + hdrlen, channel, channel_len);
+	hdrlen += channel_len;
+	hdrlen += snprintf (hdr + hdrlen, allocated - hdrlen,
+			"\r\n$%zu\r\n", len);
+
+	for (attempt = 0; attempt < 2; attempt ++) {
+		redis = rmilter_redis_get (cfg, serv, priv, &pooled);
 
-				redisFree (redis);
-				upstream_ok (&serv->up, time (NULL));
+		if (redis == NULL) {
+			break;
+		}
+
+		ok = rmilter_atomic_write (redis->fd, hdr, hdrlen) != -1 &&
+				rmilter_redis_send_file (redis->fd, fd, len) &&
+				rmilter_atomic_write (redis->fd, "\r\n", 2) != -1;
+
+		if (!ok) {
+			err = errno;
+			redis->err = REDIS_ERR_IO;
+			rmilter_strlcpy (redis->errstr, strerror (errno),
+					sizeof (redis->errstr));
+		}
+		else if (redisGetReply (redis, (void **)&r) == REDIS_OK && r != NULL) {
+			rmilter_redis_release (cfg, serv, redis, false);
+			rmilter_cache_ok (cfg, serv, priv);
+			free (hdr);
+
+			return r;
+		}
+		else {
+			err = errno;
+		}
+
+		if (!pooled || !rmilter_redis_conn_closed (redis, err)) {
+			msg_err ("<%s>; cannot publish to %s:%d: %s", priv->mlfi_id,
+					serv->addr, (int)serv->port, redis->errstr);
+			rmilter_redis_release (cfg, serv, redis, true);
+			break;
+		}
+
+		msg_info ("<%s>; persistent connection to %s:%d is broken: %s, "
+				"reconnecting", priv->mlfi_id, serv->addr,
+				(int)serv->port, redis->errstr);
+		rmilter_redis_release (cfg, serv, redis, true);
+	}
+
+	free (hdr);
+	rmilter_cache_fail (cfg, serv, priv);
+
+	return NULL;
+}
+
+int
+rmilter_publish_cache_file (struct config_file *cfg,
+		enum rmilter_publish_type type,
+		const unsigned char *channel, size_t channel_len,
+		int fd, size_t len, struct mlfi_priv *priv)
+{
+	struct cache_server *serv;
+	redisReply *r;
+	int n = 0;
+
+	serv = rmilter_get_publish_server (cfg, type, priv);
+
+	if (serv) {
+		if (cfg->cache_use_redis) {
+			r = rmilter_redis_publish_file (cfg, serv, channel, channel_len,
+					fd, len, priv);
+
+			if (r == NULL) {
+				return -1;
+			}
+
+			if (r->type == REDIS_REPLY_ERROR) {
+				msg_err ("<%s>; cannot publish to %s:%d: %s", priv->mlfi_id,
+						serv->addr, (int)serv->port, r->str);
+				freeReplyObject (r);
+
+				return -1;
 			}
+
+			n = r->integer;
+			freeReplyObject (r);
 		}
 		else {
 			msg_err ("<%s>; memcached query requested when pubsub is available "
@@ -33,6 +33,9 @@
 #define MAXKEYLEN 250
 #endif
 
+/* Maximum number of arguments passed to a cache script */
+#define MAX_CACHE_SCRIPT_ARGS 8
+
 struct config_file;
 struct mlfi_priv;
 
@@ -48,6 +51,61 @@ enum rmilter_publish_type {
 	RMILTER_PUBLISH_SPAM,
 };
 
+struct cache_server;
+
+struct rmilter_cache_query {
+	enum rmilter_query_type type;
+	const unsigned char *key;
+	size_t keylen;
+	const unsigned char *field;	/* if not NULL, key is a hash (redis only) */
+	size_t fieldlen;
+	unsigned char *data;		/* value found (must be freed by a caller) */
+	size_t datalen;
+	/* Private fields */
+	struct cache_server *serv;
+	bool done;
+};
+
+struct rmilter_cache_update {
+	enum rmilter_query_type type;
+	const unsigned char *key;
+	size_t keylen;
+	const unsigned char *field;	/* if not NULL, key is a hash (redis only) */
+	size_t fieldlen;
+	const unsigned char *data;	/* NULL means that key should be deleted */
+	size_t datalen;
+	unsigned expire;
+	/* Private fields */
+	struct cache_server *serv;
+	bool done;
+};
+
+struct rmilter_cache_eval {
+	const unsigned char *key;
+	size_t keylen;
+	unsigned int nargs;
+	const char **args;
+	unsigned char *data;		/* string returned (must be freed by a caller) */
+	size_t datalen;
+	/* Private fields */
+	struct cache_server *serv;
+	bool done;
+};
+
+struct rmilter_cache_script {
+	const char *body;			/* lua source */
+	char sha[41];				/* sha1 of the loaded script */
+};
+
+struct rmilter_cache_stat {
+	uint64_t pool_hits;			/* requests served by a persistent connection */
+	uint64_t pool_misses;		/* new connections established */
+	uint64_t pool_reconnects;	/* stale or broken connections replaced */
+	uint64_t pool_errors;		/* connections dropped due to I/O errors */
+	uint64_t breaker_trips;		/* circuit breakers opened */
+	uint64_t breaker_rejects;	/* requests failed by open breakers */
+};
+
 /**
  * Query cache (preferring redis) for the specified key
  * @param cfg
@@ -63,10 +121,81 @@ bool rmilter_query_cache (struct config_file *cfg, enum rmilter_query_type type,
 		const unsigned char *key, size_t keylen,
 		unsigned char **data, size_t *datalen, struct mlfi_priv *priv);
 
+/**
+ * Query cache for several keys at once. Keys are grouped by the server they
+ * are mapped to and each group is requested by a single command, so the
+ * whole query costs one round trip per server.
+ * @param cfg
+ * @param queries array of queries, `data` and `datalen` are filled for the
+ * keys found (`data` is NULL otherwise)
+ * @param nqueries number of queries
+ * @param priv pointer to useful information from milter protocol
+ * @return number of keys found
+ */
+int rmilter_query_cache_multi (struct config_file *cfg,
+		struct rmilter_cache_query *queries, unsigned int nqueries,
+		struct mlfi_priv *priv);
+
+/**
+ * Similar to rmilter_query_cache_multi but stops sending requests to other
+ * servers as soon as some key is found
+ * @return index of the first query found in `queries` or -1
+ */
+int rmilter_query_cache_first (struct config_file *cfg,
+		struct rmilter_cache_query *queries, unsigned int nqueries,
+		struct mlfi_priv *priv);
+
 bool rmilter_set_cache (struct config_file *cfg, enum rmilter_query_type type ,
 		const unsigned char *key, size_t keylen,
 		const unsigned char *data, size_t datalen, unsigned expire, struct mlfi_priv *priv);
 
+/**
+ * Run lua script on the server that owns the specified key. The script is
+ * loaded on the first use (or when the server reports that it is unknown)
+ * and is then called by its digest. The script receives `key` as KEYS[1] and
+ * `args` as ARGV and should return a string.
+ * @param cfg
+ * @param type type of query (used to select servers)
+ * @param script script to run
+ * @param key key to operate on
+ * @param keylen length of the key
+ * @param nargs number of arguments (no more than MAX_CACHE_SCRIPT_ARGS)
+ * @param args array of `nargs` arguments
+ * @param data zero terminated string returned (must be freed by a caller)
+ * @param datalen pointer to length of data (out)
+ * @param priv pointer to useful information from milter protocol
+ * @return true if the script returned a string
+ */
+bool rmilter_eval_cache (struct config_file *cfg, enum rmilter_query_type type,
+		struct rmilter_cache_script *script,
+		const unsigned char *key, size_t keylen,
+		unsigned int nargs, const char **args,
+		unsigned char **data, size_t *datalen, struct mlfi_priv *priv);
+
+/**
+ * Set or delete several keys at once, all updates for the same server are
+ * sent as a single pipeline.
+ * @param cfg
+ * @param updates array of updates
+ * @param nupdates number of updates
+ * @param priv pointer to useful information from milter protocol
+ * @return number of updates succeeded
+ */
+int rmilter_set_cache_multi (struct config_file *cfg,
+		struct rmilter_cache_update *updates, unsigned int nupdates,
+		struct mlfi_priv *priv);
+
+/**
+ * Run script for several keys at once, all calls for the same server are sent
+ * as a single pipeline. `data` and `datalen` are filled for the calls
+ * succeeded.
+ * @return number of calls succeeded
+ */
+int rmilter_eval_cache_multi (struct config_file *cfg,
+		enum rmilter_query_type type, struct rmilter_cache_script *script,
+		struct rmilter_cache_eval *evals, unsigned int nevals,
+		struct mlfi_priv *priv);
+
 bool rmilter_delete_cache (struct config_file *cfg, enum rmilter_query_type type ,
 		const unsigned char *key, size_t keylen, struct mlfi_priv *priv);
 
@@ -74,4 +203,28 @@ int rmilter_publish_cache (struct config_file *cfg, enum rmilter_publish_type ty
 		const unsigned char *channel, size_t channel_len,
 		const unsigned char *data, size_t datalen, struct mlfi_priv *priv);
 
+/**
+ * Publish content of the file to the channel. Unlike rmilter_publish_cache,
+ * the message is streamed from the file to the server socket without being
+ * copied to a command buffer, so it is suitable for large messages.
+ * @param cfg
+ * @param type type of channel
+ * @param channel channel name
+ * @param channel_len length of channel name
+ * @param fd file to send
+ * @param len number of bytes to send from the beginning of the file
+ * @param priv pointer to useful information from milter protocol
+ * @return number of clients received message or -1 in case of error
+ */
+int rmilter_publish_cache_file (struct config_file *cfg,
+		enum rmilter_publish_type type,
+		const unsigned char *channel, size_t channel_len,
+		int fd, size_t len, struct mlfi_priv *priv);
+
+/**
+ * Get a snapshot of the cache layer statistics
+ * @param st output structure
+ */
+void rmilter_cache_get_stat (struct rmilter_cache_stat *st);
+
 #endif /* INCLUDE_CACHE_H_ */
@@ -0,0 +1,727 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+#include "cfg_file.h"
+#include "cache_async.h"
+#include "rmilter.h"
+#include "resolver.h"
+#include "util.h"
+#include "utlist.h"
+#include "async.h"
+#include <poll.h>
+
+/*
+ * Cache I/O thread: milter threads put requests to the queue and sleep until
+ * the request is completed or its deadline is reached. The I/O thread takes
+ * all queued requests at once, appends their commands to the output buffers
+ * of a small number of redis connections and flushes every buffer by a single
+ * write, so commands of concurrent sessions are coalesced. Replies are matched
+ * to requests by hiredis callbacks.
+ */
+#define ASYNC_POLL_TIMEOUT 1000
+#define ASYNC_TICK 100
+#define ASYNC_MAX_CONNS 256
+
+struct rmilter_async_req {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	int ref;
+	bool done;
+	bool failed;
+	char *cmd;
+	size_t len;
+	unsigned int ncmds;
+	unsigned int nrecv;
+	redisReply **replies;
+	/* Target server, copied as the config can be reloaded */
+	char *addr;
+	int port;
+	/* Cached address of server to connect to, empty for unix sockets */
+	char ip[INET6_ADDRSTRLEN];
+	char *password;
+	char *dbname;
+	unsigned int serial;
+	unsigned int nconns;
+	unsigned int timeout;
+	unsigned int idle_timeout;
+	struct rmilter_async_req *next;
+};
+
+struct rmilter_async_conn {
+	redisAsyncContext *ac;
+	char *addr;
+	int port;
+	unsigned int serial;
+	unsigned int slot;
+	unsigned int timeout;
+	unsigned int idle_timeout;
+	unsigned int pending;
+	uint64_t last_progress;
+	uint64_t last_used;
+	bool reading;
+	bool writing;
+	struct rmilter_async_conn *prev, *next;
+};
+
+static pthread_mutex_t queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct rmilter_async_req *queue = NULL;
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+static bool async_running = false;
+static int wake_pipe[2] = {-1, -1};
+
+/* Owned by I/O thread */
+static struct rmilter_async_conn *conns = NULL;
+static unsigned int conns_serial = 0;
+static unsigned int conns_rr = 0;
+
+static struct rmilter_cache_async_stat async_stat;
+
+#define ASYNC_STAT_INC(field) __sync_fetch_and_add (&async_stat.field, 1)
+
+static uint64_t
+rmilter_async_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+rmilter_async_req_unref (struct rmilter_async_req *req)
+{
+	unsigned int i;
+	int ref;
+
+	pthread_mutex_lock (&req->mtx);
+	ref = --req->ref;
+	pthread_mutex_unlock (&req->mtx);
+
+	if (ref > 0) {
+		return;
+	}
+
+	for (i = 0; i < req->ncmds; i ++) {
+		if (req->replies[i]) {
+			freeReplyObject (req->replies[i]);
+		}
+	}
+
+	pthread_mutex_destroy (&req->mtx);
+	pthread_cond_destroy (&req->cond);
+	free (req->replies);
+	free (req->cmd);
+	free (req->addr);
+	free (req->password);
+	free (req->dbname);
+	free (req);
+}
+
+static void
+rmilter_async_req_complete (struct rmilter_async_req *req)
+{
+	pthread_mutex_lock (&req->mtx);
+	req->done = true;
+	pthread_cond_signal (&req->cond);
+	pthread_mutex_unlock (&req->mtx);
+
+	rmilter_async_req_unref (req);
+}
+
+/*
+ * Hiredis frees reply after the callback returns, so we move its content to
+ * a new object leaving an empty shell to be freed
+ */
+static redisReply *
+rmilter_async_steal_reply (redisReply *r)
+{
+	redisReply *nr;
+
+	nr = malloc (sizeof (*nr));
+
+	if (nr == NULL) {
+		return NULL;
+	}
+
+	memcpy (nr, r, sizeof (*nr));
+	r->type = REDIS_REPLY_NIL;
+	r->str = NULL;
+	r->len = 0;
+	r->element = NULL;
+	r->elements = 0;
+
+	return nr;
+}
+
+static void
+rmilter_async_reply_cb (redisAsyncContext *ac, void *r, void *ud)
+{
+	struct rmilter_async_req *req = ud;
+	struct rmilter_async_conn *conn = ac->data;
+	redisReply *reply = r;
+
+	if (conn) {
+		conn->pending --;
+		conn->last_progress = rmilter_async_now ();
+	}
+
+	if (reply == NULL) {
+		req->failed = true;
+	}
+	else if (!req->failed) {
+		req->replies[req->nrecv] = rmilter_async_steal_reply (reply);
+
+		if (req->replies[req->nrecv] == NULL) {
+			req->failed = true;
+		}
+	}
+
+	req->nrecv ++;
+
+	if (req->nrecv == req->ncmds) {
+		if (req->failed) {
+			ASYNC_STAT_INC (errors);
+		}
+
+		rmilter_async_req_complete (req);
+	}
+}
+
+static void
+rmilter_async_prepare_cb (redisAsyncContext *ac, void *r, void *ud)
+{
+	struct rmilter_async_conn *conn = ac->data;
+	redisReply *reply = r;
+
+	if (conn) {
+		conn->pending --;
+		conn->last_progress = rmilter_async_now ();
+
+		if (reply && reply->type == REDIS_REPLY_ERROR) {
+			msg_err ("cache_async: cannot setup connection to %s:%d: %s",
+					conn->addr, conn->port, reply->str);
+		}
+	}
+}
+
+/* Event loop hooks */
+static void
+rmilter_async_add_read (void *data)
+{
+	struct rmilter_async_conn *conn = data;
+
+	conn->reading = true;
+}
+
+static void
+rmilter_async_del_read (void *data)
+{
+	struct rmilter_async_conn *conn = data;
+
+	conn->reading = false;
+}
+
+static void
+rmilter_async_add_write (void *data)
+{
+	struct rmilter_async_conn *conn = data;
+
+	conn->writing = true;
+}
+
+static void
+rmilter_async_del_write (void *data)
+{
+	struct rmilter_async_conn *conn = data;
+
+	conn->writing = false;
+}
+
+static void
+rmilter_async_cleanup (void *data)
+{
+	struct rmilter_async_conn *conn = data;
+
+	/* Context is being freed by hiredis */
+	conn->reading = false;
+	conn->writing = false;
+	conn->ac = NULL;
+}
+
+static void
+rmilter_async_connect_cb (const redisAsyncContext *ac, int status)
+{
+	struct rmilter_async_conn *conn = ac->data;
+
+	if (conn && status != REDIS_OK) {
+		msg_err ("cache_async: cannot connect to %s:%d: %s", conn->addr,
+				conn->port, ac->errstr);
+	}
+}
+
+static void
+rmilter_async_disconnect_cb (const redisAsyncContext *ac, int status)
+{
+	struct rmilter_async_conn *conn = ac->data;
+
+	if (conn && status != REDIS_OK) {
+		msg_info ("cache_async: connection to %s:%d is broken: %s",
+				conn->addr, conn->port, ac->errstr);
+	}
+}
+
+static struct rmilter_async_conn *
+rmilter_async_conn_new (struct rmilter_async_req *req, unsigned int slot,
+		uint64_t now)
+{
+	struct rmilter_async_conn *conn;
+	redisAsyncContext *ac;
+
+	if (req->addr[0] == '/' || req->addr[0] == '.') {
+		ac = redisAsyncConnectUnix (req->addr);
+	}
+	else {
+		ac = redisAsyncConnect (req->ip[0] ? req->ip : req->addr, req->port);
+	}
+
+	if (ac == NULL || ac->err != 0) {
+		msg_err ("cache_async: cannot connect to %s:%d: %s", req->addr,
+				req->port, ac ? ac->errstr : "unknown error");
+
+		if (ac) {
+			redisAsyncFree (ac);
+		}
+
+		return NULL;
+	}
+
+	conn = calloc (1, sizeof (*conn));
+
+	if (conn == NULL || (conn->addr = strdup (req->addr)) == NULL) {
+		free (conn);
+		redisAsyncFree (ac);
+
+		return NULL;
+	}
+
+	conn->ac = ac;
+	conn->port = req->port;
+	conn->serial = req->serial;
+	conn->slot = slot;
+	conn->timeout = req->timeout;
+	conn->idle_timeout = req->idle_timeout;
+	conn->last_used = now;
+	conn->last_progress = now;
+
+	ac->data = conn;
+	ac->ev.data = conn;
+	ac->ev.addRead = rmilter_async_add_read;
+	ac->ev.delRead = rmilter_async_del_read;
+	ac->ev.addWrite = rmilter_async_add_write;
+	ac->ev.delWrite = rmilter_async_del_write;
+	ac->ev.cleanup = rmilter_async_cleanup;
+	redisAsyncSetConnectCallback (ac, rmilter_async_connect_cb);
+	redisAsyncSetDisconnectCallback (ac, rmilter_async_disconnect_cb);
+
+	/* These commands are queued before any request */
+	if (req->password) {
+		if (redisAsyncCommand (ac, rmilter_async_prepare_cb, NULL, "AUTH %s",
+				req->password) == REDIS_OK) {
+			conn->pending ++;
+		}
+	}
+	if (req->dbname) {
+		if (redisAsyncCommand (ac, rmilter_async_prepare_cb, NULL, "SELECT %s",
+				req->dbname) == REDIS_OK) {
+			conn->pending ++;
+		}
+	}
+
+	DL_APPEND (conns, conn);
+	ASYNC_STAT_INC (connections);
+
+	return conn;
+}
+
+static struct rmilter_async_conn *
+rmilter_async_conn_get (struct rmilter_async_req *req, uint64_t now)
+{
+	struct rmilter_async_conn *conn;
+	unsigned int slot;
+
+	slot = conns_rr ++ % req->nconns;
+
+	DL_FOREACH (conns, conn) {
+		if (conn->ac && conn->serial == req->serial && conn->slot == slot &&
+				conn->port == req->port && strcmp (conn->addr, req->addr) == 0) {
+			return conn;
+		}
+	}
+
+	return rmilter_async_conn_new (req, slot, now);
+}
+
+static void
+rmilter_async_dispatch (struct rmilter_async_req *req, uint64_t now)
+{
+	struct rmilter_async_conn *conn;
+	const char *p;
+	size_t remain, cmdlen;
+	unsigned int sent = 0;
+
+	if (req->serial != conns_serial) {
+		/* Config has been reloaded, old connections are closed when idle */
+		conns_serial = req->serial;
+	}
+
+	conn = rmilter_async_conn_get (req, now);
+
+	if (conn != NULL) {
+		p = req->cmd;
+		remain = req->len;
+
+		while (sent < req->ncmds && conn->ac) {
+			cmdlen = rmilter_resp_cmdlen (p, remain);
+
+			if (cmdlen == 0 || redisAsyncFormattedCommand (conn->ac,
+					rmilter_async_reply_cb, req, p, cmdlen) != REDIS_OK) {
+				break;
+			}
+
+			if (conn->pending ++ == 0) {
+				conn->last_progress = now;
+			}
+
+			p += cmdlen;
+			remain -= cmdlen;
+			sent ++;
+		}
+
+		conn->last_used = now;
+	}
+
+	if (sent < req->ncmds) {
+		/* Commands that have not been sent are considered as failed */
+		req->failed = true;
+		req->nrecv += req->ncmds - sent;
+
+		if (sent == 0) {
+			ASYNC_STAT_INC (errors);
+			rmilter_async_req_complete (req);
+		}
+	}
+}
+
+static void
+rmilter_async_process_queue (void)
+{
+	struct rmilter_async_req *reqs, *req, *tmp;
+	char buf[64];
+	uint64_t now;
+
+	while (read (wake_pipe[0], buf, sizeof (buf)) > 0);
+
+	pthread_mutex_lock (&queue_mtx);
+	reqs = queue;
+	queue = NULL;
+	pthread_mutex_unlock (&queue_mtx);
+
+	now = rmilter_async_now ();
+
+	LL_FOREACH_SAFE (reqs, req, tmp) {
+		req->next = NULL;
+		rmilter_async_dispatch (req, now);
+	}
+}
+
+/*
+ * Closes connections that are broken, stuck, idle or belong to the previous
+ * configuration
+ */
+static void
+rmilter_async_sweep (uint64_t now)
+{
+	struct rmilter_async_conn *conn, *tmp;
+
+	DL_FOREACH_SAFE (conns, conn, tmp) {
+		if (conn->ac) {
+			if (conn->pending > 0) {
+				if (now - conn->last_progress > conn->timeout) {
+					msg_err ("cache_async: no reply from %s:%d for %u ms, "
+							"closing connection", conn->addr, conn->port,
+							(unsigned)(now - conn->last_progress));
+					/* Pending callbacks are called with NULL reply */
+					redisAsyncFree (conn->ac);
+				}
+			}
+			else if (conn->serial != conns_serial ||
+					now - conn->last_used > conn->idle_timeout) {
+				redisAsyncFree (conn->ac);
+			}
+		}
+
+		if (conn->ac == NULL) {
+			DL_DELETE (conns, conn);
+			free (conn->addr);
+			free (conn);
+		}
+	}
+}
+
+static void *
+rmilter_async_thread (void *unused)
+{
+	struct pollfd pfds[ASYNC_MAX_CONNS + 1];
+	struct rmilter_async_conn *polled[ASYNC_MAX_CONNS + 1], *conn;
+	unsigned int npfds, i;
+	int timeout;
+	bool busy;
+
+	msg_info ("cache_async: starting...");
+
+	for (;;) {
+		pfds[0].fd = wake_pipe[0];
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		npfds = 1;
+		busy = false;
+
+		DL_FOREACH (conns, conn) {
+			if (conn->pending > 0) {
+				busy = true;
+			}
+
+			if (conn->ac && (conn->reading || conn->writing) &&
+					npfds <= ASYNC_MAX_CONNS) {
+				pfds[npfds].fd = conn->ac->c.fd;
+				pfds[npfds].events = (conn->reading ? POLLIN : 0) |
+						(conn->writing ? POLLOUT : 0);
+				pfds[npfds].revents = 0;
+				polled[npfds] = conn;
+				npfds ++;
+			}
+		}
+
+		/* Wake up more often when waiting for replies to check deadlines */
+		timeout = busy ? ASYNC_TICK : ASYNC_POLL_TIMEOUT;
+
+		if (poll (pfds, npfds, timeout) == -1 && errno != EINTR) {
+			msg_err ("cache_async: poll failed: %s", strerror (errno));
+		}
+
+		for (i = 1; i < npfds; i ++) {
+			conn = polled[i];
+
+			if (pfds[i].revents == 0) {
+				continue;
+			}
+
+			if (conn->ac && conn->writing &&
+					(pfds[i].revents & (POLLOUT|POLLERR|POLLHUP))) {
+				redisAsyncHandleWrite (conn->ac);
+			}
+			if (conn->ac && conn->reading &&
+					(pfds[i].revents & (POLLIN|POLLERR|POLLHUP))) {
+				redisAsyncHandleRead (conn->ac);
+			}
+		}
+
+		/* New commands are flushed on the next iteration */
+		if (pfds[0].revents & POLLIN) {
+			rmilter_async_process_queue ();
+		}
+
+		rmilter_async_sweep (rmilter_async_now ());
+	}
+
+	return NULL;
+}
+
+static void
+rmilter_async_start (void)
+{
+	int fl, i;
+
+	if (pipe (wake_pipe) == -1) {
+		msg_err ("cache_async: cannot create pipe: %s", strerror (errno));
+		return;
+	}
+
+	for (i = 0; i < 2; i ++) {
+		fl = fcntl (wake_pipe[i], F_GETFL, 0);
+		fcntl (wake_pipe[i], F_SETFL, fl | O_NONBLOCK);
+	}
+
+	if (!rmilter_thread_start ("cache_async", rmilter_async_thread, NULL)) {
+		close (wake_pipe[0]);
+		close (wake_pipe[1]);
+	}
+	else {
+		async_running = true;
+	}
+}
+
+static struct rmilter_async_req *
+rmilter_async_req_new (struct config_file *cfg, struct cache_server *serv,
+		const char *cmd, size_t len, unsigned int ncmds)
+{
+	struct rmilter_async_req *req;
+
+	req = calloc (1, sizeof (*req));
+
+	if (req == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_init (&req->mtx, NULL);
+	pthread_cond_init (&req->cond, NULL);
+	/* One reference for the caller and one for I/O thread */
+	req->ref = 2;
+	req->ncmds = ncmds;
+	req->len = len;
+	req->port = serv->port;
+	req->serial = cfg->serial;
+	req->nconns = cfg->cache_async_conns > 0 ? cfg->cache_async_conns : 1;
+	req->timeout = cfg->cache_connect_timeout;
+	req->idle_timeout = cfg->cache_idle_timeout;
+	req->replies = calloc (ncmds, sizeof (redisReply *));
+	req->cmd = malloc (len);
+	req->addr = strdup (serv->addr);
+
+	if (!rmilter_resolver_addr (serv->resolved, req->ip, sizeof (req->ip))) {
+		req->ip[0] = '\0';
+	}
+
+	if (cfg->cache_password) {
+		req->password = strdup (cfg->cache_password);
+	}
+	/* Redis cluster supports database 0 only */
+	if (cfg->cache_dbname && !cfg->cache_cluster) {
+		req->dbname = strdup (cfg->cache_dbname);
+	}
+
+	if (req->replies == NULL || req->cmd == NULL || req->addr == NULL ||
+			(cfg->cache_password && req->password == NULL) ||
+			(cfg->cache_dbname && !cfg->cache_cluster &&
+					req->dbname == NULL)) {
+		req->ref = 1;
+		rmilter_async_req_unref (req);
+
+		return NULL;
+	}
+
+	memcpy (req->cmd, cmd, len);
+
+	return req;
+}
+
+bool
+rmilter_cache_async_pipeline (struct config_file *cfg,
+		struct cache_server *serv, struct mlfi_priv *priv,
+		const char *cmd, size_t len, unsigned int ncmds, redisReply **replies)
+{
+	struct rmilter_async_req *req;
+	struct timeval tv;
+	struct timespec deadline;
+	unsigned int i;
+	bool wakeup, ret = false;
+	int rc = 0;
+
+	pthread_once (&async_once, rmilter_async_start);
+
+	if (!async_running) {
+		msg_err ("<%s>; cache I/O thread is not running", priv->mlfi_id);
+		return false;
+	}
+
+	req = rmilter_async_req_new (cfg, serv, cmd, len, ncmds);
+
+	if (req == NULL) {
+		msg_err ("<%s>; cannot allocate cache request", priv->mlfi_id);
+		return false;
+	}
+
+	ASYNC_STAT_INC (requests);
+	gettimeofday (&tv, NULL);
+	deadline.tv_sec = tv.tv_sec + cfg->cache_connect_timeout / 1000;
+	deadline.tv_nsec = tv.tv_usec * 1000 +
+			(cfg->cache_connect_timeout % 1000) * 1000000;
+
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec ++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock (&queue_mtx);
+	wakeup = (queue == NULL);
+	LL_APPEND (queue, req);
+	pthread_mutex_unlock (&queue_mtx);
+
+	if (wakeup && write (wake_pipe[1], "", 1) == -1 && errno != EAGAIN) {
+		msg_err ("<%s>; cannot wake up cache I/O thread: %s", priv->mlfi_id,
+				strerror (errno));
+	}
+
+	pthread_mutex_lock (&req->mtx);
+
+	while (!req->done && rc != ETIMEDOUT) {
+		rc = pthread_cond_timedwait (&req->cond, &req->mtx, &deadline);
+	}
+
+	if (req->done && !req->failed) {
+		for (i = 0; i < ncmds; i ++) {
+			replies[i] = req->replies[i];
+			req->replies[i] = NULL;
+		}
+
+		ret = true;
+	}
+
+	pthread_mutex_unlock (&req->mtx);
+
+	if (!ret) {
+		if (rc == ETIMEDOUT) {
+			ASYNC_STAT_INC (timeouts);
+			msg_err ("<%s>; cannot query %s:%d: timed out", priv->mlfi_id,
+					serv->addr, (int)serv->port);
+		}
+		else {
+			msg_err ("<%s>; cannot query %s:%d: connection error",
+					priv->mlfi_id, serv->addr, (int)serv->port);
+		}
+	}
+
+	rmilter_async_req_unref (req);
+
+	return ret;
+}
+
+void
+rmilter_cache_async_get_stat (struct rmilter_cache_async_stat *st)
+{
+	rmilter_stat_snapshot (st, &async_stat, sizeof (*st));
+}
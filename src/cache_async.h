@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_CACHE_ASYNC_H_
+#define SRC_CACHE_ASYNC_H_
+
+#include "config.h"
+#include "hiredis.h"
+
+struct config_file;
+struct cache_server;
+struct mlfi_priv;
+
+struct rmilter_cache_async_stat {
+	uint64_t requests;			/* requests submitted */
+	uint64_t timeouts;			/* requests abandoned by their callers */
+	uint64_t errors;			/* requests failed due to I/O errors */
+	uint64_t connections;		/* connections established */
+};
+
+/**
+ * Send preformatted pipeline of `ncmds` commands to the specified server via
+ * the cache I/O thread and wait for all replies. The I/O thread is started
+ * on the first call. Commands from all callers are multiplexed over
+ * `cache_async_conns` connections per server.
+ * @param cfg
+ * @param serv server to send commands to
+ * @param priv pointer to useful information from milter protocol
+ * @param cmd formatted commands
+ * @param len length of `cmd`
+ * @param ncmds number of commands in `cmd`
+ * @param replies array of `ncmds` replies (must be freed by a caller)
+ * @return true if all replies have been received before deadline
+ */
+bool rmilter_cache_async_pipeline (struct config_file *cfg,
+		struct cache_server *serv, struct mlfi_priv *priv,
+		const char *cmd, size_t len, unsigned int ncmds, redisReply **replies);
+
+void rmilter_cache_async_get_stat (struct rmilter_cache_async_stat *st);
+
+#endif /* SRC_CACHE_ASYNC_H_ */
@@ -29,6 +29,7 @@
 
 #include "cfg_file.h"
 #include "rmilter.h"
+#include "resolver.h"
 
 extern int yylineno;
 extern char *yytext;
@@ -103,13 +104,68 @@ static size_t copy_regexp(char **dst, const char *src)
 	return rmilter_strlcpy (*dst, src, len + 1);
 }
 
+static int parse_cache_host(struct cache_server *mc, char *str)
+{
+	char *cur_tok, *err_str;
+	uint16_t port;
+
+	cur_tok = strsep (&str, ":");
+
+	if (cur_tok == NULL || *cur_tok == '\0') {
+		return 0;
+	}
+
+	/* cur_tok - server name, str - server port */
+	if (str == NULL) {
+		port = DEFAULT_MEMCACHED_PORT;
+	}
+	else {
+		port = strtoul (str, &err_str, 10);
+		if (*err_str != '\0') {
+			yyerror ("yyparse: bad memcached port: %s", str);
+			return 0;
+		}
+	}
+
+	mc->addr = strdup (cur_tok);
+	mc->port = port;
+
+	if (mc->addr == NULL) {
+		return 0;
+	}
+
+	upstream_set_id (&mc->up, mc->addr, mc->port);
+
+	rmilter_resolver_release (mc->resolved);
+	mc->resolved = rmilter_resolver_get (mc->addr);
+
+	return 1;
+}
+
+static void free_cache_replicas(struct cache_server *mc)
+{
+	unsigned int i;
+
+	if (mc->nreplicas > 0) {
+		upstream_set_destroy (mc->replicas);
+	}
+
+	for (i = 0; i < mc->nreplicas; i++) {
+		free (mc->replicas[i].addr);
+		rmilter_resolver_release (mc->replicas[i].resolved);
+	}
+
+	free (mc->replicas);
+	mc->replicas = NULL;
+	mc->nreplicas = 0;
+}
+
 int add_cache_server(struct config_file *cf, char *str, char *str2,
 		int type)
 {
-	char *cur_tok, *err_str;
 	struct cache_server *mc = NULL;
-	uint16_t port;
-	unsigned *pnum;
+	char *cur_tok;
+	unsigned *pnum, nreplicas;
 
 	if (str == NULL) {
 		return 0;
@@ -149,30 +205,42 @@ int add_cache_server(struct config_file *cf, char *str, char *str2,
 	}
 
 	mc += *pnum;
-	cur_tok = strsep (&str, ":");
+	/* Slot might be reused after `servers = ` */
+	free_cache_replicas (mc);
 
-	if (cur_tok == NULL || *cur_tok == '\0') {
+	if (!parse_cache_host (mc, str)) {
 		return 0;
 	}
 
-	/* cur_tok - server name, str - server port */
-	if (str == NULL) {
-		port = DEFAULT_MEMCACHED_PORT;
+	if (str2 != NULL && !cf->cache_use_redis) {
+		msg_warn("mirrored servers are no longer supported; "
+				"server %s will be ignored", str2);
 	}
-	else {
-		port = strtoul (str, &err_str, 10);
-		if (*err_str != '\0') {
-			yyerror ("yyparse: bad memcached port: %s", str);
+	else if (str2 != NULL) {
+		/* Comma separated list of read replicas */
+		nreplicas = 1;
+
+		for (cur_tok = str2; *cur_tok != '\0'; cur_tok++) {
+			if (*cur_tok == ',') {
+				nreplicas++;
+			}
+		}
+
+		mc->replicas = calloc (nreplicas, sizeof (*mc->replicas));
+
+		if (mc->replicas == NULL) {
 			return 0;
 		}
-	}
 
-	mc->addr = strdup (cur_tok);
-	mc->port = port;
+		while ((cur_tok = strsep (&str2, ",")) != NULL) {
+			if (!parse_cache_host (&mc->replicas[mc->nreplicas], cur_tok)) {
+				free_cache_replicas (mc);
+				return 0;
+			}
 
-	if (str2 != NULL) {
-		msg_warn("mirrored servers are no longer supported; "
-				"server %s will be ignored", str2);
+			mc->replicas[mc->nreplicas].is_redis = true;
+			mc->nreplicas++;
+		}
 	}
 
 	(*pnum)++;
@@ -207,6 +275,14 @@ int add_clamav_server(struct config_file *cf, char *str)
 
 	srv->name = strdup (cur_tok);
 
+	if (srv->name == NULL) {
+		return 0;
+	}
+
+	/* Slot might be reused after `servers = ` */
+	rmilter_resolver_release (srv->resolved);
+	srv->resolved = rmilter_resolver_get (srv->name);
+
 	if (str != NULL) {
 		/* We have also port */
 		srv->port = strtoul (str, NULL, 10);
@@ -270,6 +346,14 @@ int add_spamd_server(struct config_file *cf, char *str, int is_extra)
 
 	srv->name = strdup (cur_tok);
 
+	if (srv->name == NULL) {
+		return 0;
+	}
+
+	/* Slot might be reused after `servers = ` */
+	rmilter_resolver_release (srv->resolved);
+	srv->resolved = rmilter_resolver_get (srv->name);
+
 	if (str != NULL) {
 		/* We have also port */
 		srv->port = strtoul (str, NULL, 10);
@@ -323,6 +407,12 @@ void init_defaults(struct config_file *cfg)
 	cfg->clamav_port_timeout = DEFAULT_CLAMAV_PORT_TIMEOUT;
 	cfg->clamav_results_timeout = DEFAULT_CLAMAV_RESULTS_TIMEOUT;
 	cfg->cache_connect_timeout = DEFAULT_MEMCACHED_CONNECT_TIMEOUT;
+	cfg->cache_idle_timeout = DEFAULT_CACHE_IDLE_TIMEOUT;
+	cfg->local_cache_ttl = DEFAULT_LOCAL_CACHE_TTL;
+	cfg->cache_async_conns = DEFAULT_CACHE_ASYNC_CONNS;
+	cfg->publish_queue_size = DEFAULT_PUBLISH_QUEUE_SIZE;
+	cfg->publish_workers = DEFAULT_PUBLISH_WORKERS;
+	cfg->ratelimit_flush_updates = DEFAULT_RATELIMIT_FLUSH_UPDATES;
 	cfg->spamd_connect_timeout = DEFAULT_SPAMD_CONNECT_TIMEOUT;
 	cfg->spamd_results_timeout = DEFAULT_SPAMD_RESULTS_TIMEOUT;
 
@@ -338,6 +428,10 @@ void init_defaults(struct config_file *cfg)
 	cfg->spam_header = strdup (DEFAULT_SPAM_HEADER);
 	cfg->spam_header_value = strdup (DEFAULT_SPAM_HEADER_VALUE);
 	cfg->spamd_retry_count = DEFAULT_SPAMD_RETRY_COUNT;
+	cfg->spamd_hedge_percentile = DEFAULT_SPAMD_HEDGE_PERCENTILE;
+	cfg->spamd_idle_timeout = DEFAULT_SPAMD_IDLE_TIMEOUT;
+	cfg->spamd_concurrency_wait = DEFAULT_CONCURRENCY_WAIT;
+	cfg->clamav_concurrency_wait = DEFAULT_CONCURRENCY_WAIT;
 	cfg->spamd_retry_timeout = DEFAULT_SPAMD_RETRY_TIMEOUT;
 	cfg->spamd_temp_fail = 0;
 	cfg->spam_bar_char = strdup ("x");
@@ -375,6 +469,9 @@ void init_defaults(struct config_file *cfg)
 	cfg->dkim_enable = 1;
 	cfg->pid_file = NULL;
 	cfg->tempfiles_mode = 00600;
+	cfg->healthcheck_timeout = DEFAULT_HEALTHCHECK_TIMEOUT;
+	cfg->resolve_interval = DEFAULT_RESOLVE_INTERVAL;
+	cfg->cache_breaker_open_time = DEFAULT_CACHE_BREAKER_OPEN_TIME;
 	cfg->syslog_name = strdup ("rmilter");
 
 #if 0
@@ -446,6 +543,37 @@ void free_config(struct config_file *cfg)
 	for (i = 0; i < cfg->spamd_servers_num; i++) {
 		free (cfg->spamd_servers[i].name);
 	}
+	/* Slots beyond the current number might have been used before reset */
+	for (i = 0; i < MAX_CLAMAV_SERVERS; i++) {
+		rmilter_resolver_release (cfg->clamav_servers[i].resolved);
+	}
+	for (i = 0; i < MAX_SPAMD_SERVERS; i++) {
+		rmilter_resolver_release (cfg->spamd_servers[i].resolved);
+		rmilter_resolver_release (cfg->extra_spamd_servers[i].resolved);
+	}
+	for (i = 0; i < MAX_CACHE_SERVERS; i++) {
+		rmilter_resolver_release (cfg->cache_servers_grey[i].resolved);
+		rmilter_resolver_release (cfg->cache_servers_white[i].resolved);
+		rmilter_resolver_release (cfg->cache_servers_limits[i].resolved);
+		rmilter_resolver_release (cfg->cache_servers_id[i].resolved);
+		rmilter_resolver_release (cfg->cache_servers_copy[i].resolved);
+		rmilter_resolver_release (cfg->cache_servers_spam[i].resolved);
+	}
+	upstream_set_destroy (cfg->clamav_servers);
+	upstream_set_destroy (cfg->spamd_servers);
+	upstream_set_destroy (cfg->extra_spamd_servers);
+	upstream_set_destroy (cfg->cache_servers_grey);
+	upstream_set_destroy (cfg->cache_servers_white);
+	upstream_set_destroy (cfg->cache_servers_limits);
+	upstream_set_destroy (cfg->cache_servers_id);
+	upstream_set_destroy (cfg->cache_servers_copy);
+	upstream_set_destroy (cfg->cache_servers_spam);
+
+	for (i = 0; i < MAX_CACHE_SERVERS; i++) {
+		free_cache_replicas (&cfg->cache_servers_grey[i]);
+		free_cache_replicas (&cfg->cache_servers_white[i]);
+		free_cache_replicas (&cfg->cache_servers_id[i]);
+	}
 
 	/* Free whitelists and bounce list*/
 	clear_rcpt_whitelist (&cfg->wlist_rcpt_global);
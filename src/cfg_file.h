@@ -62,9 +62,26 @@
 #define DEFAULT_SPAMD_RESULTS_TIMEOUT 20000
 #define DEFAULT_SPAMD_RETRY_TIMEOUT 1000
 #define DEFAULT_SPAMD_RETRY_COUNT 5
+#define DEFAULT_SPAMD_HEDGE_PERCENTILE 95
+#define DEFAULT_SPAMD_IDLE_TIMEOUT 60000
 #define DEFAULT_RSPAMD_METRIC "default"
 /* Memcached timeouts */
 #define DEFAULT_MEMCACHED_CONNECT_TIMEOUT 1000
+#define DEFAULT_CACHE_IDLE_TIMEOUT 60000
+#define DEFAULT_LOCAL_CACHE_TTL 10000
+#define DEFAULT_CACHE_ASYNC_CONNS 2
+#define DEFAULT_PUBLISH_QUEUE_SIZE 64
+#define DEFAULT_PUBLISH_WORKERS 1
+/* Ratelimit write-behind */
+#define DEFAULT_RATELIMIT_FLUSH_UPDATES 1000
+/* Circuit breaker of cache servers */
+#define DEFAULT_CACHE_BREAKER_OPEN_TIME 5000
+/* Active health checks */
+#define DEFAULT_HEALTHCHECK_TIMEOUT 500
+/* Refresh of resolved upstream names */
+#define DEFAULT_RESOLVE_INTERVAL 60000
+/* Time to wait for a free slot of scanners concurrency limit */
+#define DEFAULT_CONCURRENCY_WAIT 1000
 /* Upstream timeouts */
 #define DEFAULT_UPSTREAM_ERROR_TIME 10
 #define DEFAULT_UPSTREAM_DEAD_TIME 300
@@ -96,6 +113,9 @@ enum spamd_type {
 	SPAMD_RSPAMD = 0
 };
 
+/* Cached addresses of server, see resolver.h */
+struct rmilter_resolved;
+
 typedef struct bucket_s {
 	unsigned int burst;
 	double rate;
@@ -105,6 +125,7 @@ struct clamav_server {
 	struct upstream up;
 	int port;
 	char *name;
+	struct rmilter_resolved *resolved;
 };
 
 struct spamd_server {
@@ -112,13 +133,43 @@ struct spamd_server {
 	enum spamd_type type;
 	char *name;
 	int port;
+	struct rmilter_resolved *resolved;
+};
+
+struct rmilter_cluster;
+
+enum rmilter_breaker_state {
+	BREAKER_CLOSED = 0,
+	/* Requests fail without being sent */
+	BREAKER_OPEN,
+	/* Single probe request is allowed to check if server has recovered */
+	BREAKER_HALF_OPEN
+};
+
+/* Circuit breaker of cache server, fields are updated atomically */
+struct rmilter_breaker {
+	unsigned int state;
+	unsigned int failures;
+	/* Requests and errors during the current window */
+	unsigned int requests;
+	unsigned int errors;
+	uint64_t window_start;
+	/* Time when breaker has been opened or probe has been sent, ms */
+	uint64_t changed;
 };
 
 struct cache_server {
 	struct upstream up;
 	char *addr;
 	int port;
+	struct rmilter_resolved *resolved;
 	bool is_redis;
+	/* Shared slots map if servers are nodes of redis cluster */
+	struct rmilter_cluster *cluster;
+	/* Read replicas (redis only), writes always go to the server itself */
+	struct cache_server *replicas;
+	unsigned int nreplicas;
+	struct rmilter_breaker breaker;
 };
 
 struct beanstalk_server {
@@ -160,6 +211,13 @@ struct whitelisted_rcpt_entry {
 	UT_hash_handle hh;
 };
 
+/* Format of greylisting records */
+enum greylisting_format {
+	GREY_FORMAT_LEGACY = 0,
+	GREY_FORMAT_COMPACT,
+	GREY_FORMAT_MIGRATE,		/* write compact records, read both */
+};
+
 struct config_file {
 	char *cfg_name;
 	char *pid_file;
@@ -174,11 +232,20 @@ struct config_file {
 	unsigned int clamav_error_time;
 	unsigned int clamav_dead_time;
 	unsigned int clamav_maxerrors;
+	enum upstream_balance clamav_balance;
+	/* Adaptive concurrency limit per server, disabled if 0 */
+	unsigned int clamav_max_concurrency;
+	unsigned int clamav_concurrency_wait;
 	unsigned int clamav_connect_timeout;
 	unsigned int clamav_port_timeout;
 	unsigned int clamav_results_timeout;
 	radix_compressed_t *clamav_whitelist;
 	unsigned int tempfiles_mode;
+	/* Active health checks of upstreams, disabled if interval is 0 */
+	unsigned int healthcheck_interval;
+	unsigned int healthcheck_timeout;
+	/* Upstream names are resolved again after this time, never if 0 */
+	unsigned int resolve_interval;
 
 	struct spamd_server spamd_servers[MAX_SPAMD_SERVERS];
 	unsigned int spamd_servers_num;
@@ -187,8 +254,17 @@ struct config_file {
 	unsigned int spamd_error_time;
 	unsigned int spamd_dead_time;
 	unsigned int spamd_maxerrors;
+	enum upstream_balance spamd_balance;
+	unsigned int spamd_max_concurrency;
+	unsigned int spamd_concurrency_wait;
 	unsigned int spamd_connect_timeout;
 	unsigned int spamd_results_timeout;
+	/* Hedged requests per second, hedging is disabled if 0 */
+	unsigned int spamd_hedge_budget;
+	unsigned int spamd_hedge_percentile;
+	/* Idle persistent connections per server, pooling is disabled if 0 */
+	unsigned int spamd_keepalive_conns;
+	unsigned int spamd_idle_timeout;
 	radix_compressed_t *spamd_whitelist;
 	char *spamd_reject_message;
 	char *rspamd_metric;
@@ -223,7 +299,18 @@ struct config_file {
 	unsigned int cache_error_time;
 	unsigned int cache_dead_time;
 	unsigned int cache_maxerrors;
+	/* Circuit breaker, disabled if both thresholds are 0 */
+	unsigned int cache_breaker_failures;
+	unsigned int cache_breaker_error_rate;
+	unsigned int cache_breaker_open_time;
+	enum upstream_hashing cache_hashing;
 	unsigned int cache_connect_timeout;
+	unsigned int cache_idle_timeout;
+	size_t local_cache_size;
+	unsigned int local_cache_ttl;
+	unsigned int cache_async_conns;
+	unsigned int publish_queue_size;
+	unsigned int publish_workers;
 	char *cache_password;
 	char *cache_dbname;
 	char *cache_spam_channel;
@@ -236,6 +323,11 @@ struct config_file {
 	unsigned send_cache_headers:1;
 	unsigned send_cache_extra_diff:1;
 	unsigned cache_use_redis:1;
+	unsigned cache_use_async:1;
+	unsigned cache_cluster:1;
+	unsigned cache_memcached_binary:1;
+	unsigned publish_compress:1;
+	unsigned publish_drop_oldest:1;
 	unsigned spamd_soft_fail:1;
 	unsigned spamd_greylist:1;
 	unsigned spamd_spam_add_header:1;
@@ -248,6 +340,7 @@ struct config_file {
 	unsigned weighted_clamav:1;
 	unsigned greylisting_enable:1;
 	unsigned ratelimit_enable:1;
+	unsigned ratelimit_use_script:1;
 	unsigned dkim_enable:1;
 	unsigned compression_enable:1;
 	unsigned rspamd_dkim_sign:1;
@@ -258,6 +351,9 @@ struct config_file {
 	bucket_t limit_to_ip_from;
 	bucket_t limit_bounce_to;
 	bucket_t limit_bounce_to_ip;
+	/* Write-behind of bucket updates, disabled if interval is 0 */
+	unsigned int ratelimit_flush_interval;
+	unsigned int ratelimit_flush_updates;
 
 	struct whitelisted_rcpt_entry *wlist_rcpt_limit;
 	struct whitelisted_rcpt_entry *wlist_rcpt_global;
@@ -265,6 +361,8 @@ struct config_file {
 
 	unsigned int greylisting_timeout;
 	unsigned int greylisting_expire;
+	unsigned int greylisting_format;
+	unsigned int greylisting_buckets;
 	unsigned int whitelisting_expire;
 	char *id_prefix;
 	char *grey_prefix;
@@ -65,7 +65,13 @@ uint8_t cur_flags = 0;
 %token  SPAMD_NEVER_REJECT TEMPFILES_MODE USE_REDIS REDIS DKIM_SIGN_NETWORKS OUR_NETWORKS SPAM_BAR_CHAR
 %token  SPAM_NO_AUTH_HEADER PASSWORD DBNAME SPAMD_SETTINGS_ID SPAMD_SPAM_ADD_HEADER
 %token  COPY_FULL COPY_CHANNEL SPAM_CHANNEL ENABLE EQPLUS COMPRESSION DKIM_RSPAMD_SIGN
-%token  EXTENDED_HEADERS_RCPT
+%token  EXTENDED_HEADERS_RCPT IDLE_TIMEOUT USE_SCRIPT LOCAL_CACHE_SIZE LOCAL_CACHE_TTL
+%token  ASYNC ASYNC_CONNECTIONS PUBLISH_QUEUE PUBLISH_WORKERS PUBLISH_COMPRESS
+%token  PUBLISH_DROP_OLDEST FORMAT HASH_BUCKETS CLUSTER FLUSH_INTERVAL FLUSH_UPDATES
+%token  BALANCE HEALTHCHECK_INTERVAL HEALTHCHECK_TIMEOUT HASHING
+%token  HEDGE_BUDGET HEDGE_PERCENTILE BREAKER_FAILURES BREAKER_ERROR_RATE
+%token  BREAKER_OPEN_TIME MAX_CONCURRENCY CONCURRENCY_WAIT KEEPALIVE_CONNECTIONS
+%token  RESOLVE_INTERVAL REPLICAS
 
 %type	<string>	STRING
 %type	<string>	QUOTEDSTRING
@@ -74,7 +80,7 @@ uint8_t cur_flags = 0;
 %type   <string>  	SOCKCRED
 %type	<string>	IPADDR IPNETWORK
 %type	<string>	HOSTPORT
-%type 	<string>	ip_net cache_hosts clamav_addr spamd_addr bounce_addr
+%type 	<string>	ip_net cache_hosts cache_replicas clamav_addr spamd_addr bounce_addr
 %type	<string>	DOMAIN_STR
 %type	<limit>		SIZELIMIT
 %type	<flag>		FLAG
@@ -103,6 +109,9 @@ command	:
 	tempdir
 	| tempfiles_mode
 	| strictauth
+	| healthcheck_interval
+	| healthcheck_timeout
+	| resolve_interval
 	| pidfile
 	| clamav
 	| spamd
@@ -179,6 +188,28 @@ strictauth:
 	}
 	;
 
+healthcheck_interval:
+	HEALTHCHECK_INTERVAL EQSIGN SECONDS {
+		cfg->healthcheck_interval = $3;
+	}
+	;
+
+healthcheck_timeout:
+	HEALTHCHECK_TIMEOUT EQSIGN SECONDS {
+		if ($3 == 0) {
+			yyerror ("yyparse: healthcheck_timeout must be positive");
+			YYERROR;
+		}
+		cfg->healthcheck_timeout = $3;
+	}
+	;
+
+resolve_interval:
+	RESOLVE_INTERVAL EQSIGN SECONDS {
+		cfg->resolve_interval = $3;
+	}
+	;
+
 clamav:
 	CLAMAV OBRACE clamavbody EBRACE
 	| CLAMAV OBRACE empty EBRACE
@@ -197,6 +228,9 @@ clamavcmd:
 	| clamav_error_time
 	| clamav_dead_time
 	| clamav_maxerrors
+	| clamav_balance
+	| clamav_max_concurrency
+	| clamav_concurrency_wait
 	| clamav_whitelist
 	;
 
@@ -257,6 +291,31 @@ clamav_maxerrors:
 		cfg->clamav_maxerrors = $3;
 	}
 	;
+clamav_balance:
+	BALANCE EQSIGN STRING {
+		if (strcasecmp ($3, "random") == 0) {
+			cfg->clamav_balance = BALANCE_RANDOM;
+		}
+		else if (strcasecmp ($3, "latency") == 0) {
+			cfg->clamav_balance = BALANCE_LATENCY;
+		}
+		else {
+			yyerror ("yyparse: invalid balance mode: %s", $3);
+			YYERROR;
+		}
+		free ($3);
+	}
+	;
+clamav_max_concurrency:
+	MAX_CONCURRENCY EQSIGN NUMBER {
+		cfg->clamav_max_concurrency = $3;
+	}
+	;
+clamav_concurrency_wait:
+	CONCURRENCY_WAIT EQSIGN SECONDS {
+		cfg->clamav_concurrency_wait = $3;
+	}
+	;
 clamav_connect_timeout:
 	CONNECT_TIMEOUT EQSIGN SECONDS {
 		cfg->clamav_connect_timeout = $3;
@@ -306,6 +365,13 @@ spamdcmd:
 	| spamd_error_time
 	| spamd_dead_time
 	| spamd_maxerrors
+	| spamd_balance
+	| spamd_max_concurrency
+	| spamd_concurrency_wait
+	| spamd_hedge_budget
+	| spamd_hedge_percentile
+	| spamd_keepalive_connections
+	| spamd_idle_timeout
 	| spamd_reject_message
 	| spamd_whitelist
 	| extra_spamd_servers
@@ -597,6 +663,62 @@ spamd_settings_id:
 	}
 	;
 
+spamd_balance:
+	BALANCE EQSIGN STRING {
+		if (strcasecmp ($3, "random") == 0) {
+			cfg->spamd_balance = BALANCE_RANDOM;
+		}
+		else if (strcasecmp ($3, "latency") == 0) {
+			cfg->spamd_balance = BALANCE_LATENCY;
+		}
+		else {
+			yyerror ("yyparse: invalid balance mode: %s", $3);
+			YYERROR;
+		}
+		free ($3);
+	}
+	;
+
+spamd_max_concurrency:
+	MAX_CONCURRENCY EQSIGN NUMBER {
+		cfg->spamd_max_concurrency = $3;
+	}
+	;
+
+spamd_concurrency_wait:
+	CONCURRENCY_WAIT EQSIGN SECONDS {
+		cfg->spamd_concurrency_wait = $3;
+	}
+	;
+
+spamd_hedge_budget:
+	HEDGE_BUDGET EQSIGN NUMBER {
+		cfg->spamd_hedge_budget = $3;
+	}
+	;
+
+spamd_hedge_percentile:
+	HEDGE_PERCENTILE EQSIGN NUMBER {
+		if ($3 < 1 || $3 > 99) {
+			yyerror ("yyparse: hedge_percentile must be between 1 and 99");
+			YYERROR;
+		}
+		cfg->spamd_hedge_percentile = $3;
+	}
+	;
+
+spamd_keepalive_connections:
+	KEEPALIVE_CONNECTIONS EQSIGN NUMBER {
+		cfg->spamd_keepalive_conns = $3;
+	}
+	;
+
+spamd_idle_timeout:
+	IDLE_TIMEOUT EQSIGN SECONDS {
+		cfg->spamd_idle_timeout = $3;
+	}
+	;
+
 spamd_compression:
 	COMPRESSION EQSIGN FLAG {
 		cfg->compression_enable = $3;
@@ -686,6 +808,8 @@ greylistingcmd:
 	| greylisting_whitelist_expire
 	| greylisted_message
 	| greylisting_enable
+	| greylisting_format
+	| greylisting_buckets
 	;
 
 greylisting_timeout:
@@ -746,6 +870,31 @@ greylisting_enable:
 	}
 	;
 
+greylisting_format:
+	FORMAT EQSIGN STRING {
+		if (strcasecmp ($3, "legacy") == 0) {
+			cfg->greylisting_format = GREY_FORMAT_LEGACY;
+		}
+		else if (strcasecmp ($3, "compact") == 0) {
+			cfg->greylisting_format = GREY_FORMAT_COMPACT;
+		}
+		else if (strcasecmp ($3, "migrate") == 0) {
+			cfg->greylisting_format = GREY_FORMAT_MIGRATE;
+		}
+		else {
+			yyerror ("yyparse: invalid greylisting format: %s", $3);
+			YYERROR;
+		}
+		free ($3);
+	}
+	;
+
+greylisting_buckets:
+	HASH_BUCKETS EQSIGN NUMBER {
+		cfg->greylisting_buckets = $3;
+	}
+	;
+
 ip_net:
 	IPADDR
 	| IPNETWORK
@@ -774,9 +923,23 @@ cachecmd:
 	| cache_spam_servers
 	| cache_copy_servers
 	| cache_connect_timeout
+	| cache_idle_timeout
+	| cache_local_size
+	| cache_local_ttl
+	| cache_async
+	| cache_async_conns
+	| cache_cluster
+	| cache_hashing
+	| cache_publish_queue
+	| cache_publish_workers
+	| cache_publish_compress
+	| cache_publish_drop_oldest
 	| cache_error_time
 	| cache_dead_time
 	| cache_maxerrors
+	| cache_breaker_failures
+	| cache_breaker_error_rate
+	| cache_breaker_open_time
 	| cache_protocol
 	| cache_id_prefix
 	| cache_grey_prefix
@@ -804,7 +967,19 @@ cache_grey_server:
 	;
 
 cache_grey_params:
-	OBRACE cache_hosts COMMA cache_hosts EBRACE {
+	OBRACE cache_hosts COMMA REPLICAS EQSIGN cache_replicas EBRACE {
+		if (!add_cache_server (cfg, $2, $6, CACHE_SERVER_GREY)) {
+			yyerror ("yyparse: add_cache_server");
+			YYERROR;
+		}
+		free ($2);
+		free ($6);
+	}
+	| OBRACE cache_hosts COMMA cache_replicas EBRACE {
+		yywarn ("yyparse: mirrors are no longer supported, {%s, %s} makes "
+				"%s a master with read replicas %s, writes go to the master "
+				"only; use {%s, replicas = %s} to silence this warning",
+				$2, $4, $2, $4, $2, $4);
 		if (!add_cache_server (cfg, $2, $4, CACHE_SERVER_GREY)) {
 			yyerror ("yyparse: add_cache_server");
 			YYERROR;
@@ -836,7 +1011,19 @@ cache_white_server:
 	;
 
 cache_white_params:
-	OBRACE cache_hosts COMMA cache_hosts EBRACE {
+	OBRACE cache_hosts COMMA REPLICAS EQSIGN cache_replicas EBRACE {
+		if (!add_cache_server (cfg, $2, $6, CACHE_SERVER_WHITE)) {
+			yyerror ("yyparse: add_cache_server");
+			YYERROR;
+		}
+		free ($2);
+		free ($6);
+	}
+	| OBRACE cache_hosts COMMA cache_replicas EBRACE {
+		yywarn ("yyparse: mirrors are no longer supported, {%s, %s} makes "
+				"%s a master with read replicas %s, writes go to the master "
+				"only; use {%s, replicas = %s} to silence this warning",
+				$2, $4, $2, $4, $2, $4);
 		if (!add_cache_server (cfg, $2, $4, CACHE_SERVER_WHITE)) {
 			yyerror ("yyparse: add_cache_server");
 			YYERROR;
@@ -894,7 +1081,27 @@ cache_id_server:
 	;
 
 cache_id_params:
-	cache_hosts {
+	OBRACE cache_hosts COMMA REPLICAS EQSIGN cache_replicas EBRACE {
+		if (!add_cache_server (cfg, $2, $6, CACHE_SERVER_ID)) {
+			yyerror ("yyparse: add_cache_server");
+			YYERROR;
+		}
+		free ($2);
+		free ($6);
+	}
+	| OBRACE cache_hosts COMMA cache_replicas EBRACE {
+		yywarn ("yyparse: mirrors are no longer supported, {%s, %s} makes "
+				"%s a master with read replicas %s, writes go to the master "
+				"only; use {%s, replicas = %s} to silence this warning",
+				$2, $4, $2, $4, $2, $4);
+		if (!add_cache_server (cfg, $2, $4, CACHE_SERVER_ID)) {
+			yyerror ("yyparse: add_cache_server");
+			YYERROR;
+		}
+		free ($2);
+		free ($4);
+	}
+	| cache_hosts {
 		if (!add_cache_server (cfg, $1, NULL, CACHE_SERVER_ID)) {
 			yyerror ("yyparse: add_cache_server");
 			YYERROR;
@@ -960,6 +1167,21 @@ cache_hosts:
 	| DOMAIN_STR
 	| HOSTPORT
 	;
+cache_replicas:
+	cache_hosts
+	| cache_replicas COMMA cache_hosts {
+		size_t len = strlen ($1) + strlen ($3) + 2;
+
+		$$ = malloc (len);
+		if ($$ == NULL) {
+			yyerror ("yyparse: malloc failed");
+			YYERROR;
+		}
+		snprintf ($$, len, "%s,%s", $1, $3);
+		free ($1);
+		free ($3);
+	}
+	;
 cache_error_time:
 	ERROR_TIME EQSIGN NUMBER {
 		cfg->cache_error_time = $3;
@@ -980,10 +1202,123 @@ cache_connect_timeout:
 		cfg->cache_connect_timeout = $3;
 	}
 	;
+cache_idle_timeout:
+	IDLE_TIMEOUT EQSIGN SECONDS {
+		cfg->cache_idle_timeout = $3;
+	}
+	;
+cache_local_size:
+	LOCAL_CACHE_SIZE EQSIGN SIZELIMIT {
+		cfg->local_cache_size = $3;
+	}
+	| LOCAL_CACHE_SIZE EQSIGN NUMBER {
+		cfg->local_cache_size = $3;
+	}
+	;
+cache_local_ttl:
+	LOCAL_CACHE_TTL EQSIGN SECONDS {
+		cfg->local_cache_ttl = $3;
+	}
+	;
+cache_async:
+	ASYNC EQSIGN FLAG {
+		cfg->cache_use_async = $3;
+	}
+	;
+cache_async_conns:
+	ASYNC_CONNECTIONS EQSIGN NUMBER {
+		if ($3 == 0) {
+			yyerror ("yyparse: async_connections must be positive");
+			YYERROR;
+		}
+		cfg->cache_async_conns = $3;
+	}
+	;
+cache_cluster:
+	CLUSTER EQSIGN FLAG {
+		cfg->cache_cluster = $3;
+	}
+	;
+cache_breaker_failures:
+	BREAKER_FAILURES EQSIGN NUMBER {
+		cfg->cache_breaker_failures = $3;
+	}
+	;
+cache_breaker_error_rate:
+	BREAKER_ERROR_RATE EQSIGN NUMBER {
+		if ($3 > 100) {
+			yyerror ("yyparse: breaker_error_rate must be a percentage");
+			YYERROR;
+		}
+		cfg->cache_breaker_error_rate = $3;
+	}
+	;
+cache_breaker_open_time:
+	BREAKER_OPEN_TIME EQSIGN SECONDS {
+		cfg->cache_breaker_open_time = $3;
+	}
+	;
+cache_hashing:
+	HASHING EQSIGN STRING {
+		if (strcasecmp ($3, "jump") == 0) {
+			cfg->cache_hashing = HASHING_JUMP;
+		}
+		else if (strcasecmp ($3, "rendezvous") == 0) {
+			cfg->cache_hashing = HASHING_RENDEZVOUS;
+		}
+		else {
+			yyerror ("yyparse: invalid hashing mode: %s", $3);
+			YYERROR;
+		}
+		free ($3);
+	}
+	;
+cache_publish_queue:
+	PUBLISH_QUEUE EQSIGN NUMBER {
+		cfg->publish_queue_size = $3;
+	}
+	;
+cache_publish_workers:
+	PUBLISH_WORKERS EQSIGN NUMBER {
+		if ($3 == 0) {
+			yyerror ("yyparse: publish_workers must be positive");
+			YYERROR;
+		}
+		cfg->publish_workers = $3;
+	}
+	;
+cache_publish_compress:
+	PUBLISH_COMPRESS EQSIGN FLAG {
+		cfg->publish_compress = $3;
+	}
+	;
+cache_publish_drop_oldest:
+	PUBLISH_DROP_OLDEST EQSIGN FLAG {
+		cfg->publish_drop_oldest = $3;
+	}
+	;
 
 cache_protocol:
 	PROTOCOL EQSIGN STRING {
-		/* Do nothing now*/
+		if (strcasecmp ($3, "binary") == 0) {
+			cfg->cache_memcached_binary = 1;
+		}
+		else if (strcasecmp ($3, "text") == 0 ||
+				strcasecmp ($3, "ascii") == 0) {
+			cfg->cache_memcached_binary = 0;
+		}
+		else if (strcasecmp ($3, "tcp") == 0 ||
+				strcasecmp ($3, "udp") == 0) {
+			/* Legacy transport setting, it has never been used */
+			yywarn ("yyparse: protocol %s is obsolete and ignored, use binary or "
+					"text to select memcached protocol", $3);
+		}
+		else {
+			yyerror ("yyparse: invalid memcached protocol: %s", $3);
+			free ($3);
+			YYERROR;
+		}
+		free ($3);
 	}
 	;
 cache_id_prefix:
@@ -1074,6 +1409,9 @@ limitcmd:
 	| limit_bounce_to
 	| limit_bounce_to_ip
 	| limit_enable
+	| limit_use_script
+	| limit_flush_interval
+	| limit_flush_updates
 	;
 
 limit_to:
@@ -1194,6 +1532,28 @@ limit_enable:
 	}
 	;
 
+limit_use_script:
+	USE_SCRIPT EQSIGN FLAG {
+		cfg->ratelimit_use_script = $3;
+	}
+	;
+
+limit_flush_interval:
+	FLUSH_INTERVAL EQSIGN SECONDS {
+		cfg->ratelimit_flush_interval = $3;
+	}
+	;
+
+limit_flush_updates:
+	FLUSH_UPDATES EQSIGN NUMBER {
+		if ($3 == 0) {
+			yyerror ("yyparse: flush_updates must be positive");
+			YYERROR;
+		}
+		cfg->ratelimit_flush_updates = $3;
+	}
+	;
+
 whitelist:
 	WHITELIST EQSIGN {
 		clear_rcpt_whitelist (&cfg->wlist_rcpt_global);
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cfg_file.h"
+#include "cluster.h"
+#include "util.h"
+#include "utlist.h"
+
+/*
+ * Redis cluster support: configured servers are used as seed nodes to load
+ * slots map by `CLUSTER SLOTS`. Nodes discovered are kept until the next
+ * config reload, so pointers to them remain valid for per-thread connection
+ * pools and slots map can be replaced at any time.
+ */
+struct rmilter_cluster_node {
+	struct cache_server serv;
+	struct rmilter_cluster_node *next;
+};
+
+struct rmilter_cluster {
+	pthread_rwlock_t lock;
+	struct cache_server *seeds;
+	unsigned int nseeds;
+	struct rmilter_cluster_node *nodes;
+	struct cache_server *slots[RMILTER_CLUSTER_SLOTS];
+	time_t last_refresh;
+	bool stale;
+	bool refreshing;
+	struct rmilter_cluster *next;
+};
+
+static pthread_mutex_t clusters_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct rmilter_cluster *clusters = NULL;
+
+/* CRC16-CCITT (XMODEM) as used by redis cluster */
+static uint16_t
+rmilter_crc16 (const unsigned char *p, size_t len)
+{
+	uint16_t crc = 0;
+	int i;
+
+	while (len --) {
+		crc ^= (uint16_t)*p++ << 8;
+
+		for (i = 0; i < 8; i ++) {
+			if (crc & 0x8000) {
+				crc = (crc << 1) ^ 0x1021;
+			}
+			else {
+				crc <<= 1;
+			}
+		}
+	}
+
+	return crc;
+}
+
+unsigned int
+rmilter_cluster_keyslot (const unsigned char *key, size_t keylen)
+{
+	size_t s, e;
+
+	for (s = 0; s < keylen; s ++) {
+		if (key[s] == '{') {
+			break;
+		}
+	}
+
+	if (s < keylen) {
+		for (e = s + 1; e < keylen; e ++) {
+			if (key[e] == '}') {
+				break;
+			}
+		}
+
+		if (e < keylen && e != s + 1) {
+			/* Hash only the tag */
+			key += s + 1;
+			keylen = e - s - 1;
+		}
+	}
+
+	return rmilter_crc16 (key, keylen) & (RMILTER_CLUSTER_SLOTS - 1);
+}
+
+struct rmilter_cluster *
+rmilter_cluster_get (struct cache_server *seeds, unsigned int nseeds)
+{
+	struct rmilter_cluster *cl;
+	unsigned int i;
+
+	if (nseeds == 0) {
+		return NULL;
+	}
+
+	cl = seeds[0].cluster;
+
+	if (cl) {
+		return cl;
+	}
+
+	pthread_mutex_lock (&clusters_mtx);
+
+	cl = seeds[0].cluster;
+
+	if (cl == NULL) {
+		cl = calloc (1, sizeof (*cl));
+
+		if (cl) {
+			pthread_rwlock_init (&cl->lock, NULL);
+			cl->seeds = seeds;
+			cl->nseeds = nseeds;
+			cl->stale = true;
+			LL_PREPEND (clusters, cl);
+
+			/* The first seed is checked without lock, so set it last */
+			__sync_synchronize ();
+
+			for (i = nseeds; i > 0; i --) {
+				seeds[i - 1].cluster = cl;
+			}
+		}
+		else {
+			msg_err ("cluster: cannot allocate cluster state: %s",
+					strerror (errno));
+		}
+	}
+
+	pthread_mutex_unlock (&clusters_mtx);
+
+	return cl;
+}
+
+struct cache_server *
+rmilter_cluster_route (struct rmilter_cluster *cl, unsigned int slot)
+{
+	struct cache_server *serv;
+
+	pthread_rwlock_rdlock (&cl->lock);
+	serv = cl->slots[slot % RMILTER_CLUSTER_SLOTS];
+	pthread_rwlock_unlock (&cl->lock);
+
+	return serv;
+}
+
+bool
+rmilter_cluster_refresh_start (struct rmilter_cluster *cl)
+{
+	time_t now;
+	bool ret = false;
+
+	now = time (NULL);
+	pthread_rwlock_wrlock (&cl->lock);
+
+	if (cl->stale && !cl->refreshing && cl->last_refresh != now) {
+		cl->refreshing = true;
+		cl->last_refresh = now;
+		ret = true;
+	}
+
+	pthread_rwlock_unlock (&cl->lock);
+
+	return ret;
+}
+
+void
+rmilter_cluster_refresh_done (struct rmilter_cluster *cl, bool success)
+{
+	pthread_rwlock_wrlock (&cl->lock);
+	cl->refreshing = false;
+
+	if (success) {
+		cl->stale = false;
+	}
+
+	pthread_rwlock_unlock (&cl->lock);
+}
+
+void
+rmilter_cluster_set_stale (struct rmilter_cluster *cl)
+{
+	pthread_rwlock_wrlock (&cl->lock);
+	cl->stale = true;
+	pthread_rwlock_unlock (&cl->lock);
+}
+
+/*
+ * Returns seed or known node with the specified address or creates a new node,
+ * must be called with write lock held
+ */
+static struct cache_server *
+rmilter_cluster_node (struct rmilter_cluster *cl, const char *addr,
+		size_t addrlen, int port)
+{
+	struct rmilter_cluster_node *node;
+	unsigned int i;
+
+	for (i = 0; i < cl->nseeds; i ++) {
+		if (cl->seeds[i].port == port &&
+				strlen (cl->seeds[i].addr) == addrlen &&
+				memcmp (cl->seeds[i].addr, addr, addrlen) == 0) {
+			return &cl->seeds[i];
+		}
+	}
+
+	LL_FOREACH (cl->nodes, node) {
+		if (node->serv.port == port &&
+				strlen (node->serv.addr) == addrlen &&
+				memcmp (node->serv.addr, addr, addrlen) == 0) {
+			return &node->serv;
+		}
+	}
+
+	node = calloc (1, sizeof (*node));
+
+	if (node == NULL) {
+		return NULL;
+	}
+
+	node->serv.addr = malloc (addrlen + 1);
+
+	if (node->serv.addr == NULL) {
+		free (node);
+		return NULL;
+	}
+
+	memcpy (node->serv.addr, addr, addrlen);
+	node->serv.addr[addrlen] = '\0';
+	node->serv.port = port;
+	node->serv.is_redis = true;
+	node->serv.cluster = cl;
+	LL_PREPEND (cl->nodes, node);
+
+	msg_info ("cluster: discovered node %s:%d", node->serv.addr, port);
+
+	return &node->serv;
+}
+
+bool
+rmilter_cluster_update (struct rmilter_cluster *cl, const redisReply *r,
+		const struct cache_server *from)
+{
+	const redisReply *range, *host;
+	struct cache_server *serv;
+	unsigned int i, nslots = 0;
+	long long slot, start, end;
+
+	if (r->type != REDIS_REPLY_ARRAY) {
+		return false;
+	}
+
+	/* Validate reply before touching slots map */
+	for (i = 0; i < r->elements; i ++) {
+		range = r->element[i];
+
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+				range->element[0]->type != REDIS_REPLY_INTEGER ||
+				range->element[1]->type != REDIS_REPLY_INTEGER ||
+				range->element[2]->type != REDIS_REPLY_ARRAY ||
+				range->element[2]->elements < 2 ||
+				range->element[2]->element[0]->type != REDIS_REPLY_STRING ||
+				range->element[2]->element[1]->type != REDIS_REPLY_INTEGER) {
+			return false;
+		}
+
+		start = range->element[0]->integer;
+		end = range->element[1]->integer;
+
+		if (start < 0 || end < start || end >= RMILTER_CLUSTER_SLOTS) {
+			return false;
+		}
+	}
+
+	pthread_rwlock_wrlock (&cl->lock);
+	memset (cl->slots, 0, sizeof (cl->slots));
+
+	for (i = 0; i < r->elements; i ++) {
+		range = r->element[i];
+		/* The first node is the master */
+		host = range->element[2];
+
+		if (host->element[0]->len == 0 ||
+				strcmp (host->element[0]->str, "?") == 0) {
+			/* Unknown address means the node that has replied */
+			serv = rmilter_cluster_node (cl, from->addr, strlen (from->addr),
+					from->port);
+		}
+		else {
+			serv = rmilter_cluster_node (cl, host->element[0]->str,
+					host->element[0]->len, host->element[1]->integer);
+		}
+
+		if (serv == NULL) {
+			continue;
+		}
+
+		end = range->element[1]->integer;
+
+		for (slot = range->element[0]->integer; slot <= end; slot ++) {
+			cl->slots[slot] = serv;
+			nslots ++;
+		}
+	}
+
+	pthread_rwlock_unlock (&cl->lock);
+
+	if (nslots < RMILTER_CLUSTER_SLOTS) {
+		msg_warn ("cluster: only %u of %d slots are covered according to "
+				"%s:%d", nslots, RMILTER_CLUSTER_SLOTS, from->addr, from->port);
+	}
+
+	return true;
+}
+
+struct cache_server *
+rmilter_cluster_redirect (struct rmilter_cluster *cl, const char *err,
+		bool *ask)
+{
+	struct cache_server *serv;
+	const char *p, *colon;
+	char *ep;
+	unsigned long slot, port;
+
+	if (strncmp (err, "MOVED ", sizeof ("MOVED ") - 1) == 0) {
+		*ask = false;
+		p = err + sizeof ("MOVED ") - 1;
+	}
+	else if (strncmp (err, "ASK ", sizeof ("ASK ") - 1) == 0) {
+		*ask = true;
+		p = err + sizeof ("ASK ") - 1;
+	}
+	else {
+		return NULL;
+	}
+
+	/* <slot> <host>:<port>, host may be an IPv6 address */
+	slot = strtoul (p, &ep, 10);
+
+	if (ep == p || *ep != ' ' || slot >= RMILTER_CLUSTER_SLOTS) {
+		return NULL;
+	}
+
+	p = ep + 1;
+	colon = strrchr (p, ':');
+
+	if (colon == NULL) {
+		return NULL;
+	}
+
+	port = strtoul (colon + 1, &ep, 10);
+
+	if (ep == colon + 1 || port == 0 || port > 65535) {
+		return NULL;
+	}
+
+	pthread_rwlock_wrlock (&cl->lock);
+
+	if (colon == p) {
+		/* Empty host means the same node as the seed */
+		serv = rmilter_cluster_node (cl, cl->seeds[0].addr,
+				strlen (cl->seeds[0].addr), port);
+	}
+	else {
+		serv = rmilter_cluster_node (cl, p, colon - p, port);
+	}
+
+	if (serv && !*ask) {
+		/* Slot has been moved permanently, other slots might be moved too */
+		cl->slots[slot] = serv;
+		cl->stale = true;
+	}
+
+	pthread_rwlock_unlock (&cl->lock);
+
+	return serv;
+}
+
+void
+rmilter_cluster_init (void)
+{
+	struct rmilter_cluster *cl, *tmp;
+	struct rmilter_cluster_node *node, *ntmp;
+
+	pthread_mutex_lock (&clusters_mtx);
+
+	LL_FOREACH_SAFE (clusters, cl, tmp) {
+		LL_FOREACH_SAFE (cl->nodes, node, ntmp) {
+			free (node->serv.addr);
+			free (node);
+		}
+
+		pthread_rwlock_destroy (&cl->lock);
+		free (cl);
+	}
+
+	clusters = NULL;
+	pthread_mutex_unlock (&clusters_mtx);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_CLUSTER_H_
+#define SRC_CLUSTER_H_
+
+#include "config.h"
+#include "hiredis.h"
+
+#define RMILTER_CLUSTER_SLOTS 16384
+
+struct cache_server;
+
+/**
+ * Returns hash slot of the key as computed by redis cluster: CRC16 of the
+ * key or of its hash tag (non-empty substring between the first `{` and the
+ * following `}`) modulo 16384
+ * @param key
+ * @param keylen
+ * @return slot number
+ */
+unsigned int rmilter_cluster_keyslot (const unsigned char *key, size_t keylen);
+
+/**
+ * Returns cluster state associated with the array of seed servers, the state
+ * is created on the first call and is linked to all seeds
+ * @param seeds array of servers from the configuration
+ * @param nseeds number of elements in `seeds`
+ * @return cluster state or NULL if memory cannot be allocated
+ */
+struct rmilter_cluster *rmilter_cluster_get (struct cache_server *seeds,
+		unsigned int nseeds);
+
+/**
+ * Returns node that owns the specified slot
+ * @return node or NULL if the slot is not covered by the known slots map
+ */
+struct cache_server *rmilter_cluster_route (struct rmilter_cluster *cl,
+		unsigned int slot);
+
+/**
+ * Checks whether slots map should be reloaded, only one caller is allowed
+ * to reload it at the same time and reloads are done at most once per second
+ * @return true if the caller should reload slots map and then call
+ * `rmilter_cluster_refresh_done`
+ */
+bool rmilter_cluster_refresh_start (struct rmilter_cluster *cl);
+
+void rmilter_cluster_refresh_done (struct rmilter_cluster *cl, bool success);
+
+/**
+ * Replaces slots map with the one from `CLUSTER SLOTS` reply
+ * @param cl
+ * @param r reply
+ * @param from server that has sent the reply
+ * @return true if the reply is valid
+ */
+bool rmilter_cluster_update (struct rmilter_cluster *cl, const redisReply *r,
+		const struct cache_server *from);
+
+/**
+ * Parses `MOVED` or `ASK` error and returns the node the command should be
+ * resent to. `MOVED` also updates slots map and schedules its reload.
+ * @param cl
+ * @param err error string
+ * @param ask set to true for `ASK` redirection
+ * @return target node or NULL if `err` is not a redirection
+ */
+struct cache_server *rmilter_cluster_redirect (struct rmilter_cluster *cl,
+		const char *err, bool *ask);
+
+/**
+ * Schedules reload of slots map (e.g. after connection failure)
+ */
+void rmilter_cluster_set_stale (struct rmilter_cluster *cl);
+
+/**
+ * Drops all cluster states, must be called when no cache requests are
+ * active (on start and on config reload)
+ */
+void rmilter_cluster_init (void);
+
+#endif /* SRC_CLUSTER_H_ */
@@ -36,6 +36,22 @@
 
 #define GREYLISTING_HEADER "X-Rmilter-Greylist"
 
+/*
+ * Compact format (version 2): key is prefix, version and 128 bits of digest
+ * (hex encoded for memcached), value is a 4 bytes timestamp in network byte
+ * order. If hash buckets are enabled, key is prefix, version, bucket number
+ * and time slice, whereas the digest is used as a field in this bucket.
+ *
+ * Fields of redis hashes cannot expire, so each bucket only receives records
+ * during one slice of `expire` seconds and expires as a whole at the end of
+ * the next slice, when all its records are outdated. Records are looked up in
+ * the current and the previous slices.
+ */
+#define GREY_COMPACT_VERSION '2'
+#define GREY_DIGEST_LEN 16
+/* Maximum number of queries for a single hash */
+#define GREY_MAX_QUERIES 6
+
 static int
 make_greylisting_key (char *key, size_t keylen, char *prefix, const u_char *hash)
 {
@@ -62,58 +78,373 @@ make_greylisting_key (char *key, size_t keylen, char *prefix, const u_char *hash
 	return r;
 }
 
+/*
+ * Returns length of key or -1 if prefix is too long
+ */
+static int
+make_greylisting_key_compact (struct config_file *cfg, char *key,
+		size_t keylen, char *prefix, const u_char *hash, uint64_t slice)
+{
+	size_t r = 0;
+	uint32_t bucket;
+	const u_char *p;
+
+	if (prefix) {
+		r = strlen (prefix);
+	}
+
+	/* Longest suffix is hex digest, bucket number and slice are shorter */
+	if (r + GREY_DIGEST_LEN * 2 + 2 >= keylen) {
+		msg_err ("make_greylisting_key_compact: prefix '%s' is too long",
+				prefix);
+		return -1;
+	}
+
+	if (prefix) {
+		memcpy (key, prefix, r);
+	}
+
+	key[r ++] = GREY_COMPACT_VERSION;
+
+	if (cfg->greylisting_buckets > 0 && cfg->cache_use_redis) {
+		/*
+		 * Bucket is selected by bits not used in the field, decoded as big
+		 * endian to be the same on all hosts
+		 */
+		p = hash + GREY_DIGEST_LEN;
+		bucket = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+				((uint32_t)p[2] << 8) | (uint32_t)p[3];
+		r += snprintf (key + r, keylen - r, "b%u.%llu",
+				(unsigned)(bucket % cfg->greylisting_buckets),
+				(unsigned long long)slice);
+	}
+	else if (cfg->cache_use_redis) {
+		memcpy (key + r, hash, GREY_DIGEST_LEN);
+		r += GREY_DIGEST_LEN;
+	}
+	else {
+		/* Memcached does not allow binary keys */
+		r += rmilter_encode_hex_buf (hash, GREY_DIGEST_LEN, key + r,
+				keylen - r);
+	}
+
+	return r;
+}
+
 static int
 greylisting_sort_rcpt_func (struct rcpt *r1, struct rcpt *r2)
 {
 	return strcmp (r1->r_addr, r2->r_addr);
 }
 
-static int
-greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
-		const u_char *blake_hash, bool *exists,
-		char *hdr_buf, size_t hdr_size, const char *type)
+struct greylisting_hash {
+	char white_key[MAXKEYLEN];
+	int white_keylen;
+	char grey_key[MAXKEYLEN];
+	int grey_keylen;
+	/* Buckets of the previous time slice, if buckets are used */
+	char white_key_prev[MAXKEYLEN];
+	int white_keylen_prev;
+	char grey_key_prev[MAXKEYLEN];
+	int grey_keylen_prev;
+	/* Time when buckets of the current slice expire */
+	time_t white_bucket_end;
+	time_t grey_bucket_end;
+	/* Keys in legacy format, used in migration mode */
+	char white_key_old[MAXKEYLEN];
+	int white_keylen_old;
+	char grey_key_old[MAXKEYLEN];
+	int grey_keylen_old;
+	/* Field in hash bucket, if buckets are used */
+	u_char field[GREY_DIGEST_LEN];
+	size_t fieldlen;
+	/* Printable name of the record for logging */
+	char name[MAXKEYLEN];
+	/* Indexes of queries for legacy and previous slice keys, or -1 */
+	int migrate_idx;
+	int prev_idx;
+	bool compact;
+	bool migrate;
+	const char *type;
+};
+
+/*
+ * Makes keys of the current and the previous slices of bucket, returns false
+ * if keys cannot be made
+ */
+static bool
+greylisting_bucket_keys (struct config_file *cfg, char *key, int *keylen,
+		char *key_prev, int *keylen_prev, time_t *end, char *prefix,
+		const u_char *hash, unsigned int expire, time_t now)
 {
-	char key[MAXKEYLEN], timebuf[64], timebuf_expire[64];
-	int r, keylen;
-	time_t elapsed;
-	struct timeval *tm1 = NULL, tm;
-	struct tm tm_parsed;
-	size_t dlen;
-	void *addr;
+	uint64_t slice = 0;
 
-	addr = priv->priv_addr.family == AF_INET6
-		   ? (void *) &priv->priv_addr.addr.sa6.sin6_addr :
-		   (void *) &priv->priv_addr.addr.sa4.sin_addr;
+	if (expire > 0) {
+		slice = now / expire;
+		*end = (slice + 2) * expire;
+	}
 
-	keylen = make_greylisting_key (key,
-			sizeof (key),
-			cfg->white_prefix,
-			blake_hash);
+	*keylen = make_greylisting_key_compact (cfg, key, MAXKEYLEN, prefix, hash,
+			slice);
 
-	dlen = sizeof (*tm1);
+	if (*keylen == -1) {
+		return false;
+	}
 
-	if (rmilter_query_cache (cfg, RMILTER_QUERY_WHITELIST, key, keylen,
-			(unsigned char **)&tm1, &dlen, priv)) {
-		elapsed = tm1->tv_sec + cfg->whitelisting_expire;
-		localtime_r (&elapsed, &tm_parsed);
-		strftime (timebuf, sizeof (timebuf), "%F %T", &tm_parsed);
-		snprintf (hdr_buf, hdr_size, "Whitelisted till %s, type: %s",
-				timebuf, type);
+	if (slice > 0) {
+		*keylen_prev = make_greylisting_key_compact (cfg, key_prev, MAXKEYLEN,
+				prefix, hash, slice - 1);
+	}
 
-		return GREY_WHITELISTED;
+	return true;
+}
+
+static bool
+greylisting_init_hash (struct config_file *cfg, struct greylisting_hash *gh,
+		const u_char *blake_hash, const char *type, time_t now)
+{
+	memset (gh, 0, sizeof (*gh));
+	gh->type = type;
+	gh->migrate_idx = -1;
+	gh->prev_idx = -1;
+
+	if (cfg->greylisting_format == GREY_FORMAT_LEGACY) {
+		gh->white_keylen = make_greylisting_key (gh->white_key,
+				sizeof (gh->white_key),
+				cfg->white_prefix,
+				blake_hash);
+		gh->grey_keylen = make_greylisting_key (gh->grey_key,
+				sizeof (gh->grey_key),
+				cfg->grey_prefix,
+				blake_hash);
+		rmilter_strlcpy (gh->name, gh->grey_key, sizeof (gh->name));
+
+		return true;
+	}
+
+	gh->compact = true;
+	rmilter_encode_hex_buf (blake_hash, GREY_DIGEST_LEN, gh->name,
+			sizeof (gh->name));
+
+	if (cfg->greylisting_buckets > 0 && cfg->cache_use_redis) {
+		memcpy (gh->field, blake_hash, GREY_DIGEST_LEN);
+		gh->fieldlen = GREY_DIGEST_LEN;
+
+		if (!greylisting_bucket_keys (cfg, gh->white_key, &gh->white_keylen,
+				gh->white_key_prev, &gh->white_keylen_prev,
+				&gh->white_bucket_end, cfg->white_prefix, blake_hash,
+				cfg->whitelisting_expire, now) ||
+				!greylisting_bucket_keys (cfg, gh->grey_key, &gh->grey_keylen,
+				gh->grey_key_prev, &gh->grey_keylen_prev,
+				&gh->grey_bucket_end, cfg->grey_prefix, blake_hash,
+				cfg->greylisting_expire, now)) {
+			return false;
+		}
+	}
+	else {
+		gh->white_keylen = make_greylisting_key_compact (cfg, gh->white_key,
+				sizeof (gh->white_key), cfg->white_prefix, blake_hash, 0);
+		gh->grey_keylen = make_greylisting_key_compact (cfg, gh->grey_key,
+				sizeof (gh->grey_key), cfg->grey_prefix, blake_hash, 0);
+
+		if (gh->white_keylen == -1 || gh->grey_keylen == -1) {
+			return false;
+		}
+	}
+
+	if (cfg->greylisting_format == GREY_FORMAT_MIGRATE) {
+		gh->migrate = true;
+		gh->white_keylen_old = make_greylisting_key (gh->white_key_old,
+				sizeof (gh->white_key_old),
+				cfg->white_prefix,
+				blake_hash);
+		gh->grey_keylen_old = make_greylisting_key (gh->grey_key_old,
+				sizeof (gh->grey_key_old),
+				cfg->grey_prefix,
+				blake_hash);
+	}
+
+	return true;
+}
+
+/*
+ * Adds white and grey keys queries (and legacy and previous slice ones),
+ * returns number of queries added, no more than GREY_MAX_QUERIES
+ */
+static unsigned int
+greylisting_add_queries (struct greylisting_hash *gh,
+		struct rmilter_cache_query *q)
+{
+	unsigned int n = 2;
+
+	memset (q, 0, sizeof (*q) * 2);
+	q[0].type = RMILTER_QUERY_WHITELIST;
+	q[0].key = (const unsigned char *)gh->white_key;
+	q[0].keylen = gh->white_keylen;
+	q[1].type = RMILTER_QUERY_GREYLIST;
+	q[1].key = (const unsigned char *)gh->grey_key;
+	q[1].keylen = gh->grey_keylen;
+
+	if (gh->fieldlen > 0) {
+		q[0].field = gh->field;
+		q[0].fieldlen = gh->fieldlen;
+		q[1].field = gh->field;
+		q[1].fieldlen = gh->fieldlen;
+	}
+
+	if (gh->migrate) {
+		gh->migrate_idx = n;
+		memset (&q[n], 0, sizeof (*q) * 2);
+		q[n].type = RMILTER_QUERY_WHITELIST;
+		q[n].key = (const unsigned char *)gh->white_key_old;
+		q[n].keylen = gh->white_keylen_old;
+		q[n + 1].type = RMILTER_QUERY_GREYLIST;
+		q[n + 1].key = (const unsigned char *)gh->grey_key_old;
+		q[n + 1].keylen = gh->grey_keylen_old;
+		n += 2;
+	}
+
+	if (gh->white_keylen_prev > 0 && gh->grey_keylen_prev > 0) {
+		gh->prev_idx = n;
+		memset (&q[n], 0, sizeof (*q) * 2);
+		q[n].type = RMILTER_QUERY_WHITELIST;
+		q[n].key = (const unsigned char *)gh->white_key_prev;
+		q[n].keylen = gh->white_keylen_prev;
+		q[n].field = gh->field;
+		q[n].fieldlen = gh->fieldlen;
+		q[n + 1].type = RMILTER_QUERY_GREYLIST;
+		q[n + 1].key = (const unsigned char *)gh->grey_key_prev;
+		q[n + 1].keylen = gh->grey_keylen_prev;
+		q[n + 1].field = gh->field;
+		q[n + 1].fieldlen = gh->fieldlen;
+		n += 2;
+	}
+
+	return n;
+}
+
+/*
+ * Extracts timestamp from a record in any format
+ */
+static bool
+greylisting_parse_time (const struct rmilter_cache_query *q, time_t *res)
+{
+	struct timeval tv;
+	uint32_t ts;
+
+	if (q->data == NULL) {
+		return false;
+	}
+
+	if (q->datalen == sizeof (ts)) {
+		memcpy (&ts, q->data, sizeof (ts));
+		*res = ntohl (ts);
+
+		return true;
+	}
+	else if (q->datalen == sizeof (tv)) {
+		memcpy (&tv, q->data, sizeof (tv));
+		*res = tv.tv_sec;
+
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Finds white or grey record, records in hash buckets expire with the whole
+ * bucket only, so their age is checked here
+ */
+static bool
+greylisting_find_record (struct config_file *cfg, struct greylisting_hash *gh,
+		const struct rmilter_cache_query *q, bool white, time_t now,
+		time_t *res)
+{
+	unsigned int idx = white ? 0 : 1;
+	time_t expire;
+
+	expire = white ? cfg->whitelisting_expire : cfg->greylisting_expire;
+
+	if (greylisting_parse_time (&q[idx], res)) {
+		if (gh->fieldlen == 0 || expire == 0 || *res + expire > now) {
+			return true;
+		}
+	}
+
+	if (gh->prev_idx != -1 &&
+			greylisting_parse_time (&q[gh->prev_idx + idx], res) &&
+			(expire == 0 || *res + expire > now)) {
+		return true;
+	}
+
+	if (gh->migrate_idx != -1 &&
+			greylisting_parse_time (&q[gh->migrate_idx + idx], res)) {
+		return true;
+	}
+
+	return false;
+}
+
+static bool
+greylisting_store (struct config_file *cfg, struct mlfi_priv *priv,
+		struct greylisting_hash *gh, bool white, struct timeval *tm)
+{
+	struct rmilter_cache_update u;
+	uint32_t ts;
+
+	memset (&u, 0, sizeof (u));
+
+	if (white) {
+		u.type = RMILTER_QUERY_WHITELIST;
+		u.key = (const unsigned char *)gh->white_key;
+		u.keylen = gh->white_keylen;
+		u.expire = cfg->whitelisting_expire;
+	}
+	else {
+		u.type = RMILTER_QUERY_GREYLIST;
+		u.key = (const unsigned char *)gh->grey_key;
+		u.keylen = gh->grey_keylen;
+		u.expire = cfg->greylisting_expire;
 	}
 
-	if (tm1) {
-		free (tm1);
+	if (!gh->compact) {
+		return rmilter_set_cache (cfg, u.type, u.key, u.keylen,
+				(unsigned char *)tm, sizeof (*tm), u.expire, priv);
+	}
+
+	ts = htonl ((uint32_t)tm->tv_sec);
+	u.data = (const unsigned char *)&ts;
+	u.datalen = sizeof (ts);
+
+	if (gh->fieldlen > 0) {
+		u.field = gh->field;
+		u.fieldlen = gh->fieldlen;
+
+		/* Bucket expires at the end of the next slice, it is never prolonged */
+		if (u.expire > 0) {
+			u.expire = (white ? gh->white_bucket_end : gh->grey_bucket_end) -
+					tm->tv_sec;
+		}
 	}
 
-	/* Try to get record from memcached_grey */
-	keylen = make_greylisting_key (key,
-			sizeof (key),
-			cfg->grey_prefix,
-			blake_hash);
-	tm1 = NULL;
-	dlen = sizeof (*tm1);
+	return rmilter_set_cache_multi (cfg, &u, 1, priv) == 1;
+}
+
+/*
+ * Checks greylisting records for a single hash, `q` points to the results of
+ * white and grey keys queries prepared by greylisting_add_queries
+ */
+static int
+greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
+		struct greylisting_hash *gh, const struct rmilter_cache_query *q,
+		bool *exists, char *hdr_buf, size_t hdr_size)
+{
+	char timebuf[64], timebuf_expire[64];
+	time_t elapsed, created;
+	struct timeval tm;
+	struct tm tm_parsed;
+	const char *type = gh->type;
 
 	if (gettimeofday (&tm, NULL) == -1) {
 		msg_err ("<%s>; gettimeofday failed: %s", priv->mlfi_id,
@@ -122,12 +453,24 @@ greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
 		return GREY_WHITELISTED;
 	}
 
-	if (!rmilter_query_cache (cfg, RMILTER_QUERY_GREYLIST, key, keylen,
-			(unsigned char **)&tm1, &dlen, priv)) {
+	if (greylisting_find_record (cfg, gh, q, true, tm.tv_sec, &created)) {
+		elapsed = created + cfg->whitelisting_expire;
+		localtime_r (&elapsed, &tm_parsed);
+		strftime (timebuf, sizeof (timebuf), "%F %T", &tm_parsed);
+		snprintf (hdr_buf, hdr_size, "Whitelisted till %s, type: %s",
+				timebuf, type);
+
+		if (exists) {
+			*exists = true;
+		}
+
+		return GREY_WHITELISTED;
+	}
+
+	if (!greylisting_find_record (cfg, gh, q, false, tm.tv_sec, &created)) {
 		/* Greylisting record does not exist or is insane, writing new one */
 
-		if (rmilter_set_cache (cfg, RMILTER_QUERY_GREYLIST, key, keylen,
-				(unsigned char *)&tm, sizeof (tm), cfg->greylisting_expire, priv)) {
+		if (greylisting_store (cfg, priv, gh, false, &tm)) {
 
 			if (exists) {
 				*exists = false;
@@ -143,18 +486,12 @@ greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
 					"greylisted till %s, expire at %s, type: %s",
 					timebuf, timebuf_expire, type);
 			msg_info ("<%s>; greylisting_check_hash: greylisted key: '%s': %s",
-					priv->mlfi_id, key, hdr_buf);
-			if (tm1) {
-				free (tm1);
-			}
+					priv->mlfi_id, gh->name, hdr_buf);
 		}
 		else {
 			msg_err ("<%s>; greylisting_check_hash: cannot store greylisting data: "
 					"type: %s, key: '%s'",
-					priv->mlfi_id, type, key);
-			if (tm1) {
-				free (tm1);
-			}
+					priv->mlfi_id, type, gh->name);
 
 			return GREY_WHITELISTED;
 		}
@@ -167,8 +504,8 @@ greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
 			*exists = true;
 		}
 
-		if (tm1 && tm1->tv_sec > tm.tv_sec) {
-			elapsed = tm1->tv_sec;
+		if (created > tm.tv_sec) {
+			elapsed = created;
 			localtime_r (&elapsed, &tm_parsed);
 			strftime (timebuf, sizeof (timebuf), "%F %T", &tm_parsed);
 			elapsed = time (NULL);
@@ -176,16 +513,15 @@ greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
 			strftime (timebuf_expire, sizeof (timebuf_expire), "%F %T", &tm_parsed);
 			msg_info ("<%s>; greylisting_check_hash: key: '%s': is created in "
 					"future: %s, while now it is only %s, ignore record",
-					priv->mlfi_id, key, timebuf, timebuf_expire);
-			free (tm1);
+					priv->mlfi_id, gh->name, timebuf, timebuf_expire);
 
 			return GREY_WHITELISTED;
 		}
 
-		if ((unsigned int) tm.tv_sec - tm1->tv_sec < cfg->greylisting_timeout) {
+		if ((unsigned int) tm.tv_sec - created < cfg->greylisting_timeout) {
 			/* Client comes too early */
 
-			elapsed = tm1->tv_sec + cfg->greylisting_timeout;
+			elapsed = created + cfg->greylisting_timeout;
 			localtime_r (&elapsed, &tm_parsed);
 			strftime (timebuf, sizeof (timebuf), "%F %T", &tm_parsed);
 			elapsed = time (NULL) + cfg->greylisting_expire;
@@ -193,43 +529,28 @@ greylisting_check_hash (struct config_file *cfg, struct mlfi_priv *priv,
 			strftime (timebuf_expire, sizeof (timebuf_expire), "%F %T", &tm_parsed);
 			snprintf (hdr_buf, hdr_size, "%d seconds passed, "
 					"greylisted till %s, expire at %s, type: %s",
-					(int)(tm.tv_sec - tm1->tv_sec),
+					(int)(tm.tv_sec - created),
 					timebuf, timebuf_expire, type);
 			msg_info ("<%s>; greylisting_check_hash: greylisted key: '%s': %s",
-					priv->mlfi_id, key, hdr_buf);
-
-			if (tm1) {
-				free (tm1);
-			}
+					priv->mlfi_id, gh->name, hdr_buf);
 
 			return GREY_GREYLISTED;
 		}
 		else {
-			elapsed = tm1->tv_sec + cfg->whitelisting_expire;
+			elapsed = created + cfg->whitelisting_expire;
 			localtime_r (&elapsed, &tm_parsed);
 			strftime (timebuf, sizeof (timebuf), "%F %T", &tm_parsed);
 
 			snprintf (hdr_buf, hdr_size, "Greylisted for %d seconds, "
 					"whitelisted till %s, type: %s",
-					(int)(tm.tv_sec - tm1->tv_sec),
+					(int)(tm.tv_sec - created),
 					timebuf, type);
 
-			if (tm1) {
-				free (tm1);
-			}
-
 			/* Write to whitelist memcached server */
-			keylen = make_greylisting_key (key,
-					sizeof (key),
-					cfg->white_prefix,
-					blake_hash);
-
-			if (!rmilter_set_cache (cfg, RMILTER_QUERY_WHITELIST, key, keylen,
-							(unsigned char *)&tm, sizeof (tm),
-							cfg->whitelisting_expire, priv)) {
+			if (!greylisting_store (cfg, priv, gh, true, &tm)) {
 				msg_err ("<%s>; greylisting_check_hash: cannot store whitelisting data: "
 						"type %s, key: '%s'",
-						priv->mlfi_id, type, key);
+						priv->mlfi_id, type, gh->name);
 			}
 		}
 	}
@@ -250,8 +571,12 @@ check_greylisting (void *_ctx, struct config_file *cfg, struct mlfi_priv *priv)
 	struct stat st;
 	unsigned long map_len;
 	const long max_map_len = 10 * 1024;
-	bool exists = false;
-	int ret = GREY_ERROR, fd, ahits;
+	struct greylisting_hash data_hash, env_hash;
+	struct rmilter_cache_query queries[GREY_MAX_QUERIES * 2];
+	time_t now;
+	bool exists = false, has_data = false;
+	unsigned int i, nqueries = 0, env_idx;
+	int ret = GREY_ERROR, fd;
 	SMFICTX *ctx = _ctx;
 
 	addr = priv->priv_addr.family == AF_INET6
@@ -272,6 +597,7 @@ check_greylisting (void *_ctx, struct config_file *cfg, struct mlfi_priv *priv)
 	}
 
 	greylist_buf[0] = 0;
+	now = time (NULL);
 	/* First of all, check if we have some body */
 	if (priv->eoh_pos > 0 && stat (priv->file, &st) != -1) {
 		fd = open (priv->file, O_RDONLY);
@@ -308,20 +634,17 @@ check_greylisting (void *_ctx, struct config_file *cfg, struct mlfi_priv *priv)
 				blake2b_final (&mdctx, final, BLAKE2B_OUTBYTES);
 				munmap (map, st.st_size);
 
-				ret = greylisting_check_hash (cfg, priv, final, &exists,
-						greylist_buf, sizeof (greylist_buf), "data hash");
+				if (greylisting_init_hash (cfg, &data_hash, final,
+						"data hash", now)) {
+					nqueries += greylisting_add_queries (&data_hash,
+							&queries[nqueries]);
+					has_data = true;
+				}
 			}
 		}
 	}
 
-	if (exists) {
-		/*
-		 * If data hash exists, there is no reason to check more hashes
-		 */
-		goto end;
-	}
-
-	/* Try also to set envelope hash */
+	/* Envelope hash is requested in the same query as data hash */
 
 	if (priv->priv_from[0] == '\0') {
 		from = "<>";
@@ -358,11 +681,40 @@ check_greylisting (void *_ctx, struct config_file *cfg, struct mlfi_priv *priv)
 
 	blake2b_final (&mdctx, final, BLAKE2B_OUTBYTES);
 
-	ret = greylisting_check_hash (cfg, priv, final, &exists,
-			greylist_buf, sizeof (greylist_buf), "sender, IP, recipients");
+	if (!greylisting_init_hash (cfg, &env_hash, final, "sender, IP, recipients",
+			now)) {
+		ret = GREY_WHITELISTED;
+		goto end;
+	}
+
+	env_idx = nqueries;
+	nqueries += greylisting_add_queries (&env_hash, &queries[nqueries]);
+
+	rmilter_query_cache_multi (cfg, queries, nqueries, priv);
+
+	if (has_data) {
+		ret = greylisting_check_hash (cfg, priv, &data_hash, &queries[0],
+				&exists, greylist_buf, sizeof (greylist_buf));
+
+		if (exists) {
+			/*
+			 * If data hash exists, there is no reason to check more hashes
+			 */
+			goto end;
+		}
+	}
+
+	ret = greylisting_check_hash (cfg, priv, &env_hash, &queries[env_idx],
+			&exists, greylist_buf, sizeof (greylist_buf));
 
 end:
 
+	for (i = 0; i < nqueries; i ++) {
+		if (queries[i].data) {
+			free (queries[i].data);
+		}
+	}
+
 	if (greylist_buf[0] != 0) {
 		smfi_addheader (ctx, GREYLISTING_HEADER, greylist_buf);
 	}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cfg_file.h"
+#include "rmilter.h"
+#include "upstream.h"
+#include "healthcheck.h"
+#include "resolver.h"
+#include "util.h"
+#include <poll.h>
+
+/*
+ * Health check thread: every `healthcheck_interval` it sends a cheap request
+ * to each configured server and waits for the expected reply no longer than
+ * `healthcheck_timeout`. Servers that fail are marked as dead at once, dead
+ * servers that reply are revived without waiting for `dead_time`. Probes are
+ * sent sequentially under the config read lock, so pointers to servers remain
+ * valid while the round is in progress.
+ */
+#define HEALTHCHECK_BUFSIZE 512
+
+extern struct config_file *cfg;
+
+static struct rmilter_healthcheck_stat hc_stat;
+static pthread_once_t hc_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Sends request and waits for a reply containing `expect`
+ */
+static bool
+rmilter_healthcheck_probe (struct mlfi_priv *priv, const char *addr,
+		struct rmilter_resolved *resolved, int port, const char *req,
+		size_t reqlen, const char *expect, unsigned int timeout)
+{
+	char buf[HEALTHCHECK_BUFSIZE];
+	struct timeval start, now;
+	size_t nread = 0;
+	ssize_t r;
+	int s, remain;
+	bool ret = false;
+
+	gettimeofday (&start, NULL);
+	s = rmilter_resolver_connect (resolved, addr, port, timeout, priv);
+
+	if (s == -1) {
+		return false;
+	}
+
+	if (write (s, req, reqlen) != (ssize_t)reqlen) {
+		msg_debug ("<%s>; healthcheck: write to %s failed: %s", priv->mlfi_id,
+				addr, strerror (errno));
+		close (s);
+		return false;
+	}
+
+	while (nread < sizeof (buf) - 1) {
+		gettimeofday (&now, NULL);
+		remain = timeout - ((now.tv_sec - start.tv_sec) * 1000 +
+				(now.tv_usec - start.tv_usec) / 1000);
+
+		if (remain <= 0 || rmilter_poll_fd (s, remain, POLLIN) < 1) {
+			break;
+		}
+
+		r = read (s, buf + nread, sizeof (buf) - nread - 1);
+
+		if (r <= 0) {
+			break;
+		}
+
+		nread += r;
+		buf[nread] = '\0';
+
+		if (strstr (buf, expect) != NULL) {
+			ret = true;
+			break;
+		}
+	}
+
+	close (s);
+
+	return ret;
+}
+
+/*
+ * Updates state of upstream according to the probe result
+ */
+static void
+rmilter_healthcheck_apply (struct mlfi_priv *priv, struct upstream *up,
+		const char *name, int port, bool alive, time_t now)
+{
+	__sync_fetch_and_add (&hc_stat.probes, 1);
+
+	if (alive) {
+		if (up->dead) {
+			msg_info ("<%s>; healthcheck: %s:%d is alive again", priv->mlfi_id,
+					name, port);
+			__sync_fetch_and_add (&hc_stat.revived, 1);
+			upstream_mark_alive (up);
+		}
+	}
+	else {
+		__sync_fetch_and_add (&hc_stat.failures, 1);
+
+		if (!up->dead) {
+			msg_warn ("<%s>; healthcheck: %s:%d is not responding, marking it "
+					"as dead", priv->mlfi_id, name, port);
+			__sync_fetch_and_add (&hc_stat.killed, 1);
+			upstream_mark_dead (up, now);
+		}
+	}
+}
+
+static void
+rmilter_healthcheck_spamd (struct mlfi_priv *priv, struct config_file *cfg,
+		struct spamd_server *servers, unsigned int nservers, time_t now)
+{
+	static const char req[] = "GET /ping HTTP/1.0\r\n\r\n";
+	unsigned int i;
+	bool alive;
+
+	if (!upstream_attach_set (servers, nservers, sizeof (*servers), now,
+			cfg->spamd_error_time, cfg->spamd_dead_time, cfg->spamd_maxerrors,
+			priv)) {
+		return;
+	}
+
+	for (i = 0; i < nservers; i ++) {
+		alive = rmilter_healthcheck_probe (priv, servers[i].name,
+				servers[i].resolved, servers[i].port, req, sizeof (req) - 1,
+				"pong", cfg->healthcheck_timeout);
+		rmilter_healthcheck_apply (priv, &servers[i].up, servers[i].name,
+				servers[i].port, alive, now);
+	}
+}
+
+static void
+rmilter_healthcheck_clamav (struct mlfi_priv *priv, struct config_file *cfg,
+		time_t now)
+{
+	static const char req[] = "nPING\n";
+	struct clamav_server *srv;
+	unsigned int i;
+	bool alive;
+
+	if (!upstream_attach_set (cfg->clamav_servers, cfg->clamav_servers_num,
+			sizeof (*srv), now, cfg->clamav_error_time, cfg->clamav_dead_time,
+			cfg->clamav_maxerrors, priv)) {
+		return;
+	}
+
+	for (i = 0; i < cfg->clamav_servers_num; i ++) {
+		srv = &cfg->clamav_servers[i];
+		alive = rmilter_healthcheck_probe (priv, srv->name, srv->resolved,
+				srv->port, req, sizeof (req) - 1, "PONG",
+				cfg->healthcheck_timeout);
+		rmilter_healthcheck_apply (priv, &srv->up, srv->name, srv->port,
+				alive, now);
+	}
+}
+
+static void
+rmilter_healthcheck_cache (struct mlfi_priv *priv, struct config_file *cfg,
+		struct cache_server *servers, unsigned int nservers, time_t now)
+{
+	static const char redis_req[] = "*1\r\n$4\r\nPING\r\n",
+			memcached_req[] = "version\r\n";
+	struct cache_server *srv;
+	unsigned int i;
+	char req[HEALTHCHECK_BUFSIZE];
+	int reqlen;
+	bool alive;
+
+	if (nservers == 0 || !upstream_attach_set (servers, nservers,
+			sizeof (*srv), now, cfg->cache_error_time, cfg->cache_dead_time,
+			cfg->cache_maxerrors, priv)) {
+		return;
+	}
+
+	for (i = 0; i < nservers; i ++) {
+		srv = &servers[i];
+
+		if (srv->is_redis && cfg->cache_password) {
+			/* Otherwise PING is answered with NOAUTH error */
+			reqlen = snprintf (req, sizeof (req),
+					"*2\r\n$4\r\nAUTH\r\n$%zu\r\n%s\r\n%s",
+					strlen (cfg->cache_password), cfg->cache_password,
+					redis_req);
+
+			if (reqlen >= (int)sizeof (req)) {
+				msg_err ("<%s>; healthcheck: password is too long, cannot "
+						"check %s", priv->mlfi_id, srv->addr);
+				continue;
+			}
+
+			alive = rmilter_healthcheck_probe (priv, srv->addr,
+					srv->resolved, srv->port, req, reqlen, "+PONG",
+					cfg->healthcheck_timeout);
+		}
+		else if (srv->is_redis) {
+			alive = rmilter_healthcheck_probe (priv, srv->addr,
+					srv->resolved, srv->port, redis_req,
+					sizeof (redis_req) - 1, "+PONG", cfg->healthcheck_timeout);
+		}
+		else {
+			alive = rmilter_healthcheck_probe (priv, srv->addr,
+					srv->resolved, srv->port, memcached_req,
+					sizeof (memcached_req) - 1, "VERSION",
+					cfg->healthcheck_timeout);
+		}
+
+		rmilter_healthcheck_apply (priv, &srv->up, srv->addr, srv->port,
+				alive, now);
+
+		if (srv->nreplicas > 0) {
+			rmilter_healthcheck_cache (priv, cfg, srv->replicas,
+					srv->nreplicas, now);
+		}
+	}
+}
+
+static void
+rmilter_healthcheck_round (struct mlfi_priv *priv, struct config_file *cfg)
+{
+	time_t now;
+
+	now = time (NULL);
+
+	rmilter_healthcheck_spamd (priv, cfg, cfg->spamd_servers,
+			cfg->spamd_servers_num, now);
+	rmilter_healthcheck_spamd (priv, cfg, cfg->extra_spamd_servers,
+			cfg->extra_spamd_servers_num, now);
+	rmilter_healthcheck_clamav (priv, cfg, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_limits,
+			cfg->cache_servers_limits_num, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_grey,
+			cfg->cache_servers_grey_num, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_white,
+			cfg->cache_servers_white_num, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_id,
+			cfg->cache_servers_id_num, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_copy,
+			cfg->cache_servers_copy_num, now);
+	rmilter_healthcheck_cache (priv, cfg, cfg->cache_servers_spam,
+			cfg->cache_servers_spam_num, now);
+}
+
+static void *
+rmilter_healthcheck_thread (void *unused)
+{
+	struct mlfi_priv *priv;
+	unsigned int interval;
+
+	if ((priv = rmilter_thread_priv ("healthcheck")) == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		CFG_RLOCK();
+		interval = cfg->healthcheck_interval;
+
+		if (interval > 0) {
+			rmilter_healthcheck_round (priv, cfg);
+		}
+
+		CFG_UNLOCK();
+		rmilter_thread_sleep (interval);
+	}
+
+	return NULL;
+}
+
+static void
+rmilter_healthcheck_init (void)
+{
+	rmilter_thread_start ("healthcheck", rmilter_healthcheck_thread, NULL);
+}
+
+void
+rmilter_healthcheck_start (void)
+{
+	pthread_once (&hc_once, rmilter_healthcheck_init);
+}
+
+void
+rmilter_healthcheck_get_stat (struct rmilter_healthcheck_stat *st)
+{
+	rmilter_stat_snapshot (st, &hc_stat, sizeof (*st));
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_HEALTHCHECK_H_
+#define SRC_HEALTHCHECK_H_
+
+#include "config.h"
+
+struct rmilter_healthcheck_stat {
+	uint64_t probes;			/* probes sent */
+	uint64_t failures;			/* probes failed */
+	uint64_t killed;			/* upstreams marked as dead by probes */
+	uint64_t revived;			/* upstreams revived by probes */
+};
+
+/**
+ * Start the health check thread. It periodically probes rspamd (GET /ping),
+ * clamav (PING) and cache servers (PING for redis, version for memcached)
+ * configured in the current config and marks them as dead or alive, so
+ * upstreams selection skips failed servers before requests are sent to them.
+ * Probing is disabled while `healthcheck_interval` is 0.
+ */
+void rmilter_healthcheck_start (void);
+
+void rmilter_healthcheck_get_stat (struct rmilter_healthcheck_stat *st);
+
+#endif /* SRC_HEALTHCHECK_H_ */
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "config.h"
+#include "cfg_file.h"
+#include "lcache.h"
+#include "uthash.h"
+#include "utlist.h"
+#include "xxhash.h"
+
+/*
+ * Local (in-process) cache for rarely changed values, such as whitelisting
+ * records and message ids. The cache is split into shards, each shard has its
+ * own lock, hash table and LRU list, so threads looking for different keys
+ * rarely contend.
+ */
+#define LCACHE_SHARDS 16
+#define LCACHE_SEED 0xabadcafe
+
+struct rmilter_lcache_elt {
+	UT_hash_handle hh;
+	struct rmilter_lcache_elt *prev, *next;
+	time_t expire;
+	size_t keylen;
+	size_t datalen;
+	unsigned char *data;
+	unsigned char key[];
+};
+
+struct rmilter_lcache_shard {
+	pthread_mutex_t mtx;
+	struct rmilter_lcache_elt *hash;
+	struct rmilter_lcache_elt *lru;		/* most recently used first */
+	size_t bytes;
+	size_t max_bytes;
+};
+
+static struct rmilter_lcache_shard shards[LCACHE_SHARDS];
+static pthread_once_t lcache_once = PTHREAD_ONCE_INIT;
+static struct rmilter_lcache_stat lcache_stat;
+
+#define LCACHE_STAT_INC(field) __sync_fetch_and_add (&lcache_stat.field, 1)
+#define LCACHE_STAT_ADD(field, n) __sync_fetch_and_add (&lcache_stat.field, (n))
+#define LCACHE_STAT_SUB(field, n) __sync_fetch_and_sub (&lcache_stat.field, (n))
+
+static void
+rmilter_lcache_init_once (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < LCACHE_SHARDS; i ++) {
+		pthread_mutex_init (&shards[i].mtx, NULL);
+	}
+}
+
+static inline size_t
+rmilter_lcache_elt_size (struct rmilter_lcache_elt *elt)
+{
+	return sizeof (*elt) + elt->keylen + elt->datalen;
+}
+
+/* Key is prepended with the query type to separate values of distinct types */
+static size_t
+rmilter_lcache_make_key (enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen, unsigned char *buf)
+{
+	buf[0] = (unsigned char)type;
+	memcpy (buf + 1, key, keylen);
+
+	return keylen + 1;
+}
+
+static struct rmilter_lcache_shard *
+rmilter_lcache_get_shard (const unsigned char *key, size_t keylen)
+{
+	return &shards[XXH64 (key, keylen, LCACHE_SEED) % LCACHE_SHARDS];
+}
+
+/* Must be called with shard locked */
+static void
+rmilter_lcache_elt_remove (struct rmilter_lcache_shard *shard,
+		struct rmilter_lcache_elt *elt)
+{
+	size_t sz = rmilter_lcache_elt_size (elt);
+
+	HASH_DEL (shard->hash, elt);
+	DL_DELETE (shard->lru, elt);
+	shard->bytes -= sz;
+	LCACHE_STAT_SUB (bytes, sz);
+	LCACHE_STAT_SUB (elts, 1);
+	free (elt);
+}
+
+void
+rmilter_lcache_init (struct config_file *cfg)
+{
+	struct rmilter_lcache_elt *elt, *tmp;
+	unsigned int i;
+
+	pthread_once (&lcache_once, rmilter_lcache_init_once);
+
+	for (i = 0; i < LCACHE_SHARDS; i ++) {
+		pthread_mutex_lock (&shards[i].mtx);
+
+		HASH_ITER (hh, shards[i].hash, elt, tmp) {
+			rmilter_lcache_elt_remove (&shards[i], elt);
+		}
+
+		shards[i].max_bytes = cfg->local_cache_size / LCACHE_SHARDS;
+		pthread_mutex_unlock (&shards[i].mtx);
+	}
+}
+
+bool
+rmilter_lcache_eligible (struct config_file *cfg,
+		enum rmilter_query_type type)
+{
+	if (cfg->local_cache_size == 0 || cfg->local_cache_ttl == 0) {
+		return false;
+	}
+
+	return (type == RMILTER_QUERY_WHITELIST || type == RMILTER_QUERY_ID);
+}
+
+bool
+rmilter_lcache_lookup (enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen,
+		unsigned char **data, size_t *datalen)
+{
+	struct rmilter_lcache_shard *shard;
+	struct rmilter_lcache_elt *elt;
+	unsigned char kbuf[MAXKEYLEN + 1];
+	size_t klen;
+	bool ret = false;
+
+	if (keylen > MAXKEYLEN) {
+		return false;
+	}
+
+	klen = rmilter_lcache_make_key (type, key, keylen, kbuf);
+	shard = rmilter_lcache_get_shard (kbuf, klen);
+
+	pthread_mutex_lock (&shard->mtx);
+	HASH_FIND (hh, shard->hash, kbuf, klen, elt);
+
+	if (elt) {
+		if (elt->expire < time (NULL)) {
+			rmilter_lcache_elt_remove (shard, elt);
+			LCACHE_STAT_INC (expired);
+			elt = NULL;
+		}
+		else {
+			*data = malloc (elt->datalen);
+
+			if (*data) {
+				memcpy (*data, elt->data, elt->datalen);
+				*datalen = elt->datalen;
+				ret = true;
+			}
+
+			/* Move to the head of LRU */
+			DL_DELETE (shard->lru, elt);
+			DL_PREPEND (shard->lru, elt);
+		}
+	}
+
+	pthread_mutex_unlock (&shard->mtx);
+
+	if (ret) {
+		LCACHE_STAT_INC (hits);
+	}
+	else {
+		LCACHE_STAT_INC (misses);
+	}
+
+	return ret;
+}
+
+void
+rmilter_lcache_insert (struct config_file *cfg,
+		enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen,
+		const unsigned char *data, size_t datalen, unsigned expire)
+{
+	struct rmilter_lcache_shard *shard;
+	struct rmilter_lcache_elt *elt, *old;
+	unsigned char kbuf[MAXKEYLEN + 1];
+	size_t klen, sz;
+	unsigned ttl;
+
+	if (keylen > MAXKEYLEN) {
+		return;
+	}
+
+	klen = rmilter_lcache_make_key (type, key, keylen, kbuf);
+	sz = sizeof (*elt) + klen + datalen;
+	shard = rmilter_lcache_get_shard (kbuf, klen);
+	elt = malloc (sz);
+
+	if (elt == NULL) {
+		return;
+	}
+
+	ttl = cfg->local_cache_ttl / 1000;
+
+	if (expire > 0 && expire < ttl) {
+		ttl = expire;
+	}
+
+	elt->expire = time (NULL) + ttl;
+	elt->keylen = klen;
+	elt->datalen = datalen;
+	memcpy (elt->key, kbuf, klen);
+	elt->data = elt->key + klen;
+	memcpy (elt->data, data, datalen);
+
+	pthread_mutex_lock (&shard->mtx);
+
+	if (sz > shard->max_bytes) {
+		pthread_mutex_unlock (&shard->mtx);
+		free (elt);
+
+		return;
+	}
+
+	HASH_FIND (hh, shard->hash, kbuf, klen, old);
+
+	if (old) {
+		rmilter_lcache_elt_remove (shard, old);
+	}
+
+	/* Evict the least recently used elements */
+	while (shard->lru && shard->bytes + sz > shard->max_bytes) {
+		rmilter_lcache_elt_remove (shard, shard->lru->prev);
+		LCACHE_STAT_INC (evicted);
+	}
+
+	HASH_ADD_KEYPTR (hh, shard->hash, elt->key, elt->keylen, elt);
+	DL_PREPEND (shard->lru, elt);
+	shard->bytes += sz;
+	LCACHE_STAT_ADD (bytes, sz);
+	LCACHE_STAT_INC (elts);
+	pthread_mutex_unlock (&shard->mtx);
+}
+
+void
+rmilter_lcache_remove (enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen)
+{
+	struct rmilter_lcache_shard *shard;
+	struct rmilter_lcache_elt *elt;
+	unsigned char kbuf[MAXKEYLEN + 1];
+	size_t klen;
+
+	if (keylen > MAXKEYLEN) {
+		return;
+	}
+
+	klen = rmilter_lcache_make_key (type, key, keylen, kbuf);
+	shard = rmilter_lcache_get_shard (kbuf, klen);
+
+	pthread_mutex_lock (&shard->mtx);
+	HASH_FIND (hh, shard->hash, kbuf, klen, elt);
+
+	if (elt) {
+		rmilter_lcache_elt_remove (shard, elt);
+	}
+
+	pthread_mutex_unlock (&shard->mtx);
+}
+
+void
+rmilter_lcache_get_stat (struct rmilter_lcache_stat *st)
+{
+	rmilter_stat_snapshot (st, &lcache_stat, sizeof (*st));
+}
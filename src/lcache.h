@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_LCACHE_H_
+#define SRC_LCACHE_H_
+
+#include "config.h"
+#include "cache.h"
+
+struct config_file;
+
+struct rmilter_lcache_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t expired;
+	uint64_t evicted;
+	uint64_t bytes;
+	uint64_t elts;
+};
+
+/**
+ * (Re)configure local cache according to the config, all cached elements are
+ * removed
+ * @param cfg
+ */
+void rmilter_lcache_init (struct config_file *cfg);
+
+/**
+ * Returns true if values of the specified type are cached locally
+ */
+bool rmilter_lcache_eligible (struct config_file *cfg,
+		enum rmilter_query_type type);
+
+/**
+ * Lookup key in the local cache
+ * @param data copy of the data found (must be freed by a caller)
+ * @param datalen length of data
+ * @return true if key has been found and it is not expired
+ */
+bool rmilter_lcache_lookup (enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen,
+		unsigned char **data, size_t *datalen);
+
+/**
+ * Insert or replace key in the local cache. Element will be evicted after
+ * `expire` seconds or after `local_cache_ttl` whatever is less
+ */
+void rmilter_lcache_insert (struct config_file *cfg,
+		enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen,
+		const unsigned char *data, size_t datalen, unsigned expire);
+
+/**
+ * Remove key from the local cache
+ */
+void rmilter_lcache_remove (enum rmilter_query_type type,
+		const unsigned char *key, size_t keylen);
+
+void rmilter_lcache_get_stat (struct rmilter_lcache_stat *st);
+
+#endif /* SRC_LCACHE_H_ */
@@ -47,6 +47,7 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "libclamc.h"
+#include "resolver.h"
 #include "sds.h"
 
 /* Maximum time in seconds during which clamav server is marked inactive after scan error */
@@ -70,7 +71,7 @@ pthread_mutex_t mx_clamav_write = PTHREAD_MUTEX_INITIALIZER;
  *
  * returns 0 when checked, -1 on some error during scan (try another server), -2
  * on unexpected error (probably clamd died on our file, fallback to another
- * host not recommended)
+ * host not recommended), -3 if scan has been cancelled by mlfi_eom
  */
 
 static int clamscan_socket(const char *file, const struct clamav_server *srv,
@@ -93,7 +94,8 @@ static int clamscan_socket(const char *file, const struct clamav_server *srv,
 	if (!srv)
 		return 0;
 
-	s = rmilter_connect_addr (srv->name, srv->port, cfg->clamav_connect_timeout, priv);
+	s = rmilter_resolver_connect (srv->resolved, srv->name, srv->port,
+			cfg->clamav_connect_timeout, priv);
 
 	if (s == -1) {
 		return -1;
@@ -185,7 +187,16 @@ static int clamscan_socket(const char *file, const struct clamav_server *srv,
 	fcntl (s, F_SETFL, ofl | O_NONBLOCK);
 
 	/* wait for reply */
-	if (rmilter_poll_fd (s, cfg->clamav_results_timeout, POLLIN) < 1) {
+	r = rmilter_poll_fd_cancel (s, cfg->clamav_results_timeout, POLLIN,
+			priv->scan_cancel_fd);
+
+	if (r == -1 && errno == ECANCELED) {
+		msg_info ("<%s>; clamav: request to %s has been cancelled",
+				priv->mlfi_id, srv->name);
+		close (s);
+		return -3;
+	}
+	else if (r < 1) {
 		msg_warn("<%s>; clamav: timeout waiting results %s", priv->mlfi_id,
 				srv->name);
 		close (s);
@@ -285,7 +296,8 @@ static int clamscan_socket(const char *file, const struct clamav_server *srv,
  *
  * returns 0 if file scanned (or not scanned due to filesize limit), -1 when
  * retry limit exceeded, -2 on unexpected error, e.g. unexpected reply from
- * server (suppose scanned message killed clamd...)
+ * server (suppose scanned message killed clamd...), -3 if scan has been
+ * cancelled
  */
 
 int clamscan (void *ctx, struct mlfi_priv *priv, struct config_file *cfg,
@@ -293,7 +305,7 @@ int clamscan (void *ctx, struct mlfi_priv *priv, struct config_file *cfg,
 {
 	int retry = 5, r = -2;
 	/* struct stat sb; */
-	struct timeval t;
+	struct timeval t, tv;
 	double ts, tf;
 	struct clamav_server *selected = NULL;
 	struct timespec sleep_ts;
@@ -323,6 +335,13 @@ int clamscan (void *ctx, struct mlfi_priv *priv, struct config_file *cfg,
 					cfg->clamav_error_time, cfg->clamav_dead_time,
 					cfg->clamav_maxerrors, priv);
 		}
+		else if (cfg->clamav_balance == BALANCE_LATENCY) {
+			selected = (struct clamav_server *) get_upstream_by_latency (
+					(void *) cfg->clamav_servers, cfg->clamav_servers_num,
+					sizeof(struct clamav_server), t.tv_sec,
+					cfg->clamav_error_time, cfg->clamav_dead_time,
+					cfg->clamav_maxerrors, priv);
+		}
 		else {
 			selected = (struct clamav_server *) get_random_upstream (
 					(void *) cfg->clamav_servers, cfg->clamav_servers_num,
@@ -336,9 +355,23 @@ int clamscan (void *ctx, struct mlfi_priv *priv, struct config_file *cfg,
 			return -1;
 		}
 
+		selected = (struct clamav_server *) upstream_acquire (&selected->up,
+				cfg->clamav_max_concurrency, cfg->clamav_concurrency_wait,
+				&tv, priv);
+
+		if (selected == NULL) {
+			msg_err("<%s>; clamscan: all servers are busy, %s", priv->mlfi_id,
+					file);
+			return -1;
+		}
+
 		msg_info ("<%s>; clamscan: start scanning message on %s", priv->mlfi_id,
 						selected->name);
 		r = clamscan_socket (file, selected, strres, strres_len, cfg, priv);
+		upstream_release (&selected->up, &tv,
+				r == 0 ? UPSTREAM_RESULT_OK :
+				(r == -3 ? UPSTREAM_RESULT_CANCELLED : UPSTREAM_RESULT_FAILED),
+				cfg->clamav_max_concurrency);
 		msg_info ("<%s>; clamscan: finish scanning message on %s", priv->mlfi_id,
 						selected->name);
 
@@ -346,6 +379,10 @@ int clamscan (void *ctx, struct mlfi_priv *priv, struct config_file *cfg,
 			upstream_ok (&selected->up, t.tv_sec);
 			break;
 		}
+		else if (r == -3) {
+			/* Server is not blamed for cancelled scan */
+			break;
+		}
 		upstream_fail (&selected->up, t.tv_sec);
 		if (r == -2) {
 			msg_warn("<%s>; clamscan: unexpected problem, %s, %s", priv->mlfi_id,
@@ -30,6 +30,7 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "libspamd.h"
+#include "resolver.h"
 #include "mfapi.h"
 #include "ucl.h"
 #include "http_parser.h"
@@ -44,6 +45,14 @@
 #define MAX_FAILED 5
 /* Maximum inactive timeout (20 min) */
 #define MAX_TIMEOUT 1200.0
+/* Number of recent scan times to calculate delay of hedged requests */
+#define HEDGE_SAMPLES 256
+/* Requests are not hedged until this number of scans is measured */
+#define HEDGE_MIN_SAMPLES 32
+/* Percentile is recalculated after this number of new scans */
+#define HEDGE_RECALC 32
+/* Attempts to select server for hedged request other than the first one */
+#define HEDGE_SELECT_TRIES 3
 
 /* Global mutexes */
 
@@ -246,52 +255,330 @@ rmilter_spamd_symcmp (struct rspamd_symbol *s1, struct rspamd_symbol *s2)
 }
 
 /*
- * rspamdscan_socket() - send file to specified host. See spamdscan() for
- * load-balanced wrapper.
- *
- * returns 0 when spam not found, 1 when spam found, -1 on some error during scan (try another server), -2
- * on unexpected error (probably clamd died on our file, fallback to another
- * host not recommended)
+ * Recent scan times used to find the delay before hedged request
  */
+static pthread_mutex_t hedge_mtx = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int hedge_samples[HEDGE_SAMPLES];
+static unsigned int hedge_nsamples, hedge_pos, hedge_fresh;
+/* Cached percentile of scan time in milliseconds, 0 if not yet known */
+static unsigned int hedge_delay, hedge_delay_pct;
+/* Hedged requests sent during the current second */
+static time_t hedge_sec;
+static unsigned int hedge_used;
 
 static int
-rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
-		const struct spamd_server *srv, struct config_file *cfg,
-		struct rspamd_metric_result *res,
-		int dkim_only)
+rspamd_hedge_cmp (const void *a, const void *b)
+{
+	unsigned int ua = *(const unsigned int *)a, ub = *(const unsigned int *)b;
+
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+static void
+rspamd_hedge_record (const struct timeval *start)
+{
+	struct timeval now;
+	long ms;
+
+	gettimeofday (&now, NULL);
+	ms = (now.tv_sec - start->tv_sec) * 1000 +
+			(now.tv_usec - start->tv_usec) / 1000;
+
+	pthread_mutex_lock (&hedge_mtx);
+	hedge_samples[hedge_pos] = ms > 0 ? ms : 0;
+	hedge_pos = (hedge_pos + 1) % HEDGE_SAMPLES;
+
+	if (hedge_nsamples < HEDGE_SAMPLES) {
+		hedge_nsamples ++;
+	}
+
+	hedge_fresh ++;
+	pthread_mutex_unlock (&hedge_mtx);
+}
+
+/*
+ * Returns delay in milliseconds after which the hedged request should be
+ * sent, 0 if there are not enough samples yet
+ */
+static unsigned int
+rspamd_hedge_get_delay (struct config_file *cfg)
+{
+	unsigned int sorted[HEDGE_SAMPLES], n, delay;
+
+	pthread_mutex_lock (&hedge_mtx);
+	n = hedge_nsamples;
+
+	if (n >= HEDGE_MIN_SAMPLES && (hedge_fresh >= HEDGE_RECALC ||
+			hedge_delay == 0 || hedge_delay_pct != cfg->spamd_hedge_percentile)) {
+		memcpy (sorted, hedge_samples, n * sizeof (sorted[0]));
+		qsort (sorted, n, sizeof (sorted[0]), rspamd_hedge_cmp);
+		hedge_delay = sorted[(n - 1) * cfg->spamd_hedge_percentile / 100];
+		/* Zero means unknown */
+		if (hedge_delay == 0) {
+			hedge_delay = 1;
+		}
+		hedge_delay_pct = cfg->spamd_hedge_percentile;
+		hedge_fresh = 0;
+	}
+
+	delay = n >= HEDGE_MIN_SAMPLES ? hedge_delay : 0;
+	pthread_mutex_unlock (&hedge_mtx);
+
+	return delay;
+}
+
+/*
+ * Takes hedged request from the budget of the current second, time is taken
+ * here as callers may hold timestamps of their start, and the budget is never
+ * moved back to an older second
+ */
+static bool
+rspamd_hedge_allow (struct config_file *cfg)
+{
+	bool ret = false;
+	time_t now;
+
+	pthread_mutex_lock (&hedge_mtx);
+	now = time (NULL);
+
+	if (now > hedge_sec) {
+		hedge_sec = now;
+		hedge_used = 0;
+	}
+
+	if (hedge_used < cfg->spamd_hedge_budget) {
+		hedge_used ++;
+		ret = true;
+	}
+
+	pthread_mutex_unlock (&hedge_mtx);
+
+	return ret;
+}
+
+/*
+ * Idle keep-alive connections to rspamd servers, shared by all threads and
+ * keyed by server address, so they survive config reloads
+ */
+struct rspamd_idle_conn {
+	int fd;
+	time_t last;
+	struct rspamd_idle_conn *prev, *next;
+};
+
+struct rspamd_pool {
+	char *key;
+	struct rspamd_idle_conn *idle;
+	unsigned int nidle;
+	UT_hash_handle hh;
+};
+
+static struct rspamd_pool *rspamd_pools = NULL;
+static pthread_mutex_t rspamd_pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+rspamd_pool_key (const struct spamd_server *srv, char *key, size_t keylen)
+{
+	snprintf (key, keylen, "%s:%d", srv->name, srv->port);
+}
+
+/*
+ * Closes connections idle for longer than timeout, called with pool locked
+ */
+static void
+rspamd_pool_expire (struct rspamd_pool *pool, struct config_file *cfg,
+		time_t now)
+{
+	struct rspamd_idle_conn *conn, *tmp;
+
+	DL_FOREACH_SAFE (pool->idle, conn, tmp) {
+		if (now - conn->last >= cfg->spamd_idle_timeout / 1000) {
+			DL_DELETE (pool->idle, conn);
+			pool->nidle --;
+			close (conn->fd);
+			free (conn);
+		}
+	}
+}
+
+/*
+ * Returns idle connection to the server or -1 if there are none. Connections
+ * closed by server are readable, so they are detected here and dropped.
+ */
+static int
+rspamd_pool_get (struct config_file *cfg, const struct spamd_server *srv)
+{
+	struct rspamd_pool *pool;
+	struct rspamd_idle_conn *conn;
+	char key[ADDRLEN + 16];
+	int s = -1;
+
+	rspamd_pool_key (srv, key, sizeof (key));
+	pthread_mutex_lock (&rspamd_pool_mtx);
+	HASH_FIND_STR (rspamd_pools, key, pool);
+
+	if (pool != NULL) {
+		rspamd_pool_expire (pool, cfg, time (NULL));
+
+		while (s == -1 && (conn = pool->idle) != NULL) {
+			DL_DELETE (pool->idle, conn);
+			pool->nidle --;
+
+			if (rmilter_poll_fd (conn->fd, 0, POLLIN) == 0) {
+				s = conn->fd;
+			}
+			else {
+				close (conn->fd);
+			}
+
+			free (conn);
+		}
+	}
+
+	pthread_mutex_unlock (&rspamd_pool_mtx);
+
+	return s;
+}
+
+/*
+ * Returns connection to the pool or closes it if the pool is full
+ */
+static void
+rspamd_pool_put (struct config_file *cfg, const struct spamd_server *srv,
+		int s)
+{
+	struct rspamd_pool *pool;
+	struct rspamd_idle_conn *conn;
+	char key[ADDRLEN + 16];
+
+	rspamd_pool_key (srv, key, sizeof (key));
+	pthread_mutex_lock (&rspamd_pool_mtx);
+	HASH_FIND_STR (rspamd_pools, key, pool);
+
+	if (pool == NULL) {
+		pool = calloc (1, sizeof (*pool));
+
+		if (pool != NULL && (pool->key = strdup (key)) == NULL) {
+			free (pool);
+			pool = NULL;
+		}
+
+		if (pool != NULL) {
+			HASH_ADD_KEYPTR (hh, rspamd_pools, pool->key, strlen (pool->key),
+					pool);
+		}
+	}
+
+	if (pool != NULL) {
+		rspamd_pool_expire (pool, cfg, time (NULL));
+	}
+
+	if (pool == NULL || pool->nidle >= cfg->spamd_keepalive_conns ||
+			(conn = malloc (sizeof (*conn))) == NULL) {
+		pthread_mutex_unlock (&rspamd_pool_mtx);
+		close (s);
+
+		return;
+	}
+
+	conn->fd = s;
+	conn->last = time (NULL);
+	/* The most recently used connections are reused first */
+	DL_PREPEND (pool->idle, conn);
+	pool->nidle ++;
+	pthread_mutex_unlock (&rspamd_pool_mtx);
+}
+
+/*
+ * Detects the end of reply by Content-Length instead of waiting for the
+ * connection to be closed
+ */
+struct rspamd_framing {
+	struct http_parser parser;
+	bool complete;
+	bool keepalive;
+	bool eof;
+};
+
+static int
+rspamd_framing_on_complete (http_parser *parser)
+{
+	struct rspamd_framing *fr = parser->data;
+
+	fr->complete = true;
+	fr->keepalive = http_should_keep_alive (parser);
+
+	return 0;
+}
+
+static const struct http_parser_settings rspamd_framing_settings = {
+	.on_message_complete = rspamd_framing_on_complete
+};
+
+static void
+rspamd_framing_init (struct rspamd_framing *fr)
+{
+	memset (fr, 0, sizeof (*fr));
+	http_parser_init (&fr->parser, HTTP_RESPONSE);
+	fr->parser.data = fr;
+}
+
+/*
+ * Closes connection or returns it to the pool if the whole reply has been
+ * read and server allows to reuse connection
+ */
+static void
+rspamdscan_release_conn (struct config_file *cfg,
+		const struct spamd_server *srv, int s, struct rspamd_framing *fr)
+{
+	if (cfg->spamd_keepalive_conns > 0 && fr->complete && fr->keepalive &&
+			!fr->eof) {
+		rspamd_pool_put (cfg, srv, s);
+	}
+	else {
+		close (s);
+	}
+}
+
+/*
+ * Sends message to the specified host using either idle keep-alive
+ * connection or a new one, returns socket in non-blocking mode or -1 on
+ * error. `pooled` is set if idle connection has been used, such a request
+ * can be retried with a new connection.
+ */
+static int
+rspamdscan_send (struct mlfi_priv *priv, const struct spamd_server *srv,
+		struct config_file *cfg, int dkim_only, bool *pooled)
 {
 	sds buf = NULL;
-	char *io_buf = NULL;
-	struct sockaddr_un server_un;
-	struct sockaddr_in server_in;
-	int s = -1, fd = -1, ofl, size = 0, ret = -1;
+	int s = -1, fd = -1, ofl, ret = -1;
 	struct stat sb;
-	struct rspamd_metric_result *cur = NULL;
 	struct rcpt *rcpt;
-	struct rspamd_symbol *cur_symbol;
-	struct http_parser parser;
-	struct http_parser_settings ps;
 	void *map = NULL;
-	const size_t iobuf_len = 16384;
 	uint64_t r;
 
-	/* somebody doesn't need reply... */
-	if (!srv) {
-		return -1;
-	}
+	*pooled = false;
 
-	s = rmilter_connect_addr (srv->name, srv->port, cfg->spamd_connect_timeout, priv);
+	if (cfg->spamd_keepalive_conns > 0) {
+		s = rspamd_pool_get (cfg, srv);
+		*pooled = (s != -1);
+	}
 
 	if (s == -1) {
-		msg_warn("<%s>; rspamd: cannot connect to %s: %s",  priv->mlfi_id,
-				srv->name, strerror (errno));
-		goto err;
-	}
+		s = rmilter_resolver_connect (srv->resolved, srv->name, srv->port,
+				cfg->spamd_connect_timeout, priv);
+
+		if (s == -1) {
+			msg_warn("<%s>; rspamd: cannot connect to %s: %s",  priv->mlfi_id,
+					srv->name, strerror (errno));
+			goto err;
+		}
 
-	if (rmilter_poll_fd (s, cfg->spamd_connect_timeout, POLLOUT) < 1) {
-		msg_warn("<%s>; rspamd: timeout waiting writing, %s",  priv->mlfi_id, srv->name);
-		errno = ETIMEDOUT;
-		goto err;
+		if (rmilter_poll_fd (s, cfg->spamd_connect_timeout, POLLOUT) < 1) {
+			msg_warn("<%s>; rspamd: timeout waiting writing, %s",  priv->mlfi_id, srv->name);
+			errno = ETIMEDOUT;
+			goto err;
+		}
 	}
 
 	if (priv->file[0] != '\0') {
@@ -319,9 +606,13 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
 
 	buf = sdsnewlen (NULL, 512);
 	sdsclear (buf);
-	buf = sdscatfmt (buf,
-			"POST /symbols HTTP/1.0\r\n",
-			(uint64_t)sb.st_size);
+	if (cfg->spamd_keepalive_conns > 0) {
+		buf = sdscatfmt (buf, "POST /symbols HTTP/1.1\r\n"
+				"Host: %s\r\nConnection: keep-alive\r\n", srv->name);
+	}
+	else {
+		buf = sdscatfmt (buf, "POST /symbols HTTP/1.0\r\n");
+	}
 
 	DL_FOREACH (priv->rcpts, rcpt)
 	{
@@ -476,56 +767,112 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
 
 	fcntl (s, F_SETFL, ofl|O_NONBLOCK);
 
-	/*
-	 * read results
-	 */
-	sdsclear (buf);
+	ret = s;
+	s = -1;
 
-	for (;;) {
-		ssize_t r;
+err:
+	if (fd != -1) {
+		close (fd);
+	}
 
-		if (io_buf == NULL) {
-			io_buf = malloc (iobuf_len);
-		}
+	if (s != -1) {
+		close (s);
+	}
 
-		if (io_buf == NULL) {
-			msg_err ("<%s>; rspamd: malloc (%s), %s", priv->mlfi_id, srv->name,
-					strerror (errno));
-			goto err;
-		}
+	if (buf) {
+		sdsfree (buf);
+	}
 
-		if (rmilter_poll_fd (s, cfg->spamd_results_timeout, POLLIN) < 1) {
-			msg_warn("<%s>; rspamd: timeout waiting results %s", priv->mlfi_id,
-					srv->name);
-			goto err;
-		}
+	if (map != NULL) {
+		munmap (map, sb.st_size);
+	}
 
-		r = read (s, io_buf, iobuf_len);
+	return ret;
+}
 
-		if (r == -1) {
-			if (errno == EAGAIN || errno == EINTR) {
-				continue;
-			}
-			else {
-				msg_warn("<%s>; rspamd: read, %s, %s", priv->mlfi_id,  srv->name,
-						strerror (errno));
-				goto err;
-			}
-		}
-		else if (r == 0) {
-			break;
+/*
+ * Reads available part of reply to `buf`, returns 1 if reply is complete, 0
+ * if more data is expected and -1 on error
+ */
+static int
+rspamdscan_read (struct mlfi_priv *priv, const struct spamd_server *srv,
+		int s, sds *buf, struct rspamd_framing *fr)
+{
+	const size_t iobuf_len = 16384;
+	ssize_t r;
+	size_t nparsed;
+	int err;
+
+	*buf = sdsMakeRoomFor (*buf, iobuf_len);
+
+	if (*buf == NULL) {
+		msg_err ("<%s>; rspamd: malloc (%s), %s", priv->mlfi_id, srv->name,
+				strerror (errno));
+		return -1;
+	}
+
+	r = read (s, *buf + sdslen (*buf), iobuf_len);
+
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return 0;
 		}
-		else {
-			buf = sdscatlen (buf, io_buf, r);
+
+		err = errno;
+		msg_warn("<%s>; rspamd: read, %s, %s", priv->mlfi_id,  srv->name,
+				strerror (err));
+		/* Caller checks whether connection has been reset */
+		errno = err;
+		return -1;
+	}
+	else if (r == 0) {
+		/* Reply without Content-Length ends with connection */
+		fr->eof = true;
+		http_parser_execute (&fr->parser, &rspamd_framing_settings, NULL, 0);
+
+		return 1;
+	}
+
+	nparsed = http_parser_execute (&fr->parser, &rspamd_framing_settings,
+			*buf + sdslen (*buf), r);
+	sdsIncrLen (*buf, r);
+
+	if (fr->complete) {
+		if (nparsed != (size_t)r) {
+			/* Unexpected data after reply */
+			fr->eof = true;
 		}
+
+		return 1;
+	}
+	else if (HTTP_PARSER_ERRNO (&fr->parser) != HPE_OK) {
+		msg_err ("<%s>; rspamd; HTTP parser error: %s when reading reply from "
+				"%s", priv->mlfi_id,
+				http_errno_description (HTTP_PARSER_ERRNO (&fr->parser)),
+				srv->name);
+		return -1;
 	}
 
+	return 0;
+}
+
+/*
+ * Parses complete HTTP reply of rspamd
+ */
+static int
+rspamdscan_parse (struct mlfi_priv *priv, const struct spamd_server *srv,
+		struct config_file *cfg, sds buf, struct rspamd_metric_result *res)
+{
+	struct http_parser parser;
+	struct http_parser_settings ps;
+	size_t size;
+
 	size = sdslen (buf);
 
 	if (size == 0) {
 		msg_err ("<%s>; rspamd; got empty reply from %s",
 				priv->mlfi_id, srv->name);
-		goto err;
+		return -1;
 	}
 
 	/* Now we need to parse HTTP reply */
@@ -539,10 +886,10 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
 	parser.data = res;
 	parser.content_length = size;
 
-	if (http_parser_execute (&parser, &ps, buf, size) != (size_t)size) {
+	if (http_parser_execute (&parser, &ps, buf, size) != size) {
 		msg_err ("<%s>; rspamd; HTTP parser error: %s when rspamd reply",
 				priv->mlfi_id, http_errno_description (parser.http_errno));
-		goto err;
+		return -1;
 	}
 
 	if (!res->parsed) {
@@ -555,16 +902,108 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
 					priv->mlfi_id);
 		}
 
-		goto err;
+		return -1;
 	}
 
-	ret = 0;
+	return 0;
+}
 
-err:
-	if (fd != -1) {
-		close (fd);
+/*
+ * rspamdscan_socket() - send file to specified host. See spamdscan() for
+ * load-balanced wrapper.
+ *
+ * returns 0 when spam not found, 1 when spam found, -1 on some error during scan (try another server), -2
+ * on unexpected error (probably clamd died on our file, fallback to another
+ * host not recommended), -3 if scan has been cancelled by mlfi_eom
+ */
+
+static int
+rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv,
+		const struct spamd_server *srv, struct config_file *cfg,
+		struct rspamd_metric_result *res,
+		int dkim_only)
+{
+	sds buf = NULL;
+	struct rspamd_framing fr;
+	int s = -1, r, attempt, ret = -1;
+	bool pooled;
+
+	/* somebody doesn't need reply... */
+	if (!srv) {
+		return -1;
 	}
 
+	buf = sdsempty ();
+
+	/* Request sent via idle connection is resent once if it is broken */
+	for (attempt = 0; attempt < 2; attempt ++) {
+		s = rspamdscan_send (priv, srv, cfg, dkim_only, &pooled);
+
+		if (s == -1) {
+			if (pooled) {
+				continue;
+			}
+
+			goto err;
+		}
+
+		/*
+		 * read results
+		 */
+		rspamd_framing_init (&fr);
+		sdsclear (buf);
+
+		for (;;) {
+			r = rmilter_poll_fd_cancel (s, cfg->spamd_results_timeout, POLLIN,
+					priv->scan_cancel_fd);
+
+			if (r == -1 && errno == ECANCELED) {
+				msg_info ("<%s>; rspamd: request to %s has been cancelled",
+						priv->mlfi_id, srv->name);
+				ret = -3;
+				goto err;
+			}
+			else if (r < 1) {
+				msg_warn("<%s>; rspamd: timeout waiting results %s", priv->mlfi_id,
+						srv->name);
+				goto err;
+			}
+
+			r = rspamdscan_read (priv, srv, s, &buf, &fr);
+
+			if (r == -1) {
+				if (pooled && sdslen (buf) == 0 &&
+						(errno == ECONNRESET || errno == EPIPE)) {
+					/* Reset by server just like closed below */
+					fr.eof = true;
+					break;
+				}
+
+				goto err;
+			}
+			else if (r == 1) {
+				break;
+			}
+		}
+
+		if (pooled && fr.eof && sdslen (buf) == 0) {
+			msg_info ("<%s>; rspamd: persistent connection to %s is broken, "
+					"reconnecting", priv->mlfi_id, srv->name);
+			close (s);
+			s = -1;
+			continue;
+		}
+
+		break;
+	}
+
+	if (s != -1 && rspamdscan_parse (priv, srv, cfg, buf, res) == 0) {
+		ret = 0;
+		rspamdscan_release_conn (cfg, srv, s, &fr);
+		s = -1;
+	}
+
+err:
 	if (s != -1) {
 		close (s);
 	}
@@ -573,14 +1012,257 @@ err:
 		sdsfree (buf);
 	}
 
-	if (map != NULL) {
-		munmap (map, sb.st_size);
+	return ret;
+}
+
+/*
+ * Selects another server for the hedged request, NULL if there is none
+ */
+static struct spamd_server *
+rspamdscan_hedge_select (struct mlfi_priv *priv, struct config_file *cfg,
+		struct spamd_server *servers, unsigned int nservers,
+		struct spamd_server *first, time_t now)
+{
+	struct spamd_server *selected;
+	int tries = HEDGE_SELECT_TRIES;
+
+	while (tries-- > 0) {
+		if (cfg->spamd_balance == BALANCE_LATENCY) {
+			selected = (struct spamd_server *) get_upstream_by_latency (
+					(void *) servers, nservers, sizeof(struct spamd_server),
+					now, cfg->spamd_error_time, cfg->spamd_dead_time,
+					cfg->spamd_maxerrors, priv);
+		}
+		else {
+			selected = (struct spamd_server *) get_random_upstream (
+					(void *) servers, nservers, sizeof(struct spamd_server),
+					now, cfg->spamd_error_time, cfg->spamd_dead_time,
+					cfg->spamd_maxerrors, priv);
+		}
+
+		if (selected != NULL && selected != first) {
+			return selected;
+		}
 	}
 
-	if (io_buf) {
-		free (io_buf);
+	return NULL;
+}
+
+/*
+ * Sends message to `*selected` and, if it does not reply during `delay`
+ * milliseconds, to another server as well. The first complete reply wins and
+ * the other request is cancelled by closing its connection. On return
+ * `*selected` points to the server whose result is returned, other failed
+ * servers are marked by this function. Slot of the first server is taken and
+ * released by caller, `start` is the time when it has been taken. Returns -3
+ * if scan has been cancelled by mlfi_eom.
+ */
+static int
+rspamdscan_hedged (struct mlfi_priv *priv, struct config_file *cfg,
+		struct spamd_server *servers, unsigned int nservers,
+		struct spamd_server **selected, struct rspamd_metric_result *res,
+		const struct timeval *start, unsigned int delay, time_t now)
+{
+	struct pollfd fds[3];
+	struct spamd_server *srvs[2];
+	struct timeval tv[2], cur;
+	sds bufs[2] = {NULL, NULL};
+	int i, r, timeout, elapsed, active, ret = -1, winner = 0;
+	struct rspamd_framing fr[2];
+	bool hedge_tried = false, failed[2] = {false, false}, pooled;
+	enum upstream_result result;
+
+	srvs[0] = *selected;
+	srvs[1] = NULL;
+	fds[1].fd = -1;
+	/* Ignored by poll if scan cannot be cancelled */
+	fds[2].fd = priv->scan_cancel_fd;
+	fds[2].events = POLLIN;
+
+	tv[0] = *start;
+	fds[0].fd = rspamdscan_send (priv, srvs[0], cfg, 0, &pooled);
+
+	if (fds[0].fd == -1 && pooled) {
+		fds[0].fd = rspamdscan_send (priv, srvs[0], cfg, 0, &pooled);
 	}
 
+	if (fds[0].fd == -1) {
+		return -1;
+	}
+
+	fds[0].events = POLLIN;
+	bufs[0] = sdsempty ();
+	rspamd_framing_init (&fr[0]);
+	active = 1;
+
+	while (active > 0) {
+		gettimeofday (&cur, NULL);
+		elapsed = (cur.tv_sec - tv[0].tv_sec) * 1000 +
+				(cur.tv_usec - tv[0].tv_usec) / 1000;
+
+		if (elapsed >= (int)cfg->spamd_results_timeout) {
+			msg_warn("<%s>; rspamd: timeout waiting results %s", priv->mlfi_id,
+					srvs[0]->name);
+			break;
+		}
+
+		timeout = cfg->spamd_results_timeout - elapsed;
+
+		if (!hedge_tried && fds[0].fd != -1) {
+			if (elapsed >= (int)delay) {
+				hedge_tried = true;
+
+				if (rspamd_hedge_allow (cfg)) {
+					srvs[1] = rspamdscan_hedge_select (priv, cfg, servers,
+							nservers, srvs[0], now);
+				}
+
+				/* Busy server is not loaded by hedged requests */
+				if (srvs[1] != NULL && !upstream_try_acquire (&srvs[1]->up,
+						cfg->spamd_max_concurrency, &tv[1])) {
+					srvs[1] = NULL;
+				}
+
+				if (srvs[1] != NULL) {
+					msg_info ("<%s>; rspamd: no reply from %s in %d ms, "
+							"sending hedged request to %s", priv->mlfi_id,
+							srvs[0]->name, elapsed, srvs[1]->name);
+					fds[1].fd = rspamdscan_send (priv, srvs[1], cfg, 0, &pooled);
+
+					if (fds[1].fd == -1 && pooled) {
+						fds[1].fd = rspamdscan_send (priv, srvs[1], cfg, 0,
+								&pooled);
+					}
+
+					if (fds[1].fd == -1) {
+						upstream_release (&srvs[1]->up, &tv[1], UPSTREAM_RESULT_FAILED,
+								cfg->spamd_max_concurrency);
+						failed[1] = true;
+					}
+					else {
+						fds[1].events = POLLIN;
+						bufs[1] = sdsempty ();
+						rspamd_framing_init (&fr[1]);
+						active ++;
+					}
+				}
+			}
+			else if (timeout > (int)delay - elapsed) {
+				timeout = delay - elapsed;
+			}
+		}
+
+		for (i = 0; i < 3; i ++) {
+			fds[i].revents = 0;
+		}
+
+		r = poll (fds, 3, timeout);
+
+		if (r == -1 && errno != EINTR) {
+			msg_warn("<%s>; rspamd: poll failed: %s", priv->mlfi_id,
+					strerror (errno));
+			break;
+		}
+		else if (r <= 0) {
+			continue;
+		}
+		else if (fds[2].revents != 0) {
+			msg_info ("<%s>; rspamd: request to %s has been cancelled",
+					priv->mlfi_id, srvs[0]->name);
+			ret = -3;
+			break;
+		}
+
+		for (i = 0; i < 2; i ++) {
+			if (fds[i].fd == -1 || fds[i].revents == 0) {
+				continue;
+			}
+
+			r = rspamdscan_read (priv, srvs[i], fds[i].fd, &bufs[i], &fr[i]);
+
+			if (r == 1) {
+				r = rspamdscan_parse (priv, srvs[i], cfg, bufs[i], res) == 0 ?
+						1 : -1;
+			}
+
+			if (r == 1) {
+				winner = i;
+				ret = 0;
+				break;
+			}
+			else if (r == -1) {
+				close (fds[i].fd);
+				fds[i].fd = -1;
+				failed[i] = true;
+				active --;
+
+				if (i == 1) {
+					upstream_release (&srvs[i]->up, &tv[i],
+							UPSTREAM_RESULT_FAILED,
+							cfg->spamd_max_concurrency);
+				}
+			}
+		}
+
+		if (ret == 0) {
+			break;
+		}
+	}
+
+	for (i = 0; i < 2; i ++) {
+		if (fds[i].fd != -1) {
+			if (ret == 0 && i == winner) {
+				rspamd_hedge_record (&tv[i]);
+				rspamdscan_release_conn (cfg, srvs[i], fds[i].fd, &fr[i]);
+				result = UPSTREAM_RESULT_OK;
+			}
+			else if (ret == 0) {
+				msg_info ("<%s>; rspamd: cancel request to %s, reply from %s "
+						"is used", priv->mlfi_id, srvs[i]->name,
+						srvs[winner]->name);
+				close (fds[i].fd);
+				result = UPSTREAM_RESULT_CANCELLED;
+
+				/*
+				 * Slow primary is recorded with its time so far, otherwise
+				 * the delay would only be based on the winners
+				 */
+				if (i == 0) {
+					rspamd_hedge_record (&tv[i]);
+				}
+			}
+			else {
+				/* Timed out or cancelled */
+				failed[i] = (ret == -1);
+				close (fds[i].fd);
+				result = failed[i] ? UPSTREAM_RESULT_FAILED :
+						UPSTREAM_RESULT_CANCELLED;
+			}
+
+			if (i == 1) {
+				upstream_release (&srvs[i]->up, &tv[i], result,
+						cfg->spamd_max_concurrency);
+			}
+		}
+
+		if (bufs[i] != NULL) {
+			sdsfree (bufs[i]);
+		}
+	}
+
+	/* Server whose result is returned is marked by caller */
+	if (ret != 0) {
+		winner = 0;
+	}
+
+	for (i = 0; i < 2; i ++) {
+		if (i != winner && failed[i]) {
+			upstream_fail (&srvs[i]->up, now);
+		}
+	}
+
+	*selected = srvs[winner];
+
 	return ret;
 }
 #undef TEST_WORD
@@ -650,9 +1332,13 @@ spamdscan (void *_ctx, struct mlfi_priv *priv, struct config_file *cfg, int extr
 {
 	static const int max_syslog_len = 900;
 	int retry, r = -2, to_trace = 0, i, j, ret;
-	struct timeval t;
+	struct timeval t, tv;
 	double ts, tf;
-	struct spamd_server *selected = NULL;
+	struct spamd_server *selected = NULL, *primary;
+	struct spamd_server *servers;
+	unsigned int nservers, delay;
+	bool hedge;
+	enum upstream_result result;
 	char bar_buf[128], hdrbuf[256];
 	char *prefix = "s", *c;
 	struct rspamd_metric_result *res;
@@ -683,17 +1369,24 @@ spamdscan (void *_ctx, struct mlfi_priv *priv, struct config_file *cfg, int extr
 	/* try to scan with available servers */
 	while (1) {
 		if (extra) {
-			selected = (struct spamd_server *) get_random_upstream (
-					(void *) cfg->extra_spamd_servers,
-					cfg->extra_spamd_servers_num, sizeof(struct spamd_server),
+			servers = cfg->extra_spamd_servers;
+			nservers = cfg->extra_spamd_servers_num;
+		}
+		else {
+			servers = cfg->spamd_servers;
+			nservers = cfg->spamd_servers_num;
+		}
+
+		if (cfg->spamd_balance == BALANCE_LATENCY) {
+			selected = (struct spamd_server *) get_upstream_by_latency (
+					(void *) servers, nservers, sizeof(struct spamd_server),
 					t.tv_sec, cfg->spamd_error_time, cfg->spamd_dead_time,
 					cfg->spamd_maxerrors, priv);
 		}
 		else {
 			selected = (struct spamd_server *) get_random_upstream (
-					(void *) cfg->spamd_servers, cfg->spamd_servers_num,
-					sizeof(struct spamd_server), t.tv_sec,
-					cfg->spamd_error_time, cfg->spamd_dead_time,
+					(void *) servers, nservers, sizeof(struct spamd_server),
+					t.tv_sec, cfg->spamd_error_time, cfg->spamd_dead_time,
 					cfg->spamd_maxerrors, priv);
 		}
 		if (selected == NULL) {
@@ -708,7 +1401,48 @@ spamdscan (void *_ctx, struct mlfi_priv *priv, struct config_file *cfg, int extr
 				selected->name);
 
 		prefix = "rs";
-		r = rspamdscan_socket (ctx, priv, selected, cfg, res, dkim_only);
+		hedge = !extra && !dkim_only && cfg->spamd_hedge_budget > 0;
+
+		primary = (struct spamd_server *) upstream_acquire (&selected->up,
+				cfg->spamd_max_concurrency, cfg->spamd_concurrency_wait,
+				&tv, priv);
+
+		if (primary == NULL) {
+			msg_err("<%s>; spamdscan: all servers are busy, %s", priv->mlfi_id,
+					priv->file);
+			free (res);
+
+			return NULL;
+		}
+
+		selected = primary;
+
+		if (hedge && nservers > 1 &&
+				(delay = rspamd_hedge_get_delay (cfg)) > 0) {
+			r = rspamdscan_hedged (priv, cfg, servers, nservers, &selected,
+					res, &tv, delay, t.tv_sec);
+		}
+		else {
+			r = rspamdscan_socket (ctx, priv, selected, cfg, res, dkim_only);
+
+			if (hedge && r == 0) {
+				rspamd_hedge_record (&tv);
+			}
+		}
+
+		/* The first server has been cancelled if hedged request won */
+		if (r == -3 || selected != primary) {
+			result = UPSTREAM_RESULT_CANCELLED;
+		}
+		else if (r == 0 || r == 1) {
+			result = UPSTREAM_RESULT_OK;
+		}
+		else {
+			result = UPSTREAM_RESULT_FAILED;
+		}
+
+		upstream_release (&primary->up, &tv, result,
+				cfg->spamd_max_concurrency);
 
 		msg_info("<%s>; spamdscan: finish scanning message on %s", priv->mlfi_id,
 				selected->name);
@@ -717,6 +1451,10 @@ spamdscan (void *_ctx, struct mlfi_priv *priv, struct config_file *cfg, int extr
 			upstream_ok (&selected->up, t.tv_sec);
 			break;
 		}
+		else if (r == -3) {
+			/* Server is not blamed for cancelled scan */
+			break;
+		}
 		upstream_fail (&selected->up, t.tv_sec);
 		if (r == -2) {
 			msg_warn("<%s>; %spamdscan: unexpected problem, %s, %s",
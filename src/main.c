@@ -29,6 +29,13 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "util.h"
+#include "cache.h"
+#include "cache_async.h"
+#include "cluster.h"
+#include "healthcheck.h"
+#include "publish.h"
+#include "resolver.h"
+#include "lcache.h"
 #include "mfapi.h"
 
 /* config options here... */
@@ -81,6 +88,12 @@ reload_thread(void *unused)
 	FILE *f;
 	struct config_file *new_cfg = NULL, *tmp;
 	struct sigaction signals;
+	struct rmilter_cache_stat cst;
+	struct rmilter_lcache_stat lst;
+	struct rmilter_cache_async_stat ast;
+	struct rmilter_publish_stat pst;
+	struct rmilter_healthcheck_stat hst;
+	struct rmilter_resolver_stat rst;
 
 	/* Initialize signals and start reload thread */
 	bzero (&signals, sizeof(struct sigaction));
@@ -157,12 +170,78 @@ reload_thread(void *unused)
 #else
 		srand (time (NULL));
 #endif
+		rmilter_lcache_init (cfg);
+		rmilter_cluster_init ();
 		/* Free old config */
 		free_config (tmp);
 		free (tmp);
 
 		CFG_UNLOCK()
 		;
+
+		rmilter_cache_get_stat (&cst);
+		msg_info("reload_thread: cache connections: %llu reused, %llu new, "
+				"%llu reconnected, %llu broken",
+				(unsigned long long)cst.pool_hits,
+				(unsigned long long)cst.pool_misses,
+				(unsigned long long)cst.pool_reconnects,
+				(unsigned long long)cst.pool_errors);
+
+		if (cst.breaker_trips > 0) {
+			msg_info("reload_thread: cache circuit breakers: %llu trips, "
+					"%llu requests rejected",
+					(unsigned long long)cst.breaker_trips,
+					(unsigned long long)cst.breaker_rejects);
+		}
+
+		rmilter_lcache_get_stat (&lst);
+		msg_info("reload_thread: local cache: %llu hits, %llu misses, "
+				"%llu expired, %llu evicted, %llu elements, %llu bytes",
+				(unsigned long long)lst.hits,
+				(unsigned long long)lst.misses,
+				(unsigned long long)lst.expired,
+				(unsigned long long)lst.evicted,
+				(unsigned long long)lst.elts,
+				(unsigned long long)lst.bytes);
+		rmilter_cache_async_get_stat (&ast);
+
+		if (ast.requests > 0) {
+			msg_info("reload_thread: cache I/O thread: %llu requests, "
+					"%llu timed out, %llu failed, %llu connections",
+					(unsigned long long)ast.requests,
+					(unsigned long long)ast.timeouts,
+					(unsigned long long)ast.errors,
+					(unsigned long long)ast.connections);
+		}
+
+		rmilter_publish_get_stat (&pst);
+
+		if (pst.queued > 0 || pst.dropped > 0) {
+			msg_info("reload_thread: publish queue: %llu queued, "
+					"%llu published, %llu dropped, %llu failed",
+					(unsigned long long)pst.queued,
+					(unsigned long long)pst.published,
+					(unsigned long long)pst.dropped,
+					(unsigned long long)pst.failed);
+		}
+
+		rmilter_healthcheck_get_stat (&hst);
+
+		if (hst.probes > 0) {
+			msg_info("reload_thread: health checks: %llu probes, "
+					"%llu failed, %llu servers killed, %llu revived",
+					(unsigned long long)hst.probes,
+					(unsigned long long)hst.failures,
+					(unsigned long long)hst.killed,
+					(unsigned long long)hst.revived);
+		}
+
+		rmilter_resolver_get_stat (&rst);
+		msg_info("reload_thread: resolver: %llu lookups, %llu failed, "
+				"%llu changed addresses",
+				(unsigned long long)rst.lookups,
+				(unsigned long long)rst.failures,
+				(unsigned long long)rst.changes);
 	}
 	return NULL;
 }
@@ -317,6 +396,7 @@ int main(int argc, char *argv[])
 
 	umask (0);
 	rng_state = get_prng_state ();
+	rmilter_lcache_init (cfg);
 
 	smfi_setconn (cfg->sock_cred);
 	if (smfi_register (smfilter) == MI_FAILURE) {
@@ -341,6 +421,9 @@ int main(int argc, char *argv[])
 		msg_warn("main: cannot start reload thread, ignoring error");
 	}
 
+	rmilter_healthcheck_start ();
+	rmilter_resolver_start ();
+
 	if (cfg->pid_file) {
 		pfh = rmilter_pidfile_open (cfg->pid_file, 0644, &pid);
 
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include "config.h"
+#include "cfg_file.h"
+#include "cache.h"
+#include "publish.h"
+#include "rmilter.h"
+#include "util.h"
+#include "utlist.h"
+#include "contrib/zstd/zstd.h"
+
+/*
+ * Background publishing of message copies and spam samples: milter threads
+ * only take a reference to the spooled message and put it to a bounded queue,
+ * whereas worker threads send messages to redis.
+ */
+struct rmilter_publish_elt {
+	enum rmilter_publish_type type;
+	struct rmilter_spool *spool;
+	char mlfi_id[14];
+	struct rmilter_publish_elt *prev, *next;
+};
+
+extern struct config_file *cfg;
+
+static pthread_mutex_t publish_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t publish_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t publish_once = PTHREAD_ONCE_INIT;
+static struct rmilter_publish_elt *publish_queue = NULL;
+static unsigned int publish_queue_len = 0;
+static unsigned int publish_workers = 0;
+static struct rmilter_publish_stat publish_stat;
+
+#define PUBLISH_STAT_INC(field) __sync_fetch_and_add (&publish_stat.field, 1)
+
+struct rmilter_spool *
+rmilter_spool_open (const char *path)
+{
+	struct rmilter_spool *spool;
+	struct stat sb;
+	int fd;
+
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (fstat (fd, &sb) == -1 || !S_ISREG (sb.st_mode) ||
+			(spool = malloc (sizeof (*spool))) == NULL) {
+		close (fd);
+
+		return NULL;
+	}
+
+	spool->fd = fd;
+	spool->len = sb.st_size;
+	spool->ref = 1;
+
+	return spool;
+}
+
+struct rmilter_spool *
+rmilter_spool_ref (struct rmilter_spool *spool)
+{
+	__sync_fetch_and_add (&spool->ref, 1);
+
+	return spool;
+}
+
+void
+rmilter_spool_unref (struct rmilter_spool *spool)
+{
+	if (spool && __sync_sub_and_fetch (&spool->ref, 1) == 0) {
+		close (spool->fd);
+		free (spool);
+	}
+}
+
+static void
+rmilter_publish_elt_free (struct rmilter_publish_elt *elt)
+{
+	rmilter_spool_unref (elt->spool);
+	free (elt);
+}
+
+/*
+ * Sends message to redis, should be called with config locked
+ */
+static bool
+rmilter_publish_process (struct rmilter_publish_elt *elt,
+		struct mlfi_priv *priv)
+{
+	const char *channel;
+	void *map;
+	unsigned char *out = NULL;
+	const unsigned char *data;
+	size_t datalen, r;
+	int ret;
+
+	if (elt->type == RMILTER_PUBLISH_COPY) {
+		channel = cfg->cache_copy_channel;
+	}
+	else {
+		channel = cfg->cache_spam_channel;
+	}
+
+	if (channel == NULL || elt->spool->len == 0) {
+		/* Disabled by reload */
+		return true;
+	}
+
+	if (!cfg->publish_compress) {
+		ret = rmilter_publish_cache_file (cfg, elt->type,
+				(const unsigned char *)channel, strlen (channel), elt->spool->fd, elt->spool->len, priv);
+
+		goto out;
+	}
+
+	map = mmap (NULL, elt->spool->len, PROT_READ, MAP_SHARED, elt->spool->fd,
+			0);
+
+	if (map == MAP_FAILED) {
+		msg_err ("<%s>; cannot map message to publish: %s", priv->mlfi_id,
+				strerror (errno));
+
+		return false;
+	}
+
+	data = map;
+	datalen = elt->spool->len;
+	r = ZSTD_compressBound (datalen);
+	out = malloc (r);
+
+	if (out == NULL) {
+		munmap (map, elt->spool->len);
+
+		return false;
+	}
+
+	r = ZSTD_compress (out, r, map, datalen, 1);
+
+	if (ZSTD_isError (r)) {
+		msg_warn ("<%s>; cannot compress message to publish: %s",
+				priv->mlfi_id, ZSTD_getErrorName (r));
+	}
+	else {
+		data = out;
+		datalen = r;
+	}
+
+	ret = rmilter_publish_cache (cfg, elt->type,
+			(const unsigned char *)channel, strlen (channel),
+			data, datalen, priv);
+	free (out);
+	munmap (map, elt->spool->len);
+
+out:
+	if (ret == -1) {
+		msg_err ("<%s>; cannot publish message to stream %s", priv->mlfi_id,
+				channel);
+
+		return false;
+	}
+
+	msg_info ("<%s>; published message to %s (%d clients)", priv->mlfi_id,
+			channel, ret);
+
+	return true;
+}
+
+static void *
+rmilter_publish_thread (void *unused)
+{
+	struct rmilter_publish_elt *elt;
+	struct mlfi_priv *priv;
+
+	if ((priv = rmilter_thread_priv ("publish")) == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock (&publish_mtx);
+
+		while (publish_queue == NULL) {
+			pthread_cond_wait (&publish_cond, &publish_mtx);
+		}
+
+		elt = publish_queue;
+		DL_DELETE (publish_queue, elt);
+		publish_queue_len --;
+		pthread_mutex_unlock (&publish_mtx);
+
+		rmilter_strlcpy (priv->mlfi_id, elt->mlfi_id, sizeof (priv->mlfi_id));
+
+		CFG_RLOCK();
+
+		if (rmilter_publish_process (elt, priv)) {
+			PUBLISH_STAT_INC (published);
+		}
+		else {
+			PUBLISH_STAT_INC (failed);
+		}
+
+		CFG_UNLOCK();
+
+		rmilter_publish_elt_free (elt);
+	}
+
+	return NULL;
+}
+
+static void
+rmilter_publish_start (void)
+{
+	unsigned int i, nworkers;
+
+	nworkers = cfg->publish_workers > 0 ? cfg->publish_workers : 1;
+
+	for (i = 0; i < nworkers; i ++) {
+		if (!rmilter_thread_start ("publish", rmilter_publish_thread, NULL)) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock (&publish_mtx);
+	publish_workers = i;
+	pthread_mutex_unlock (&publish_mtx);
+}
+
+bool
+rmilter_publish_enqueue (struct config_file *cfg,
+		enum rmilter_publish_type type, struct rmilter_spool *spool,
+		struct mlfi_priv *priv)
+{
+	struct rmilter_publish_elt *elt, *drop = NULL;
+
+	pthread_once (&publish_once, rmilter_publish_start);
+
+	elt = malloc (sizeof (*elt));
+
+	if (elt == NULL) {
+		return false;
+	}
+
+	elt->type = type;
+	elt->spool = rmilter_spool_ref (spool);
+	rmilter_strlcpy (elt->mlfi_id, priv->mlfi_id, sizeof (elt->mlfi_id));
+
+	pthread_mutex_lock (&publish_mtx);
+
+	if (publish_workers == 0) {
+		pthread_mutex_unlock (&publish_mtx);
+		rmilter_publish_elt_free (elt);
+
+		return false;
+	}
+
+	if (publish_queue_len >= cfg->publish_queue_size) {
+		if (!cfg->publish_drop_oldest) {
+			pthread_mutex_unlock (&publish_mtx);
+			PUBLISH_STAT_INC (dropped);
+			msg_warn ("<%s>; publish queue is full, dropping message",
+					priv->mlfi_id);
+			rmilter_publish_elt_free (elt);
+
+			return false;
+		}
+
+		drop = publish_queue;
+		DL_DELETE (publish_queue, drop);
+		publish_queue_len --;
+	}
+
+	DL_APPEND (publish_queue, elt);
+	publish_queue_len ++;
+	pthread_cond_signal (&publish_cond);
+	pthread_mutex_unlock (&publish_mtx);
+
+	PUBLISH_STAT_INC (queued);
+
+	if (drop) {
+		PUBLISH_STAT_INC (dropped);
+		msg_warn ("<%s>; publish queue is full, dropping message %s",
+				priv->mlfi_id, drop->mlfi_id);
+		rmilter_publish_elt_free (drop);
+	}
+
+	return true;
+}
+
+void
+rmilter_publish_get_stat (struct rmilter_publish_stat *st)
+{
+	rmilter_stat_snapshot (st, &publish_stat, sizeof (*st));
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef SRC_PUBLISH_H_
+#define SRC_PUBLISH_H_
+
+#include "config.h"
+#include "cache.h"
+
+struct config_file;
+struct mlfi_priv;
+
+/* Read only handle of a spooled message shared by queued publish requests */
+struct rmilter_spool {
+	int fd;
+	size_t len;
+	int ref;
+};
+
+struct rmilter_publish_stat {
+	uint64_t queued;			/* messages put to the queue */
+	uint64_t published;			/* messages sent to redis */
+	uint64_t dropped;			/* messages dropped due to queue overflow */
+	uint64_t failed;			/* messages that could not be sent */
+};
+
+/**
+ * Open spooled message for publishing, the handle remains valid after the
+ * file is unlinked
+ * @param path path to the spool file
+ * @return new handle with a single reference or NULL
+ */
+struct rmilter_spool *rmilter_spool_open (const char *path);
+
+struct rmilter_spool *rmilter_spool_ref (struct rmilter_spool *spool);
+
+void rmilter_spool_unref (struct rmilter_spool *spool);
+
+/**
+ * Put message to the background publishing queue, workers are started on the
+ * first call. If the queue is full, either the message or the oldest queued
+ * one is dropped, depending on `publish_drop_oldest`.
+ * @param cfg
+ * @param type channel type
+ * @param spool message to publish, a new reference is taken
+ * @param priv pointer to useful information from milter protocol
+ * @return true if message has been queued
+ */
+bool rmilter_publish_enqueue (struct config_file *cfg,
+		enum rmilter_publish_type type, struct rmilter_spool *spool,
+		struct mlfi_priv *priv);
+
+void rmilter_publish_get_stat (struct rmilter_publish_stat *st);
+
+#endif /* SRC_PUBLISH_H_ */
@@ -32,8 +32,14 @@
 #include "cache.h"
 #include "upstream.h"
 #include "ratelimit.h"
+#include "uthash.h"
+#include "utlist.h"
+#include "util.h"
+#include "xxhash.h"
 
 #define EXPIRE_TIME 86400
+#define PENDING_SHARDS 32
+#define PENDING_SEED 0x7a1c3e55ULL
 
 struct ratelimit_bucket_s
 {
@@ -46,6 +52,73 @@ enum keytype
 	TO = 0, TO_IP, TO_IP_FROM, BOUNCE_TO, BOUNCE_TO_IP
 };
 
+/*
+ * Write-behind: bucket increments made at the end of message are accumulated
+ * in a sharded table and written to the cache by a flush thread, so hot
+ * buckets are updated once per flush rather than once per message
+ */
+struct ratelimit_pending {
+	char key[MAXKEYLEN];
+	size_t klen;
+	/* Copy of limit as config might be reloaded before flush */
+	bucket_t bucket;
+	unsigned int incr;
+	double tm;
+	UT_hash_handle hh;
+};
+
+struct ratelimit_pending_shard {
+	pthread_mutex_t mtx;
+	struct ratelimit_pending *elts;
+};
+
+extern struct config_file *cfg;
+
+static struct ratelimit_pending_shard pending_shards[PENDING_SHARDS];
+static pthread_once_t pending_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t flush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int pending_updates = 0;
+static int pending_enabled = 0;
+
+/*
+ * Server side leaky bucket: KEYS[1] - bucket, ARGV: time, rate, burst,
+ * increment and expire. Bucket is stored as a hash with text fields, records
+ * of other types (written by the client side implementation) are replaced.
+ * Returns "<0|1> <count>" where 0 means that limit is exceeded.
+ */
+static struct rmilter_cache_script ratelimit_script = {
+	.body =
+	"local key = KEYS[1]\n"
+	"local now = tonumber(ARGV[1])\n"
+	"local rate = tonumber(ARGV[2])\n"
+	"local burst = tonumber(ARGV[3])\n"
+	"local incr = tonumber(ARGV[4])\n"
+	"local tm, count = now, 0\n"
+	"local t = redis.call('TYPE', key)['ok']\n"
+	"if t == 'hash' then\n"
+	"  local v = redis.call('HMGET', key, 'tm', 'count')\n"
+	"  tm = tonumber(v[1]) or now\n"
+	"  count = tonumber(v[2]) or 0\n"
+	"elseif t ~= 'none' then\n"
+	"  redis.call('DEL', key)\n"
+	"end\n"
+	"if count > 0 then count = count - (now - tm) * rate end\n"
+	"count = count + incr\n"
+	"if count < 0 then count = 0 end\n"
+	"if incr > 0 and count == 0 then\n"
+	"  redis.call('DEL', key)\n"
+	"else\n"
+	"  redis.call('HMSET', key, 'tm', ARGV[1], 'count', tostring(count))\n"
+	"  redis.call('EXPIRE', key, ARGV[5])\n"
+	"end\n"
+	"if incr == 0 and count > burst then\n"
+	"  return '0 ' .. tostring(count)\n"
+	"end\n"
+	"return '1 ' .. tostring(count)\n",
+	.sha = ""
+};
+
 /* Convert string to lowercase */
 static void convert_to_lowercase(char *str, unsigned int size)
 {
@@ -138,6 +211,94 @@ static int make_key(char *buf, size_t buflen, enum keytype type,
 	return r;
 }
 
+static struct ratelimit_pending_shard *
+rate_pending_shard (const char *key, size_t klen)
+{
+	return &pending_shards[XXH64 (key, klen, PENDING_SEED) % PENDING_SHARDS];
+}
+
+/* Returns number of increments for the bucket that are not flushed yet */
+static unsigned int
+rate_pending_get (const char *key, size_t klen)
+{
+	struct ratelimit_pending_shard *shard;
+	struct ratelimit_pending *elt;
+	unsigned int incr = 0;
+
+	if (!__sync_fetch_and_add (&pending_enabled, 0)) {
+		/* Write-behind has never been used */
+		return 0;
+	}
+
+	shard = rate_pending_shard (key, klen);
+	pthread_mutex_lock (&shard->mtx);
+	HASH_FIND (hh, shard->elts, key, klen, elt);
+
+	if (elt) {
+		incr = elt->incr;
+	}
+
+	pthread_mutex_unlock (&shard->mtx);
+
+	return incr;
+}
+
+static int check_specific_limit_script (struct mlfi_priv *priv,
+		struct config_file *cfg, const char *key, size_t klen,
+		bucket_t *bucket, double tm, int is_update)
+{
+	char tmbuf[32], ratebuf[32], burstbuf[16], incrbuf[4], expirebuf[16];
+	const char *args[5];
+	char *res = NULL, *end;
+	size_t reslen = 0;
+	double count;
+	int ok;
+
+	snprintf (tmbuf, sizeof (tmbuf), "%.6f", tm);
+	snprintf (ratebuf, sizeof (ratebuf), "%.9g", bucket->rate);
+	snprintf (burstbuf, sizeof (burstbuf), "%u", bucket->burst);
+	snprintf (incrbuf, sizeof (incrbuf), "%d", is_update ? 1 : 0);
+	snprintf (expirebuf, sizeof (expirebuf), "%d", EXPIRE_TIME);
+	args[0] = tmbuf;
+	args[1] = ratebuf;
+	args[2] = burstbuf;
+	args[3] = incrbuf;
+	args[4] = expirebuf;
+
+	if (!rmilter_eval_cache (cfg, RMILTER_QUERY_RATELIMIT, &ratelimit_script,
+			(const unsigned char *)key, klen, 5, args,
+			(unsigned char **)&res, &reslen, priv)) {
+		/* Do not block mail if cache is unavailable */
+		return 1;
+	}
+
+	ok = strtol (res, &end, 10);
+	count = strtod (end, NULL);
+	free (res);
+
+	if (!is_update) {
+		count += rate_pending_get (key, klen);
+
+		if (count > bucket->burst) {
+			ok = 0;
+		}
+	}
+
+	msg_debug("<%s>; check_specific_limit: got limit for key: '%s', "
+			"count: %.1f", priv->mlfi_id, key, count);
+
+	if (ok == 0) {
+		/* Rate limit exceeded */
+		msg_info(
+				"<%s>; rate_check: ratelimit exceeded for key: %s, count: %.2f, burst: %u",
+				priv->mlfi_id, key, count, bucket->burst);
+
+		return 0;
+	}
+
+	return 1;
+}
+
 static int check_specific_limit(struct mlfi_priv *priv, struct config_file *cfg,
 		enum keytype type, bucket_t *bucket, double tm, const char *rcpt,
 		int is_update)
@@ -158,6 +319,11 @@ static int check_specific_limit(struct mlfi_priv *priv, struct config_file *cfg,
 		return -1;
 	}
 
+	if (cfg->ratelimit_use_script && cfg->cache_use_redis) {
+		return check_specific_limit_script (priv, cfg, key, klen, bucket, tm,
+				is_update);
+	}
+
 	dlen = sizeof (*b);
 
 	if (!rmilter_query_cache (cfg, RMILTER_QUERY_RATELIMIT, key, klen,
@@ -195,7 +361,7 @@ static int check_specific_limit(struct mlfi_priv *priv, struct config_file *cfg,
 				(unsigned char *) b, dlen, EXPIRE_TIME, priv);
 	}
 
-	if (b->count > bucket->burst && !is_update) {
+	if (!is_update && b->count + rate_pending_get (key, klen) > bucket->burst) {
 		/* Rate limit exceeded */
 		msg_info(
 				"<%s>; rate_check: ratelimit exceeded for key: %s, count: %.2f, burst: %u",
@@ -269,6 +435,429 @@ rate_check (struct mlfi_priv *priv, struct config_file *cfg,
 	return 1;
 }
 
+struct ratelimit_batch_elt {
+	char key[MAXKEYLEN];
+	size_t klen;
+	bucket_t *bucket;
+	/* Set for flushed increments */
+	struct ratelimit_pending *pending;
+	unsigned int incr;
+	struct ratelimit_bucket_s b;
+	char args[3][32];
+	const char *argv[5];
+	UT_hash_handle hh;
+};
+
+/* Adds all buckets for a recipient to the batch merging duplicate keys */
+static void
+rate_batch_add_rcpt (struct mlfi_priv *priv, struct config_file *cfg,
+		const char *rcpt, int bounce, struct ratelimit_batch_elt **batch,
+		unsigned int *nelts)
+{
+	static const enum keytype types[] = {
+		BOUNCE_TO, BOUNCE_TO_IP, TO_IP_FROM, TO_IP, TO
+	};
+	bucket_t *buckets[] = {
+		&cfg->limit_bounce_to, &cfg->limit_bounce_to_ip,
+		&cfg->limit_to_ip_from, &cfg->limit_to_ip, &cfg->limit_to
+	};
+	struct ratelimit_batch_elt *elt, *found;
+	unsigned int i;
+
+	for (i = bounce ? 0 : 2; i < sizeof (types) / sizeof (types[0]); i ++) {
+		if (buckets[i]->burst == 0 || buckets[i]->rate == 0) {
+			continue;
+		}
+
+		elt = calloc (1, sizeof (*elt));
+
+		if (elt == NULL) {
+			msg_err("<%s>; rate_update: calloc failed: %s",
+					priv->mlfi_id, strerror (errno));
+			return;
+		}
+
+		elt->klen = make_key (elt->key, sizeof (elt->key), types[i], priv, rcpt);
+
+		if (elt->klen == 0) {
+			msg_err("<%s>; rate_update: got error bad too long key",
+					priv->mlfi_id);
+			free (elt);
+			continue;
+		}
+
+		HASH_FIND (hh, *batch, elt->key, elt->klen, found);
+
+		if (found) {
+			found->incr ++;
+			free (elt);
+		}
+		else {
+			elt->bucket = buckets[i];
+			elt->incr = 1;
+			HASH_ADD_KEYPTR (hh, *batch, elt->key, elt->klen, elt);
+			(*nelts) ++;
+		}
+	}
+}
+
+static void
+rate_update_script (struct mlfi_priv *priv, struct config_file *cfg,
+		struct ratelimit_batch_elt *batch, unsigned int nelts, double tm)
+{
+	struct rmilter_cache_eval *evals;
+	struct ratelimit_batch_elt *elt, *tmp;
+	char tmbuf[32], expirebuf[16];
+	unsigned int i = 0;
+
+	evals = calloc (nelts, sizeof (*evals));
+
+	if (evals == NULL) {
+		msg_err("<%s>; rate_update: calloc failed: %s",
+				priv->mlfi_id, strerror (errno));
+		return;
+	}
+
+	snprintf (tmbuf, sizeof (tmbuf), "%.6f", tm);
+	snprintf (expirebuf, sizeof (expirebuf), "%d", EXPIRE_TIME);
+
+	HASH_ITER (hh, batch, elt, tmp) {
+		snprintf (elt->args[0], sizeof (elt->args[0]), "%.9g", elt->bucket->rate);
+		snprintf (elt->args[1], sizeof (elt->args[1]), "%u", elt->bucket->burst);
+		snprintf (elt->args[2], sizeof (elt->args[2]), "%u", elt->incr);
+		elt->argv[0] = tmbuf;
+		elt->argv[1] = elt->args[0];
+		elt->argv[2] = elt->args[1];
+		elt->argv[3] = elt->args[2];
+		elt->argv[4] = expirebuf;
+		evals[i].key = (const unsigned char *)elt->key;
+		evals[i].keylen = elt->klen;
+		evals[i].nargs = 5;
+		evals[i].args = elt->argv;
+		i ++;
+	}
+
+	rmilter_eval_cache_multi (cfg, RMILTER_QUERY_RATELIMIT, &ratelimit_script,
+			evals, nelts, priv);
+
+	for (i = 0; i < nelts; i ++) {
+		if (evals[i].data) {
+			free (evals[i].data);
+		}
+	}
+
+	free (evals);
+}
+
+static void
+rate_update_client (struct mlfi_priv *priv, struct config_file *cfg,
+		struct ratelimit_batch_elt *batch, unsigned int nelts, double tm)
+{
+	struct rmilter_cache_query *queries;
+	struct rmilter_cache_update *updates;
+	struct ratelimit_batch_elt *elt, *tmp;
+	unsigned int i = 0;
+
+	queries = calloc (nelts, sizeof (*queries));
+	updates = calloc (nelts, sizeof (*updates));
+
+	if (queries == NULL || updates == NULL) {
+		msg_err("<%s>; rate_update: calloc failed: %s",
+				priv->mlfi_id, strerror (errno));
+		free (queries);
+		free (updates);
+		return;
+	}
+
+	HASH_ITER (hh, batch, elt, tmp) {
+		queries[i].type = RMILTER_QUERY_RATELIMIT;
+		queries[i].key = (const unsigned char *)elt->key;
+		queries[i].keylen = elt->klen;
+		i ++;
+	}
+
+	rmilter_query_cache_multi (cfg, queries, nelts, priv);
+
+	i = 0;
+	HASH_ITER (hh, batch, elt, tmp) {
+		if (queries[i].data && queries[i].datalen == sizeof (elt->b)) {
+			memcpy (&elt->b, queries[i].data, sizeof (elt->b));
+		}
+
+		/* Leak from bucket at specified rate */
+		if (elt->b.count > 0) {
+			elt->b.count -= (tm - elt->b.tm) * elt->bucket->rate;
+		}
+
+		elt->b.count += elt->incr;
+		elt->b.tm = tm;
+		if (elt->b.count < 0) {
+			elt->b.count = 0;
+		}
+
+		updates[i].type = RMILTER_QUERY_RATELIMIT;
+		updates[i].key = (const unsigned char *)elt->key;
+		updates[i].keylen = elt->klen;
+
+		if (elt->b.count > 0) {
+			updates[i].data = (const unsigned char *)&elt->b;
+			updates[i].datalen = sizeof (elt->b);
+			updates[i].expire = EXPIRE_TIME;
+		}
+
+		i ++;
+	}
+
+	rmilter_set_cache_multi (cfg, updates, nelts, priv);
+
+	for (i = 0; i < nelts; i ++) {
+		if (queries[i].data) {
+			free (queries[i].data);
+		}
+	}
+
+	free (queries);
+	free (updates);
+}
+
+/*
+ * Writes all pending increments to the cache, should be called with config
+ * locked
+ */
+static void
+rate_pending_flush (struct mlfi_priv *priv)
+{
+	struct ratelimit_batch_elt *batch = NULL, *elt, *etmp;
+	struct ratelimit_pending *pending, *cur, *tmp;
+	unsigned int i, nelts = 0;
+	double tm = 0;
+
+	__sync_lock_test_and_set (&pending_updates, 0);
+
+	for (i = 0; i < PENDING_SHARDS; i ++) {
+		/* Detach table, so milter threads are blocked for a short time */
+		pthread_mutex_lock (&pending_shards[i].mtx);
+		pending = pending_shards[i].elts;
+		pending_shards[i].elts = NULL;
+		pthread_mutex_unlock (&pending_shards[i].mtx);
+
+		HASH_ITER (hh, pending, cur, tmp) {
+			HASH_DEL (pending, cur);
+			elt = calloc (1, sizeof (*elt));
+
+			if (elt == NULL) {
+				msg_err ("<%s>; rate_flush: calloc failed: %s",
+						priv->mlfi_id, strerror (errno));
+				free (cur);
+				continue;
+			}
+
+			memcpy (elt->key, cur->key, cur->klen);
+			elt->klen = cur->klen;
+			elt->incr = cur->incr;
+			/* Leaking is calculated from the latest message */
+			if (cur->tm > tm) {
+				tm = cur->tm;
+			}
+			/* Pending element owns the bucket until batch is freed */
+			elt->bucket = &cur->bucket;
+			elt->pending = cur;
+			HASH_ADD_KEYPTR (hh, batch, elt->key, elt->klen, elt);
+			nelts ++;
+		}
+	}
+
+	if (nelts == 0) {
+		return;
+	}
+
+	msg_debug ("<%s>; rate_flush: flushing %u buckets", priv->mlfi_id, nelts);
+
+	if (cfg->ratelimit_use_script && cfg->cache_use_redis) {
+		rate_update_script (priv, cfg, batch, nelts, tm);
+	}
+	else {
+		rate_update_client (priv, cfg, batch, nelts, tm);
+	}
+
+	HASH_ITER (hh, batch, elt, etmp) {
+		HASH_DEL (batch, elt);
+		free (elt->pending);
+		free (elt);
+	}
+}
+
+static void *
+rate_flush_thread (void *unused)
+{
+	struct mlfi_priv *priv;
+	struct timespec ts;
+	struct timeval tv;
+	unsigned int interval;
+
+	if ((priv = rmilter_thread_priv ("rate_flush")) == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		CFG_RLOCK();
+		/* Pending updates are flushed even if write-behind is switched off */
+		interval = cfg->ratelimit_flush_interval > 0 ?
+				cfg->ratelimit_flush_interval : RMILTER_IDLE_INTERVAL;
+		CFG_UNLOCK();
+
+		gettimeofday (&tv, NULL);
+		ts.tv_sec = tv.tv_sec + interval / 1000;
+		ts.tv_nsec = tv.tv_usec * 1000 + (interval % 1000) * 1000000;
+
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec ++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock (&flush_mtx);
+		pthread_cond_timedwait (&flush_cond, &flush_mtx, &ts);
+		pthread_mutex_unlock (&flush_mtx);
+
+		CFG_RLOCK();
+		rate_pending_flush (priv);
+		CFG_UNLOCK();
+	}
+
+	return NULL;
+}
+
+static void
+rate_pending_init (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < PENDING_SHARDS; i ++) {
+		pthread_mutex_init (&pending_shards[i].mtx, NULL);
+	}
+
+	if (rmilter_thread_start ("rate_flush", rate_flush_thread, NULL)) {
+		__sync_lock_test_and_set (&pending_enabled, 1);
+	}
+}
+
+/*
+ * Adds increments to the pending table, returns false if write-behind is not
+ * available
+ */
+static bool
+rate_pending_add (struct mlfi_priv *priv, struct config_file *cfg,
+		struct ratelimit_batch_elt *batch, double tm)
+{
+	struct ratelimit_pending_shard *shard;
+	struct ratelimit_pending *pending;
+	struct ratelimit_batch_elt *elt, *tmp;
+	unsigned int total;
+
+	pthread_once (&pending_once, rate_pending_init);
+
+	if (!__sync_fetch_and_add (&pending_enabled, 0)) {
+		return false;
+	}
+
+	HASH_ITER (hh, batch, elt, tmp) {
+		shard = rate_pending_shard (elt->key, elt->klen);
+		pthread_mutex_lock (&shard->mtx);
+		HASH_FIND (hh, shard->elts, elt->key, elt->klen, pending);
+
+		if (pending == NULL) {
+			pending = calloc (1, sizeof (*pending));
+
+			if (pending == NULL) {
+				pthread_mutex_unlock (&shard->mtx);
+				msg_err ("<%s>; rate_update: calloc failed: %s",
+						priv->mlfi_id, strerror (errno));
+				continue;
+			}
+
+			memcpy (pending->key, elt->key, elt->klen);
+			pending->klen = elt->klen;
+			HASH_ADD_KEYPTR (hh, shard->elts, pending->key, pending->klen,
+					pending);
+		}
+
+		pending->bucket = *elt->bucket;
+		pending->incr += elt->incr;
+
+		if (tm > pending->tm) {
+			pending->tm = tm;
+		}
+
+		pthread_mutex_unlock (&shard->mtx);
+		total = __sync_add_and_fetch (&pending_updates, elt->incr);
+
+		if (total >= cfg->ratelimit_flush_updates &&
+				total - elt->incr < cfg->ratelimit_flush_updates) {
+			/* Wake flush thread once per threshold crossing */
+			pthread_mutex_lock (&flush_mtx);
+			pthread_cond_signal (&flush_cond);
+			pthread_mutex_unlock (&flush_mtx);
+		}
+	}
+
+	return true;
+}
+
+void
+rate_update (struct mlfi_priv *priv, struct config_file *cfg)
+{
+	struct ratelimit_batch_elt *batch = NULL, *elt, *tmp;
+	struct rcpt *rcpt;
+	unsigned int nelts = 0;
+	double t;
+	int bounce;
+
+	if (!cfg->ratelimit_enable) {
+		return;
+	}
+
+	if (priv->priv_addr.family == AF_INET
+			&& radix_find_rmilter_addr (cfg->limit_whitelist_tree,
+					&priv->priv_addr) != RADIX_NO_VALUE) {
+		msg_info("<%s>; rate_update: address is whitelisted, skipping updates",
+				priv->mlfi_id);
+		return;
+	}
+
+	t = priv->conn_tm.tv_sec + priv->conn_tm.tv_usec / 1000000.;
+	bounce = is_bounce (priv->priv_from, cfg);
+
+	DL_FOREACH (priv->rcpts, rcpt) {
+		if (priv->priv_addr.family == AF_INET &&
+				is_whitelisted (&priv->priv_addr, rcpt->r_addr, cfg) != 0) {
+			continue;
+		}
+
+		rate_batch_add_rcpt (priv, cfg, rcpt->r_addr, bounce, &batch, &nelts);
+	}
+
+	if (nelts > 0) {
+		msg_debug("<%s>; rate_update: updating %u buckets", priv->mlfi_id,
+				nelts);
+
+		if (cfg->ratelimit_flush_interval > 0 &&
+				rate_pending_add (priv, cfg, batch, t)) {
+			/* Buckets are updated by the flush thread */
+		}
+		else if (cfg->ratelimit_use_script && cfg->cache_use_redis) {
+			rate_update_script (priv, cfg, batch, nelts, t);
+		}
+		else {
+			rate_update_client (priv, cfg, batch, nelts, t);
+		}
+	}
+
+	HASH_ITER (hh, batch, elt, tmp) {
+		HASH_DEL (batch, elt);
+		free (elt);
+	}
+}
+
 /*
  * vi:ts=4
  */
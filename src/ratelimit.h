@@ -34,4 +34,10 @@ struct config_file;
 
 int rate_check (struct mlfi_priv *priv, struct config_file *cfg, const char *rcpt, int is_update);
 
+/*
+ * Update limits for all recipients of the message, all buckets are updated
+ * at once using one request per cache server
+ */
+void rate_update (struct mlfi_priv *priv, struct config_file *cfg);
+
 #endif
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "cfg_file.h"
+#include "rmilter.h"
+#include "resolver.h"
+#include "util.h"
+#include <poll.h>
+
+/*
+ * Resolver cache: upstream names are resolved when config is loaded and then
+ * periodically by the resolver thread, so connecting to a server never waits
+ * for DNS. getaddrinfo does not report TTL of records, hence the fixed
+ * `resolve_interval` is used for refreshing.
+ */
+#define RESOLVER_MAX_ADDRS 16
+
+struct rmilter_sockaddr {
+	socklen_t len;
+	struct sockaddr_storage ss;
+};
+
+struct rmilter_resolved {
+	char *name;
+	/* Protected by resolver_mtx */
+	struct rmilter_sockaddr addrs[RESOLVER_MAX_ADDRS];
+	unsigned int naddrs;
+	unsigned int ref;
+	/* Rotation counter, updated atomically */
+	unsigned int cur;
+	UT_hash_handle hh;
+};
+
+extern struct config_file *cfg;
+
+static struct rmilter_resolved *resolved_names = NULL;
+static pthread_mutex_t resolver_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct rmilter_resolver_stat resolver_stat;
+static pthread_once_t resolver_once = PTHREAD_ONCE_INIT;
+
+static int
+rmilter_sockaddr_cmp (const void *a, const void *b)
+{
+	return memcmp (a, b, sizeof (struct rmilter_sockaddr));
+}
+
+/*
+ * Resolves name to the list of addresses, returns number of addresses or -1
+ * on error. Addresses are sorted, so that records returned by round robin DNS
+ * in a different order are not considered as changed.
+ */
+static int
+rmilter_resolver_lookup (const char *name, struct rmilter_sockaddr *addrs)
+{
+	struct addrinfo hints, *res, *res0;
+	int error, naddrs = 0;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	__sync_fetch_and_add (&resolver_stat.lookups, 1);
+	error = getaddrinfo (name, NULL, &hints, &res0);
+
+	if (error) {
+		msg_err ("resolver: getaddrinfo failed for %s: %s", name,
+				gai_strerror (error));
+		__sync_fetch_and_add (&resolver_stat.failures, 1);
+
+		return -1;
+	}
+
+	for (res = res0; res != NULL && naddrs < RESOLVER_MAX_ADDRS;
+			res = res->ai_next) {
+		if (res->ai_addrlen > sizeof (addrs[naddrs].ss)) {
+			continue;
+		}
+
+		memset (&addrs[naddrs], 0, sizeof (addrs[naddrs]));
+		memcpy (&addrs[naddrs].ss, res->ai_addr, res->ai_addrlen);
+		addrs[naddrs].len = res->ai_addrlen;
+		naddrs ++;
+	}
+
+	freeaddrinfo (res0);
+	qsort (addrs, naddrs, sizeof (addrs[0]), rmilter_sockaddr_cmp);
+
+	return naddrs;
+}
+
+struct rmilter_resolved *
+rmilter_resolver_get (const char *name)
+{
+	struct rmilter_resolved *res, *tmp;
+	struct rmilter_sockaddr addrs[RESOLVER_MAX_ADDRS];
+	int naddrs;
+
+	if (name[0] == '/' || name[0] == '.') {
+		/* Unix socket */
+		return NULL;
+	}
+
+	pthread_mutex_lock (&resolver_mtx);
+	HASH_FIND_STR (resolved_names, name, res);
+
+	if (res != NULL) {
+		res->ref ++;
+		pthread_mutex_unlock (&resolver_mtx);
+
+		return res;
+	}
+
+	pthread_mutex_unlock (&resolver_mtx);
+
+	/* Not locked while waiting for resolver */
+	naddrs = rmilter_resolver_lookup (name, addrs);
+	res = calloc (1, sizeof (*res));
+
+	if (res == NULL || (res->name = strdup (name)) == NULL) {
+		free (res);
+		return NULL;
+	}
+
+	if (naddrs > 0) {
+		memcpy (res->addrs, addrs, naddrs * sizeof (addrs[0]));
+		res->naddrs = naddrs;
+	}
+	else {
+		/* The resolver thread will try again */
+		msg_warn ("resolver: no addresses found for %s", name);
+	}
+
+	res->ref = 1;
+	pthread_mutex_lock (&resolver_mtx);
+	HASH_FIND_STR (resolved_names, name, tmp);
+
+	if (tmp != NULL) {
+		/* Added by another thread meanwhile */
+		tmp->ref ++;
+		pthread_mutex_unlock (&resolver_mtx);
+		free (res->name);
+		free (res);
+
+		return tmp;
+	}
+
+	HASH_ADD_KEYPTR (hh, resolved_names, res->name, strlen (res->name), res);
+	pthread_mutex_unlock (&resolver_mtx);
+
+	return res;
+}
+
+void
+rmilter_resolver_release (struct rmilter_resolved *res)
+{
+	if (res == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock (&resolver_mtx);
+
+	if (-- res->ref == 0) {
+		HASH_DEL (resolved_names, res);
+		free (res->name);
+		free (res);
+	}
+
+	pthread_mutex_unlock (&resolver_mtx);
+}
+
+/*
+ * Copies addresses of entry, returns their number and index of the first one
+ * to use
+ */
+static unsigned int
+rmilter_resolver_snapshot (struct rmilter_resolved *res,
+		struct rmilter_sockaddr *addrs, unsigned int *start)
+{
+	unsigned int naddrs;
+
+	pthread_mutex_lock (&resolver_mtx);
+	naddrs = res->naddrs;
+	memcpy (addrs, res->addrs, naddrs * sizeof (addrs[0]));
+	pthread_mutex_unlock (&resolver_mtx);
+
+	/* Each connection starts from the next address */
+	*start = __sync_fetch_and_add (&res->cur, 1);
+
+	return naddrs;
+}
+
+static void
+rmilter_sockaddr_set_port (struct rmilter_sockaddr *sa, int port)
+{
+	if (sa->ss.ss_family == AF_INET) {
+		((struct sockaddr_in *)&sa->ss)->sin_port = htons (port);
+	}
+	else if (sa->ss.ss_family == AF_INET6) {
+		((struct sockaddr_in6 *)&sa->ss)->sin6_port = htons (port);
+	}
+}
+
+int
+rmilter_resolver_connect (struct rmilter_resolved *res, const char *name,
+		int port, int msec, const struct mlfi_priv *priv)
+{
+	struct rmilter_sockaddr addrs[RESOLVER_MAX_ADDRS], *sa;
+	unsigned int naddrs, start, i;
+	int s = -1, ofl, error = 0;
+	const char *cause = NULL;
+
+	if (res == NULL) {
+		return rmilter_connect_addr (name, port, msec, priv);
+	}
+
+	naddrs = rmilter_resolver_snapshot (res, addrs, &start);
+
+	if (naddrs == 0) {
+		msg_err ("<%s>; rmilter_resolver_connect: no addresses known for %s",
+				priv->mlfi_id, name);
+		errno = EADDRNOTAVAIL;
+
+		return -1;
+	}
+
+	for (i = 0; i < naddrs; i ++) {
+		sa = &addrs[(start + i) % naddrs];
+		rmilter_sockaddr_set_port (sa, port);
+		s = socket (sa->ss.ss_family, SOCK_STREAM, 0);
+
+		if (s < 0) {
+			cause = "socket";
+			error = errno;
+			continue;
+		}
+
+		ofl = fcntl (s, F_GETFL, 0);
+		fcntl (s, F_SETFL, ofl | O_NONBLOCK);
+
+		if (connect (s, (struct sockaddr *)&sa->ss, sa->len) < 0) {
+			if (errno == EINPROGRESS || errno == EAGAIN) {
+				break;
+			}
+
+			cause = "connect";
+			error = errno;
+			close (s);
+			s = -1;
+			continue;
+		}
+
+		break; /* okay we got one */
+	}
+
+	if (s < 0) {
+		msg_err ("<%s>; rmilter_resolver_connect: connect to %s failed: %s: %s",
+				priv->mlfi_id, name, cause, strerror (error));
+		errno = error;
+
+		return -1;
+	}
+
+	/* Get write readiness */
+	if (rmilter_poll_fd (s, msec, POLLOUT) == 1) {
+		return s;
+	}
+
+	msg_err ("<%s>; rmilter_resolver_connect: connect to %s failed: timeout",
+			priv->mlfi_id, name);
+	close (s);
+	errno = ETIMEDOUT;
+
+	return -1;
+}
+
+bool
+rmilter_resolver_addr (struct rmilter_resolved *res, char *buf, size_t buflen)
+{
+	struct rmilter_sockaddr addrs[RESOLVER_MAX_ADDRS], *sa;
+	unsigned int naddrs, start;
+
+	if (res == NULL) {
+		return false;
+	}
+
+	naddrs = rmilter_resolver_snapshot (res, addrs, &start);
+
+	if (naddrs == 0) {
+		return false;
+	}
+
+	sa = &addrs[start % naddrs];
+
+	return getnameinfo ((struct sockaddr *)&sa->ss, sa->len, buf, buflen,
+			NULL, 0, NI_NUMERICHOST) == 0;
+}
+
+/*
+ * Resolves all cached names again, lookups are done without lock held, so
+ * entries are found by name once more to store results
+ */
+static void
+rmilter_resolver_refresh (void)
+{
+	struct rmilter_resolved *res, *tmp;
+	struct rmilter_sockaddr addrs[RESOLVER_MAX_ADDRS];
+	char **names;
+	unsigned int nnames, i;
+	int naddrs;
+
+	pthread_mutex_lock (&resolver_mtx);
+	nnames = HASH_COUNT (resolved_names);
+	names = calloc (nnames + 1, sizeof (*names));
+
+	if (names == NULL) {
+		pthread_mutex_unlock (&resolver_mtx);
+		return;
+	}
+
+	i = 0;
+	HASH_ITER (hh, resolved_names, res, tmp) {
+		if ((names[i] = strdup (res->name)) != NULL) {
+			i ++;
+		}
+	}
+
+	nnames = i;
+	pthread_mutex_unlock (&resolver_mtx);
+
+	for (i = 0; i < nnames; i ++) {
+		naddrs = rmilter_resolver_lookup (names[i], addrs);
+
+		if (naddrs > 0) {
+			pthread_mutex_lock (&resolver_mtx);
+			HASH_FIND_STR (resolved_names, names[i], res);
+
+			if (res != NULL && ((unsigned int)naddrs != res->naddrs ||
+					memcmp (res->addrs, addrs, naddrs * sizeof (addrs[0])) != 0)) {
+				msg_info ("resolver: addresses of %s have changed, %d records "
+						"found", names[i], naddrs);
+				__sync_fetch_and_add (&resolver_stat.changes, 1);
+				memcpy (res->addrs, addrs, naddrs * sizeof (addrs[0]));
+				res->naddrs = naddrs;
+			}
+
+			pthread_mutex_unlock (&resolver_mtx);
+		}
+
+		free (names[i]);
+	}
+
+	free (names);
+}
+
+static void *
+rmilter_resolver_thread (void *unused)
+{
+	unsigned int interval;
+
+	for (;;) {
+		CFG_RLOCK();
+		interval = cfg->resolve_interval;
+		CFG_UNLOCK();
+		rmilter_thread_sleep (interval);
+
+		if (interval > 0) {
+			rmilter_resolver_refresh ();
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rmilter_resolver_init (void)
+{
+	rmilter_thread_start ("resolver", rmilter_resolver_thread, NULL);
+}
+
+void
+rmilter_resolver_start (void)
+{
+	pthread_once (&resolver_once, rmilter_resolver_init);
+}
+
+void
+rmilter_resolver_get_stat (struct rmilter_resolver_stat *st)
+{
+	rmilter_stat_snapshot (st, &resolver_stat, sizeof (*st));
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SRC_RESOLVER_H_
+#define SRC_RESOLVER_H_
+
+#include "config.h"
+
+struct mlfi_priv;
+struct rmilter_resolved;
+
+struct rmilter_resolver_stat {
+	uint64_t lookups;			/* names resolved */
+	uint64_t failures;			/* lookups failed */
+	uint64_t changes;			/* lookups that changed addresses of name */
+};
+
+/**
+ * Returns cached addresses of the specified host name, the name is resolved
+ * now if it is not in cache yet. Entries are shared by all servers with the
+ * same name and survive config reloads while referenced. NULL is returned for
+ * unix sockets.
+ * @param name host name or numeric address
+ * @return referenced cache entry (must be released by a caller)
+ */
+struct rmilter_resolved * rmilter_resolver_get (const char *name);
+
+void rmilter_resolver_release (struct rmilter_resolved *res);
+
+/**
+ * Connects to the next cached address of server rotating over all A and AAAA
+ * records, no resolver is queried. If `res` is NULL, `name` is passed to
+ * `rmilter_connect_addr` as is.
+ * @return socket in non-blocking mode or -1 on error
+ */
+int rmilter_resolver_connect (struct rmilter_resolved *res, const char *name,
+		int port, int msec, const struct mlfi_priv *priv);
+
+/**
+ * Writes the next cached address of server in numeric form to `buf`, it is
+ * used for libraries that connect by themselves
+ * @return false if there are no addresses
+ */
+bool rmilter_resolver_addr (struct rmilter_resolved *res, char *buf,
+		size_t buflen);
+
+/**
+ * Start the resolver thread. It resolves all cached names again every
+ * `resolve_interval`, failed lookups leave the previous addresses in place.
+ */
+void rmilter_resolver_start (void);
+
+void rmilter_resolver_get_stat (struct rmilter_resolver_stat *st);
+
+#endif /* SRC_RESOLVER_H_ */
@@ -38,6 +38,7 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "cache.h"
+#include "publish.h"
 #ifdef HAVE_DCC
 #include "dccif.h"
 #endif
@@ -66,6 +67,34 @@ static void send_beanstalk (const struct mlfi_priv *);
 static int check_dcc(const struct mlfi_priv *);
 #endif
 
+/* Check running in a separate thread while rspamd checks message */
+struct rmilter_scan_job {
+	void *(*func) (void *);
+	struct mlfi_priv *priv;
+	pthread_t thr;
+	/* Check is required for message */
+	bool enabled;
+	/* Thread is started and not joined yet */
+	bool started;
+	bool done;
+	int r;
+	char *strres;
+	size_t strres_len;
+	/* Write end of pipe used to cancel other checks */
+	int cancel_fd;
+};
+
+static void rmilter_scan_init(struct rmilter_scan_job *, struct mlfi_priv *,
+		void *(*) (void *));
+static void rmilter_scan_start(struct rmilter_scan_job *, int);
+static void rmilter_scan_join(struct rmilter_scan_job *);
+static void rmilter_scan_wait(struct rmilter_scan_job *);
+static void rmilter_scan_cancel(int);
+static void *rmilter_clamav_job(void *);
+#ifdef HAVE_DCC
+static void *rmilter_dcc_job(void *);
+#endif
+
 struct smfiDesc smfilter =
 {
 		"rmilter",		/* filter name */
@@ -211,80 +240,166 @@ dkim_stripcr (char *str)
 	return str;
 }
 
+/*
+ * Remember message id from References or In-Reply-To header, all ids are
+ * checked at once at the end of headers
+ */
 static void
-check_message_id (struct mlfi_priv *priv, char *header)
+add_reply_id (struct mlfi_priv *priv, const char *mid, size_t len,
+		bool prepend)
 {
-	blake2b_state mdctx;
-	u_char final[BLAKE2B_OUTBYTES], *dbuf;
-	char md5_out[BLAKE2B_OUTBYTES * 2 + 1], *c, key[MAXKEYLEN];
-	int r, keylen;
-	size_t s, dlen;
+	struct reply_id *cur;
+
+	if (len == 0 || priv->reply_ids_num >= MAX_REPLY_IDS) {
+		return;
+	}
+
+	LL_FOREACH (priv->reply_ids, cur) {
+		if (cur->len == len && memcmp (cur->mid, mid, len) == 0) {
+			return;
+		}
+	}
+
+	cur = malloc (sizeof (*cur));
+
+	if (cur == NULL) {
+		return;
+	}
+
+	cur->mid = malloc (len + 1);
 
-	if (header == NULL) {
+	if (cur->mid == NULL) {
+		free (cur);
 		return;
 	}
 
-	s = strlen (header);
+	rmilter_strlcpy (cur->mid, mid, len + 1);
+	cur->len = len;
 
 	/* First of all do regexp check of message to determine special message id */
 	if (cfg->special_mid_re) {
-		if ((r = pcre_exec (cfg->special_mid_re, NULL, header, s, 0, 0, NULL, 0)) >= 0) {
+		if (pcre_exec (cfg->special_mid_re, NULL, cur->mid, len, 0, 0, NULL, 0) >= 0) {
 			priv->complete_to_beanstalk = 1;
 		}
 	}
 
-	if (cfg->cache_servers_id_num == 0) {
-		return;
+	if (prepend) {
+		LL_PREPEND (priv->reply_ids, cur);
+	}
+	else {
+		LL_APPEND (priv->reply_ids, cur);
 	}
 
-	blake2b_init (&mdctx, BLAKE2B_OUTBYTES);
-	/* Check reply message id in memcached */
-	/* Make hash from message id */
-	blake2b_update (&mdctx, (const u_char *)header, s);
-	blake2b_final (&mdctx, final, BLAKE2B_OUTBYTES);
+	priv->reply_ids_num ++;
+}
+
+static void
+free_reply_ids (struct mlfi_priv *priv)
+{
+	struct reply_id *cur, *tmp;
 
-	/* Format md5 output */
-	s = sizeof (md5_out);
-	for (r = 0; r < BLAKE2B_OUTBYTES; r ++){
-		s -= snprintf (md5_out + r * 2, s, "%02x", final[r]);
+	LL_FOREACH_SAFE (priv->reply_ids, cur, tmp) {
+		free (cur->mid);
+		free (cur);
+	}
+
+	priv->reply_ids = NULL;
+	priv->reply_ids_num = 0;
+}
+
+/*
+ * Check whether this message is a reply to some of our messages. All
+ * message ids are resolved in a single request per cache server
+ */
+static void
+check_reply_ids (struct mlfi_priv *priv)
+{
+	blake2b_state mdctx;
+	u_char final[BLAKE2B_OUTBYTES];
+	struct rmilter_cache_query *queries;
+	struct reply_id *cur;
+	char *keys, *key;
+	size_t prefix_len = 0;
+	unsigned int i, nqueries = 0;
+	int found;
+
+	if (priv->reply_ids == NULL || cfg->cache_servers_id_num == 0) {
+		return;
 	}
 
-	c = key;
-	s = sizeof (key);
 	if (cfg->id_prefix) {
-		s = rmilter_strlcpy (c, cfg->id_prefix, s);
-		c += s;
+		prefix_len = strlen (cfg->id_prefix);
+
+		if (prefix_len + BLAKE2B_OUTBYTES * 2 >= MAXKEYLEN) {
+			msg_warn ("<%s>; check_id: id_prefix(%s) too long for memcached key, error in configure",
+				priv->mlfi_id,
+				cfg->id_prefix);
+			prefix_len = MAXKEYLEN - BLAKE2B_OUTBYTES * 2 - 1;
+		}
 	}
-	if (sizeof (key) - s > sizeof (md5_out)) {
-		memcpy (c, md5_out, sizeof (md5_out));
+
+	queries = calloc (priv->reply_ids_num, sizeof (*queries));
+	keys = malloc (priv->reply_ids_num * MAXKEYLEN);
+
+	if (queries == NULL || keys == NULL) {
+		msg_err ("<%s>; check_id: malloc failed: %s", priv->mlfi_id,
+				strerror (errno));
+		free (queries);
+		free (keys);
+
+		return;
 	}
-	else {
-		msg_warn ("<%s>; check_id: id_prefix(%s) too long for memcached key, error in configure",
-			priv->mlfi_id,
-			cfg->id_prefix);
-		memcpy (c, md5_out, sizeof (key) - s);
+
+	LL_FOREACH (priv->reply_ids, cur) {
+		/* Make hash from message id */
+		blake2b_init (&mdctx, BLAKE2B_OUTBYTES);
+		blake2b_update (&mdctx, (const u_char *)cur->mid, cur->len);
+		blake2b_final (&mdctx, final, BLAKE2B_OUTBYTES);
+
+		key = keys + nqueries * MAXKEYLEN;
+
+		if (prefix_len > 0) {
+			memcpy (key, cfg->id_prefix, prefix_len);
+		}
+
+		queries[nqueries].type = RMILTER_QUERY_ID;
+		queries[nqueries].key = (const unsigned char *)key;
+		queries[nqueries].keylen = prefix_len +
+				rmilter_encode_hex_buf (final, sizeof (final), key + prefix_len,
+						MAXKEYLEN - prefix_len);
+		nqueries ++;
 	}
 
-	keylen = strlen (key);
-	dlen = 1;
+	found = rmilter_query_cache_first (cfg, queries, nqueries, priv);
+
+	if (found >= 0) {
+		cur = priv->reply_ids;
+
+		for (i = 0; i < (unsigned int)found; i ++) {
+			cur = cur->next;
+		}
 
-	r = rmilter_query_cache(cfg, RMILTER_QUERY_ID, key, keylen, &dbuf, &dlen, priv);
-	if (r) {
-		free (dbuf);
 		/* Turn off strict checks if message id is found */
 		priv->strict = 0;
-		rmilter_strlcpy (priv->reply_id, header, sizeof (priv->reply_id));
+		rmilter_strlcpy (priv->reply_id, cur->mid, sizeof (priv->reply_id));
 		msg_info ("<%s>; check_message_id: from %s[%s] from=<%s> to=<%s> is reply to our message %s; "
 				"skip dcc and spamd checks",
 						priv->mlfi_id,
 						priv->priv_hostname,
 						priv->priv_ip,
 						priv->priv_from,
-						priv->rcpts->r_addr,
+						priv->rcpts ? priv->rcpts->r_addr : "",
 						priv->reply_id);
-		return;
 	}
 
+	for (i = 0; i < nqueries; i ++) {
+		if (queries[i].data) {
+			free (queries[i].data);
+		}
+	}
+
+	free (queries);
+	free (keys);
 }
 
 static sfsistat
@@ -357,9 +472,8 @@ publish_message (struct mlfi_priv *priv, enum rmilter_publish_type type,
 		char *extra_buf, size_t extra_len)
 {
 	const char *channel = NULL;
-	void *map;
-	size_t sz;
-	int ret;
+	struct stat sb;
+	int ret, fd;
 
 	if (type == RMILTER_PUBLISH_COPY) {
 		channel = cfg->cache_copy_channel;
@@ -372,29 +486,54 @@ publish_message (struct mlfi_priv *priv, enum rmilter_publish_type type,
 		return;
 	}
 
-	map = rmilter_file_xmap (priv->file, PROT_READ, &sz);
+	if (cfg->publish_queue_size > 0) {
+		/* Publish in background, spool file is shared by all channels */
+		if (priv->spool == NULL) {
+			priv->spool = rmilter_spool_open (priv->file);
+
+			if (priv->spool == NULL) {
+				msg_err ("<%s>; cannot open file %s: %s",
+						priv->mlfi_id, priv->file, strerror (errno));
+
+				return;
+			}
+		}
+
+		if (rmilter_publish_enqueue (cfg, type, priv->spool, priv)) {
+			snprintf (extra_buf + strlen (extra_buf),
+					extra_len - strlen (extra_buf),
+					"; queued to %s", channel);
+		}
+
+		return;
+	}
+
+	fd = open (priv->file, O_RDONLY);
 
-	if (map == NULL) {
+	if (fd == -1 || fstat (fd, &sb) == -1) {
 		msg_err ("<%s>; cannot read file %s: %s",
 						priv->mlfi_id, priv->file, strerror (errno));
 
+		if (fd != -1) {
+			close (fd);
+		}
+
 		return;
 	}
 
-	ret = rmilter_publish_cache (cfg, type, channel, strlen (channel), map, sz,
-			priv);
+	ret = rmilter_publish_cache_file (cfg, type, channel, strlen (channel), fd,
+			sb.st_size, priv);
+	close (fd);
 
 	if (ret == -1) {
-		msg_err ("<%s>; cannot publish file %s to stream %s: %s",
-				priv->mlfi_id, priv->file, channel, strerror (errno));
-		munmap (map, sz);
+		msg_err ("<%s>; cannot publish file %s to stream %s",
+				priv->mlfi_id, priv->file, channel);
 
 		return;
 	}
 
 	snprintf (extra_buf + strlen (extra_buf), extra_len - strlen (extra_buf),
 			"; published to %s (%d clients)", channel, ret);
-	munmap (map, sz);
 }
 
 /* Milter callbacks */
@@ -422,6 +561,7 @@ mlfi_connect(SMFICTX * ctx, char *hostname, _SOCK_ADDR * addr)
 	priv->strict = 1;
 	priv->serial = cfg->serial;
 	priv->priv_addr.family = AF_UNSPEC;
+	priv->scan_cancel_fd = -1;
 
 	priv->priv_rcptcount = 0;
 
@@ -850,7 +990,7 @@ mlfi_header(SMFICTX * ctx, char *headerf, char *headerv)
 {
 	struct mlfi_priv *priv;
 	int len;
-	char *p, *c, t, *hname_lowercase;
+	char *p, *c, *hname_lowercase;
 
 	if ((priv = (struct mlfi_priv *) smfi_getpriv (ctx)) == NULL) {
 		msg_err ("Internal error: smfi_getpriv() returns NULL");
@@ -869,26 +1009,31 @@ mlfi_header(SMFICTX * ctx, char *headerf, char *headerv)
 	rmilter_str_lc (hname_lowercase, strlen (hname_lowercase));
 
 	if (headerv && strcmp (hname_lowercase, "in-reply-to") == 0) {
-		check_message_id (priv, headerv);
+		CFG_RLOCK();
+		/* Direct parent is checked first */
+		add_reply_id (priv, headerv, strlen (headerv), true);
+		CFG_UNLOCK();
 	}
 	else if (headerv && strcmp (hname_lowercase, "references") == 0) {
 		/* Break references into individual message-id */
-		c = headerv;
-		p = c;
+		CFG_RLOCK();
+		p = headerv;
 
 		while (*p) {
-			if (isspace (*p)) {
-				t = *p;
-				*p = '\0';
-				check_message_id (priv, c);
-				*p = t;
-				while (isspace (*p) &&  *p) {
-					p ++;
-				}
-				c = p;
+			while (*p && isspace (*p)) {
+				p ++;
+			}
+
+			c = p;
+
+			while (*p && !isspace (*p)) {
+				p ++;
 			}
-			p ++;
+
+			add_reply_id (priv, c, p - c, false);
 		}
+
+		CFG_UNLOCK();
 	}
 	else if (strcmp (hname_lowercase, "return-path") == 0) {
 		priv->has_return_path = 1;
@@ -975,6 +1120,10 @@ mlfi_eoh(SMFICTX * ctx)
 		}
 	}
 
+	CFG_RLOCK();
+	check_reply_ids (priv);
+	CFG_UNLOCK();
+
 	if (!priv->has_return_path && priv->fileh) {
 		fprintf (priv->fileh, "Return-Path: <%s>\r\n", priv->priv_from);
 	}
@@ -1044,10 +1193,12 @@ mlfi_eom(SMFICTX * ctx)
 	int prob_max;
 	double prob_cur;
 	struct stat sb;
-	struct rcpt *rcpt;
 	bool ip_whitelisted = false;
 	int ret = SMFIS_CONTINUE;
 	struct rspamd_metric_result *mres = NULL;
+	struct rmilter_scan_job av_job, dcc_job;
+	int cancel_pipe[2] = {-1, -1}, nscans;
+	bool spamd_check, av_whitelisted = false;
 	const char *spam_check_result = "unknown",
 			*av_check_result = "unknown",
 			*dkim_result = "unsigned";
@@ -1059,6 +1210,14 @@ mlfi_eom(SMFICTX * ctx)
 	}
 
 	memset (extra_buf, 0, sizeof (extra_buf));
+	rmilter_scan_init (&av_job, priv, rmilter_clamav_job);
+	av_job.strres = strres;
+	av_job.strres_len = sizeof (strres);
+#ifdef HAVE_DCC
+	rmilter_scan_init (&dcc_job, priv, rmilter_dcc_job);
+#else
+	rmilter_scan_init (&dcc_job, priv, NULL);
+#endif
 
 	/* set queue id */
 	if (priv->queue_id[0] == '\0') {
@@ -1121,13 +1280,58 @@ mlfi_eom(SMFICTX * ctx)
 	msg_info ("<%s>; mlfi_eom: tempfile=%s, size=%lu",
 			priv->mlfi_id, priv->file, (unsigned long int)sb.st_size);
 
+	if (radix_find_rmilter_addr (cfg->spamd_whitelist, &priv->priv_addr)
+			!= RADIX_NO_VALUE) {
+		ip_whitelisted = true;
+	}
+
+	if (radix_find_rmilter_addr (cfg->clamav_whitelist, &priv->priv_addr)
+			!= RADIX_NO_VALUE) {
+		av_whitelisted = true;
+	}
+
+	spamd_check = cfg->spamd_servers_num != 0 && !priv->has_whitelisted &&
+			priv->strict && !ip_whitelisted &&
+			(cfg->strict_auth || *priv->priv_user == '\0');
+	av_job.enabled = cfg->clamav_servers_num != 0 && !priv->has_whitelisted &&
+			!av_whitelisted;
+#ifdef HAVE_DCC
+	dcc_job.enabled = cfg->use_dcc == 1 && !priv->has_whitelisted &&
+			priv->strict && (cfg->strict_auth && *priv->priv_user != '\0');
+#endif
+	nscans = (spamd_check ||
+			(cfg->spamd_servers_num != 0 && cfg->rspamd_dkim_sign)) +
+			av_job.enabled + dcc_job.enabled;
+
+	/*
+	 * Clamav and dcc check message in separate threads while rspamd checks it
+	 * here, then verdicts are applied in the same order as if the checks were
+	 * sequential: dcc, rspamd, clamav
+	 */
+	if (nscans > 1) {
+		if (pipe (cancel_pipe) == -1) {
+			msg_warn ("<%s>; mlfi_eom: cannot create pipe, scans cannot be "
+					"cancelled: %s", priv->mlfi_id, strerror (errno));
+			cancel_pipe[0] = -1;
+			cancel_pipe[1] = -1;
+		}
+
+		priv->scan_cancel_fd = cancel_pipe[0];
+		rmilter_scan_start (&av_job, cancel_pipe[1]);
+		rmilter_scan_start (&dcc_job, cancel_pipe[1]);
+	}
+
+	if (spamd_check) {
+		msg_debug ("<%s>; mlfi_eom: check spamd", priv->mlfi_id);
+		mres = spamdscan (ctx, priv, cfg, 0, 0);
+	}
+
 #ifdef HAVE_DCC
 	/* Check dcc */
-	if (cfg->use_dcc == 1 && !priv->has_whitelisted && priv->strict &&
-			(cfg->strict_auth && *priv->priv_user != '\0')) {
+	if (dcc_job.enabled) {
 		msg_debug ("<%s>; mlfi_eom: check dcc", priv->mlfi_id);
-		r = check_dcc (priv);
-		switch (r) {
+		rmilter_scan_wait (&dcc_job);
+		switch (dcc_job.r) {
 		case 'A':
 			break;
 		case 'G':
@@ -1147,17 +1351,18 @@ mlfi_eom(SMFICTX * ctx)
 		}
 	}
 #endif
-	if (radix_find_rmilter_addr (cfg->spamd_whitelist, &priv->priv_addr)
-			!= RADIX_NO_VALUE) {
-		ip_whitelisted = true;
-	}
 
 	/* Check spamd */
-	if (cfg->spamd_servers_num != 0 && !priv->has_whitelisted && priv->strict
-			&& !ip_whitelisted &&
-			(cfg->strict_auth || *priv->priv_user == '\0')) {
-		msg_debug ("<%s>; mlfi_eom: check spamd", priv->mlfi_id);
-		mres = spamdscan (ctx, priv, cfg, 0, 0);
+	if (spamd_check) {
+		if (mres == NULL && av_job.started) {
+			/* Scan might have been cancelled because of virus */
+			rmilter_scan_join (&av_job);
+
+			if (av_job.done && av_job.r == 0 && *strres) {
+				spam_check_result = "skipped, virus found";
+				goto av_check;
+			}
+		}
 
 		if (mres == NULL) {
 			msg_warn ("<%s>; mlfi_eom: spamdscan() failed", priv->mlfi_id);
@@ -1179,6 +1384,8 @@ mlfi_eom(SMFICTX * ctx)
 			if (cfg->spamd_greylist && SPAM_IS_GREYLIST (mres) &&
 					!priv->authenticated) {
 				/* Perform greylisting */
+				/* Clamav thread uses config, so it must not be unlocked earlier */
+				rmilter_scan_join (&av_job);
 				CFG_UNLOCK();
 				/* Unlock config to avoid recursion, since check_greylisting locks cfg as well */
 				if (check_greylisting_ctx (ctx, priv) != SMFIS_CONTINUE) {
@@ -1385,11 +1592,7 @@ mlfi_eom(SMFICTX * ctx)
 		}
 	}
 
-	ip_whitelisted = false;
-
-	if (radix_find_rmilter_addr (cfg->clamav_whitelist, &priv->priv_addr)
-			!= RADIX_NO_VALUE) {
-		ip_whitelisted = true;
+	if (av_whitelisted) {
 		av_check_result = "skipped, ip whitelist";
 	}
 	else if (priv->has_whitelisted) {
@@ -1403,10 +1606,10 @@ mlfi_eom(SMFICTX * ctx)
 
 av_check:
 	/* Check clamav */
-	if (cfg->clamav_servers_num != 0 && !priv->has_whitelisted
-			&& !ip_whitelisted) {
+	if (av_job.enabled) {
 		msg_debug ("mlfi_eom: %s: check clamav", priv->mlfi_id);
-		r = check_clamscan (ctx, priv, strres, sizeof (strres));
+		rmilter_scan_wait (&av_job);
+		r = av_job.r;
 		if (r < 0) {
 			if (cfg->spamd_temp_fail) {
 				smfi_setreply (ctx, RCODE_LATER, XCODE_TEMPFAIL, "Temporary service failure.");
@@ -1457,9 +1660,7 @@ dkim_sign:
 	}
 	smfi_addheader (ctx, "X-Rcpt-To", rcptbuf);
 #else
-	DL_FOREACH (priv->rcpts, rcpt) {
-		rate_check (priv, cfg, rcpt->r_addr, 1);
-	}
+	rate_update (priv, cfg);
 #endif
 
 #ifdef WITH_DKIM
@@ -1515,6 +1716,19 @@ dkim_sign:
 #endif
 
 end:
+	/* Verdict is known, so scans that are still running are useless */
+	if (av_job.started || dcc_job.started) {
+		rmilter_scan_cancel (cancel_pipe[1]);
+		rmilter_scan_join (&av_job);
+		rmilter_scan_join (&dcc_job);
+	}
+
+	if (cancel_pipe[0] != -1) {
+		close (cancel_pipe[0]);
+		close (cancel_pipe[1]);
+	}
+
+	priv->scan_cancel_fd = -1;
 
 	addr = priv->priv_addr.family == AF_INET6
 		  ? (void *) &priv->priv_addr.addr.sa6.sin6_addr :
@@ -1596,11 +1810,17 @@ mlfi_cleanup(SMFICTX * ctx, bool ok)
 		unlink (priv->file);
 		priv->file[0] = '\0';
 	}
+	if (priv->spool) {
+		/* Queued messages keep their own references */
+		rmilter_spool_unref (priv->spool);
+		priv->spool = NULL;
+	}
 	/* clean message specific data */
 	priv->strict = 1;
 	/* Create new ID */
 	set_random_id (priv);
 	priv->reply_id[0] = '\0';
+	free_reply_ids (priv);
 	priv->queue_id[0] = '\0';
 	priv->message_id[0] = '\0';
 #ifdef WITH_DKIM
@@ -1684,7 +1904,7 @@ mlfi_body(SMFICTX * ctx, u_char * bodyp, size_t bodylen)
  * check_clamscan() return values: 0 	- scanned (or not scanned due to
  * filesize limit) -1	- retry limit exceeded -2	- unexpected error,
  * e.g. unexpected reply from server (suppose scanned message killed
- * clamd...)
+ * clamd...) -3	- cancelled as verdict of another check is already known
  */
 
 static int
@@ -1706,7 +1926,107 @@ check_clamscan(void *ctx, struct mlfi_priv *priv,
 	return r;
 }
 
+static void
+rmilter_scan_init (struct rmilter_scan_job *job, struct mlfi_priv *priv,
+		void *(*func) (void *))
+{
+	memset (job, 0, sizeof (*job));
+	job->func = func;
+	job->priv = priv;
+	job->cancel_fd = -1;
+}
+
+/*
+ * Starts check in a separate thread, it is done by rmilter_scan_wait() in the
+ * current thread if thread cannot be created
+ */
+static void
+rmilter_scan_start (struct rmilter_scan_job *job, int cancel_fd)
+{
+	int r;
+
+	if (!job->enabled) {
+		return;
+	}
+
+	job->cancel_fd = cancel_fd;
+	r = pthread_create (&job->thr, NULL, job->func, job);
+
+	if (r != 0) {
+		msg_warn ("<%s>; mlfi_eom: cannot start scan thread: %s",
+				job->priv->mlfi_id, strerror (r));
+		return;
+	}
+
+	job->started = true;
+}
+
+static void
+rmilter_scan_join (struct rmilter_scan_job *job)
+{
+	if (job->started) {
+		pthread_join (job->thr, NULL);
+		job->started = false;
+	}
+}
+
+/*
+ * Waits for result of check, the check is done now if it has not been started
+ */
+static void
+rmilter_scan_wait (struct rmilter_scan_job *job)
+{
+	rmilter_scan_join (job);
+
+	if (job->enabled && !job->done) {
+		job->func (job);
+	}
+}
+
+static void
+rmilter_scan_cancel (int cancel_fd)
+{
+	char c = 0;
+
+	/* Pipe is never read, so it remains readable for all checks */
+	if (cancel_fd != -1 && write (cancel_fd, &c, sizeof (c)) == -1) {
+		msg_warn ("rmilter_scan_cancel: write failed: %s", strerror (errno));
+	}
+}
+
+static void *
+rmilter_clamav_job (void *arg)
+{
+	struct rmilter_scan_job *job = arg;
+
+	job->r = check_clamscan (NULL, job->priv, job->strres, job->strres_len);
+	job->done = true;
+
+	/* Message with virus is rejected, so rspamd scan is not needed */
+	if (job->r == 0 && *job->strres) {
+		rmilter_scan_cancel (job->cancel_fd);
+	}
+
+	return NULL;
+}
+
 #ifdef HAVE_DCC
+static void *
+rmilter_dcc_job (void *arg)
+{
+	struct rmilter_scan_job *job = arg;
+
+	job->r = check_dcc (job->priv);
+	job->done = true;
+
+	/* Verdict of dcc is applied first, other checks are not needed then */
+	if (job->r == 'G' || job->r == 'R') {
+		rmilter_scan_cancel (job->cancel_fd);
+	}
+
+	return NULL;
+}
+
 static int
 check_dcc (const struct mlfi_priv *priv)
 {
@@ -44,6 +44,8 @@
 #endif
 
 #define STAGE_MAX 7
+/* Maximum number of message ids from References/In-Reply-To to check */
+#define MAX_REPLY_IDS 64
 
 #define RCODE_REJECT    "554"
 #define RCODE_TEMPFAIL  "451"
@@ -65,6 +67,14 @@ struct rcpt {
 	struct rcpt *prev, *next;
 };
 
+struct rmilter_spool;
+
+struct reply_id {
+	char *mid;
+	size_t len;
+	struct reply_id *next;
+};
+
 struct mlfi_priv {
 	struct rmilter_inet_address priv_addr;
 	char priv_ip[INET6_ADDRSTRLEN + 1];
@@ -88,6 +98,9 @@ struct mlfi_priv {
 	char queue_id[32];
 	char mta_tag[ADDRLEN + 1];
 	char reply_id[ADDRLEN + 33];
+	/* Message ids from References and In-Reply-To headers */
+	struct reply_id *reply_ids;
+	unsigned int reply_ids_num;
 
 #ifdef HAVE_PATH_MAX
 	char file[PATH_MAX];
@@ -98,6 +111,10 @@ struct mlfi_priv {
 #endif
     FILE *fileh;
 	int filed;
+	/* Spooled message shared with the publishing queue */
+	struct rmilter_spool *spool;
+	/* Becomes readable when scans in mlfi_eom should be stopped, or -1 */
+	int scan_cancel_fd;
 	struct timeval conn_tm;
 	struct rule* matched_rules[STAGE_MAX];
 	long eoh_pos;
@@ -35,50 +35,395 @@
 #define msg_debug(args...) do {} while(0)
 #endif
 
-#ifdef _THREAD_SAFE
-pthread_rwlock_t upstream_mtx = PTHREAD_RWLOCK_INITIALIZER;
-#define U_RLOCK() do { pthread_rwlock_rdlock (&upstream_mtx); } while (0)
-#define U_WLOCK() do { pthread_rwlock_wrlock (&upstream_mtx); } while (0)
-#define U_UNLOCK() do { pthread_rwlock_unlock (&upstream_mtx); } while (0)
-#else
-#define U_RLOCK() do {} while (0)
-#define U_WLOCK() do {} while (0)
-#define U_UNLOCK() do {} while (0)
-#endif
+/*
+ * Upstream state is shared by all milter threads without locking: every
+ * field is read and written atomically. Transitions between alive and dead
+ * states are serialized per upstreams array by the mutex of its set, and
+ * `dead` is always changed last, so lock-free readers that see the new state
+ * see its time, errors and weight as well.
+ */
+#define U_LOAD(v) (*(volatile __typeof__ (v) *)&(v))
+#define U_STORE(v, n) (void)__sync_lock_test_and_set (&(v), (n))
+#define U_CAS(v, o, n) __sync_bool_compare_and_swap (&(v), (o), (n))
 
 #define MAX_TRIES 20
+/* Concurrency limit of upstream before it is adapted */
+#define UPSTREAM_LIMIT_INITIAL 8
+/* Request is considered queued if it is slower than average in this times */
+#define UPSTREAM_LIMIT_TOLERANCE 2
+
+/*
+ * Set of upstreams is attached to every array of upstreams on the first
+ * selection. It keeps indexes of alive members, so selection is O(1) and
+ * dead members are checked only when the earliest of them is due to revive.
+ * Readers access the index without locking, consistency is ensured by the
+ * sequence counter that is odd while the index is being changed.
+ */
+struct upstream_set {
+	pthread_mutex_t mtx;
+	/* Signalled when a slot of concurrency limit is released */
+	pthread_cond_t cond;
+	unsigned int waiters;
+	u_char *ups;
+	unsigned int members;
+	unsigned int msize;
+	unsigned int seq;
+	unsigned int nalive;
+	unsigned int *alive;
+	/* Time when the first dead member should be revived, 0 if none dead */
+	time_t next_revive;
+	time_t error_timeout;
+	time_t revive_timeout;
+	unsigned int max_errors;
+};
+
+static pthread_mutex_t upstream_sets_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+#define UPSTREAM_AT(set, i) ((struct upstream *)((set)->ups + (i) * (set)->msize))
+
+/*
+ * Rebuilds index of alive members, should be called with set locked
+ */
+static void
+upstream_set_reindex (struct upstream_set *set)
+{
+	unsigned int i, n = 0;
+
+	__sync_fetch_and_add (&set->seq, 1);
+
+	for (i = 0; i < set->members; i++) {
+		if (!U_LOAD (UPSTREAM_AT (set, i)->dead)) {
+			set->alive[n++] = i;
+		}
+	}
+
+	set->nalive = n;
+	__sync_fetch_and_add (&set->seq, 1);
+}
+
+/*
+ * Marks upstream as dead, should be called with set locked
+ */
+static void
+upstream_set_kill (struct upstream_set *set, struct upstream *up, time_t now)
+{
+	if (!U_LOAD (up->dead)) {
+		U_STORE (up->time, now);
+		U_STORE (up->weight, 0);
+		U_CAS (up->dead, 0, 1);
+
+		if (set->next_revive == 0 ||
+				now + set->revive_timeout < set->next_revive) {
+			set->next_revive = now + set->revive_timeout;
+		}
+
+		upstream_set_reindex (set);
+	}
+}
 
 /*
- * Check upstream parameters and mark it whether valid or dead
+ * Revives dead members which have been dead for long enough, should be called
+ * with set locked
  */
-static void check_upstream(struct upstream *up, time_t now,
-		time_t error_timeout, time_t revive_timeout, unsigned int max_errors,
+static void
+upstream_set_revive (struct upstream_set *set, time_t now,
 		const struct mlfi_priv *priv)
 {
-	if (up->dead) {
-		if (now - up->time >= revive_timeout) {
+	struct upstream *cur;
+	unsigned int i;
+	time_t next = 0, t;
+	bool changed = false;
+
+	for (i = 0; i < set->members; i++) {
+		cur = UPSTREAM_AT (set, i);
+
+		if (!U_LOAD (cur->dead)) {
+			continue;
+		}
+
+		t = U_LOAD (cur->time);
+
+		if (now - t >= set->revive_timeout) {
 			msg_debug("<%s>; check_upstream: reviving upstream after %ld seconds",
-					priv->mlfi_id, (long int ) now - up->time);
-			U_WLOCK ();
-			up->dead = 0;
-			up->errors = 0;
-			up->time = 0;
-			up->weight = up->priority;
-			U_UNLOCK ();
+					priv->mlfi_id, (long int ) now - t);
+			U_STORE (cur->errors, 0);
+			U_STORE (cur->time, 0);
+			U_STORE (cur->weight, cur->priority);
+			U_CAS (cur->dead, 1, 0);
+			changed = true;
+		}
+		else if (next == 0 || t + set->revive_timeout < next) {
+			next = t + set->revive_timeout;
 		}
 	}
-	else {
-		if (now - up->time >= error_timeout && up->errors >= max_errors) {
-			msg_debug(
-					"<%s>; check_upstream: marking upstreams as dead after %ld errors",
-					priv->mlfi_id, (long int ) up->errors);
-			U_WLOCK ();
-			up->dead = 1;
-			up->time = now;
-			up->weight = 0;
-			U_UNLOCK ();
+
+	set->next_revive = next;
+
+	if (changed) {
+		upstream_set_reindex (set);
+	}
+}
+
+/*
+ * Returns set for the array of upstreams creating it if needed, dead members
+ * are revived if their time has come
+ */
+static struct upstream_set *
+upstream_set_get (void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout, time_t revive_timeout,
+		unsigned int max_errors, const struct mlfi_priv *priv)
+{
+	struct upstream_set *set;
+	struct upstream *cur;
+	unsigned int i;
+
+	if (members == 0) {
+		return NULL;
+	}
+
+	set = U_LOAD (((struct upstream *) ups)->set);
+
+	if (set == NULL) {
+		pthread_mutex_lock (&upstream_sets_mtx);
+		set = ((struct upstream *) ups)->set;
+
+		if (set == NULL && (set = calloc (1, sizeof (*set))) != NULL) {
+			set->alive = calloc (members, sizeof (*set->alive));
+
+			if (set->alive == NULL) {
+				free (set);
+				pthread_mutex_unlock (&upstream_sets_mtx);
+
+				return NULL;
+			}
+
+			pthread_mutex_init (&set->mtx, NULL);
+			pthread_cond_init (&set->cond, NULL);
+			set->ups = ups;
+			set->members = members;
+			set->msize = msize;
+			set->error_timeout = error_timeout;
+			set->revive_timeout = revive_timeout;
+			set->max_errors = max_errors;
+
+			/* Apply errors counted before the set has been created */
+			for (i = 0; i < members; i++) {
+				cur = UPSTREAM_AT (set, i);
+
+				if (U_LOAD (cur->errors) >= max_errors &&
+						now - U_LOAD (cur->time) >= error_timeout) {
+					upstream_set_kill (set, cur, now);
+				}
+			}
+
+			upstream_set_reindex (set);
+			/* The first member is checked without lock, so set it last */
+			__sync_synchronize ();
+
+			for (i = members; i > 0; i--) {
+				UPSTREAM_AT (set, i - 1)->set = set;
+			}
+		}
+
+		pthread_mutex_unlock (&upstream_sets_mtx);
+
+		if (set == NULL) {
+			return NULL;
+		}
+	}
+
+	/* Limits might be changed on config reload */
+	if (set->revive_timeout != revive_timeout ||
+			set->error_timeout != error_timeout ||
+			set->max_errors != max_errors) {
+		pthread_mutex_lock (&set->mtx);
+		set->error_timeout = error_timeout;
+		set->revive_timeout = revive_timeout;
+		set->max_errors = max_errors;
+		pthread_mutex_unlock (&set->mtx);
+	}
+
+	if (U_LOAD (set->next_revive) != 0 && now >= U_LOAD (set->next_revive)) {
+		pthread_mutex_lock (&set->mtx);
+
+		if (set->next_revive != 0 && now >= set->next_revive) {
+			upstream_set_revive (set, now, priv);
 		}
+
+		pthread_mutex_unlock (&set->mtx);
 	}
+
+	if (U_LOAD (set->nalive) == 0) {
+		/* All upstreams are dead */
+		revive_all_upstreams (ups, members, msize, priv);
+	}
+
+	return set;
+}
+
+/*
+ * The key idea of this function is obtained from the following paper:
+ * A Fast, Minimal Memory, Consistent Hash Algorithm
+ * John Lamping, Eric Veach
+ *
+ * http://arxiv.org/abs/1406.2294
+ */
+static uint32_t rmilter_consistent_hash(uint64_t key, uint32_t nbuckets)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < nbuckets) {
+		b = j;
+		key *= 2862933555777941757ULL + 1;
+		j = (b + 1) * (double) (1ULL << 31) / (double) ((key >> 33) + 1ULL);
+	}
+
+	return b;
+}
+
+/*
+ * Returns alive member selected by hash: either `h` modulo number of alive
+ * members or consistent hash of `h`
+ */
+static struct upstream *
+upstream_set_select (struct upstream_set *set, uint64_t h, bool consistent,
+		const struct mlfi_priv *priv)
+{
+	unsigned int seq, n, sel, idx = 0;
+
+	do {
+		seq = U_LOAD (set->seq);
+
+		if (seq & 1) {
+			/* Index is being changed */
+			continue;
+		}
+
+		__sync_synchronize ();
+		n = U_LOAD (set->nalive);
+
+		if (n == 0) {
+			return NULL;
+		}
+
+		sel = consistent ? rmilter_consistent_hash (h, n) : h % n;
+		idx = U_LOAD (set->alive[sel]);
+		__sync_synchronize ();
+	} while ((seq & 1) || seq != U_LOAD (set->seq));
+
+	msg_debug("<%s>; upstream_set_select: return upstream with number %u of %u",
+			priv->mlfi_id, sel, n);
+
+	return UPSTREAM_AT (set, idx);
+}
+
+/*
+ * Final mixing of splitmix64, used to combine key hash with member index
+ */
+static inline uint64_t
+upstream_mix64 (uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return x;
+}
+
+/*
+ * Returns alive member with the highest weight for hash `h`. Weight depends
+ * on the member identity only, not on the set of alive members or order of
+ * members, so keys of alive members never move. Members without identity use
+ * their index. Linear scan is fine for the small arrays of upstreams.
+ */
+static struct upstream *
+upstream_set_select_hrw (struct upstream_set *set, uint64_t h,
+		const struct mlfi_priv *priv)
+{
+	unsigned int seq, n, i, cur, idx = 0;
+	uint64_t w, max, id;
+
+	do {
+		seq = U_LOAD (set->seq);
+
+		if (seq & 1) {
+			continue;
+		}
+
+		__sync_synchronize ();
+		n = U_LOAD (set->nalive);
+
+		if (n == 0) {
+			return NULL;
+		}
+
+		max = 0;
+
+		for (i = 0; i < n; i++) {
+			cur = U_LOAD (set->alive[i]);
+			id = UPSTREAM_AT (set, cur)->id;
+
+			if (id == 0) {
+				id = (cur + 1) * 0x9e3779b97f4a7c15ULL;
+			}
+
+			w = upstream_mix64 (h ^ id);
+
+			if (i == 0 || w > max) {
+				max = w;
+				idx = cur;
+			}
+		}
+
+		__sync_synchronize ();
+	} while ((seq & 1) || seq != U_LOAD (set->seq));
+
+	msg_debug("<%s>; upstream_set_select_hrw: return upstream with number %u "
+			"of %u alive", priv->mlfi_id, idx, n);
+
+	return UPSTREAM_AT (set, idx);
+}
+
+/*
+ * Returns two distinct alive members selected randomly (the same member if
+ * there is only one alive)
+ */
+static void
+upstream_set_select_pair (struct upstream_set *set, struct upstream **a,
+		struct upstream **b)
+{
+	unsigned int seq, n, i, j, r1, r2, ia = 0, ib = 0;
+
+	r1 = rand ();
+	r2 = rand ();
+
+	do {
+		seq = U_LOAD (set->seq);
+
+		if (seq & 1) {
+			continue;
+		}
+
+		__sync_synchronize ();
+		n = U_LOAD (set->nalive);
+
+		if (n == 0) {
+			*a = NULL;
+			*b = NULL;
+			return;
+		}
+
+		i = r1 % n;
+		j = n > 1 ? (i + 1 + r2 % (n - 1)) % n : i;
+		ia = U_LOAD (set->alive[i]);
+		ib = U_LOAD (set->alive[j]);
+		__sync_synchronize ();
+	} while ((seq & 1) || seq != U_LOAD (set->seq));
+
+	*a = UPSTREAM_AT (set, ia);
+	*b = UPSTREAM_AT (set, ib);
 }
 
 /*
@@ -86,126 +431,346 @@ static void check_upstream(struct upstream *up, time_t now,
  */
 void upstream_fail(struct upstream *up, time_t now)
 {
-	if (up->time != 0) {
-		up->errors++;
+	struct upstream_set *set;
+	unsigned int errors;
+
+	/* The first error starts the error period */
+	U_CAS (up->time, 0, now);
+	errors = __sync_add_and_fetch (&up->errors, 1);
+	set = U_LOAD (up->set);
+
+	if (set && !U_LOAD (up->dead) && errors >= set->max_errors &&
+			now - U_LOAD (up->time) >= set->error_timeout) {
+		msg_debug("upstream_fail: marking upstream as dead after %u errors",
+				errors);
+		pthread_mutex_lock (&set->mtx);
+		upstream_set_kill (set, up, now);
+		pthread_mutex_unlock (&set->mtx);
 	}
-	else {
-		U_WLOCK ();
-		up->time = now;
-		up->errors++;
-		U_UNLOCK ();
+}
+void upstream_set_id(struct upstream *up, const char *name, unsigned int port)
+{
+	char buf[512];
+	int r;
+
+	r = snprintf (buf, sizeof (buf), "%s:%u", name, port);
+
+	if (r >= (int)sizeof (buf)) {
+		r = sizeof (buf) - 1;
 	}
+
+	up->id = XXH64 (buf, r, 0);
 }
+
 /*
  * Call this function after successful upstream request
  */
 void upstream_ok(struct upstream *up, time_t now)
 {
-	if (up->errors != 0) {
-		U_WLOCK ();
-		up->errors = 0;
-		up->time = 0;
-		U_UNLOCK ();
+	if (U_LOAD (up->errors) != 0) {
+		U_STORE (up->errors, 0);
+		U_STORE (up->time, 0);
 	}
 
-	up->weight--;
+	__sync_fetch_and_sub (&up->weight, 1);
+}
+
+void upstream_mark_dead(struct upstream *up, time_t now)
+{
+	struct upstream_set *set;
+
+	set = U_LOAD (up->set);
+
+	if (set && !U_LOAD (up->dead)) {
+		pthread_mutex_lock (&set->mtx);
+		upstream_set_kill (set, up, now);
+		pthread_mutex_unlock (&set->mtx);
+	}
 }
+
+void upstream_mark_alive(struct upstream *up)
+{
+	struct upstream_set *set;
+
+	set = U_LOAD (up->set);
+
+	if (set && U_LOAD (up->dead)) {
+		pthread_mutex_lock (&set->mtx);
+
+		if (up->dead) {
+			U_STORE (up->errors, 0);
+			U_STORE (up->time, 0);
+			U_STORE (up->weight, up->priority);
+			U_CAS (up->dead, 1, 0);
+			upstream_set_reindex (set);
+		}
+
+		pthread_mutex_unlock (&set->mtx);
+	}
+}
+
+void upstream_start(struct upstream *up, struct timeval *start)
+{
+	gettimeofday (start, NULL);
+	__sync_fetch_and_add (&up->inflight, 1);
+}
+
 /*
- * Mark all upstreams as active. This function is used when all upstreams are marked as inactive
+ * Finishes request and returns its time in microseconds, only successful
+ * requests update latency as failures might be arbitrarily fast or slow
  */
-void revive_all_upstreams(void *ups, unsigned int members, unsigned int msize,
-		const struct mlfi_priv *priv)
+static unsigned int
+upstream_done_sample (struct upstream *up, const struct timeval *start,
+		bool ok)
 {
-	unsigned int i;
-	struct upstream *cur;
-	u_char *p;
+	struct timeval now;
+	unsigned int old, cur;
+	int64_t sample;
 
-	U_WLOCK ();
-	msg_debug("<%s>; revive_all_upstreams: starting reviving all upstreams", priv->mlfi_id);
-	p = ups;
-	for (i = 0; i < members; i++) {
-		cur = (struct upstream *) p;
-		cur->time = 0;
-		cur->errors = 0;
-		cur->dead = 0;
-		cur->weight = cur->priority;
-		p += msize;
+	gettimeofday (&now, NULL);
+	__sync_fetch_and_sub (&up->inflight, 1);
+	sample = (now.tv_sec - start->tv_sec) * 1000000LL +
+			now.tv_usec - start->tv_usec;
+
+	if (sample < 0) {
+		sample = 0;
 	}
-	U_UNLOCK ();
+	else if (sample > UINT_MAX / 2) {
+		sample = UINT_MAX / 2;
+	}
+
+	if (!ok) {
+		return sample;
+	}
+
+	/* Moving average with weight 1/8, concurrent updates are not lost */
+	do {
+		old = U_LOAD (up->latency);
+		cur = old == 0 ? sample : old - old / 8 + sample / 8;
+	} while (!U_CAS (up->latency, old, cur));
+
+	return sample;
+}
+
+void upstream_done(struct upstream *up, const struct timeval *start, bool ok)
+{
+	(void)upstream_done_sample (up, start, ok);
+}
+
+bool upstream_try_acquire(struct upstream *up, unsigned int max_limit,
+		struct timeval *start)
+{
+	unsigned int limit, inflight, initial;
+
+	if (max_limit == 0) {
+		upstream_start (up, start);
+		return true;
+	}
+
+	limit = U_LOAD (up->limit);
+
+	if (limit == 0 || limit > max_limit) {
+		/* Not initialized yet or maximum has been decreased on reload */
+		initial = MIN (UPSTREAM_LIMIT_INITIAL, max_limit);
+		U_CAS (up->limit, limit, initial);
+		limit = U_LOAD (up->limit);
+	}
+
+	do {
+		inflight = U_LOAD (up->inflight);
+
+		if (inflight >= limit) {
+			return false;
+		}
+	} while (!U_CAS (up->inflight, inflight, inflight + 1));
+
+	gettimeofday (start, NULL);
+
+	return true;
 }
 
 /*
- * Scan all upstreams for errors and mark upstreams dead or alive depends on conditions,
- * return number of alive upstreams
+ * Takes a slot of any alive member starting from a random one, should be
+ * called with set locked
  */
-static int rescan_upstreams(void *ups, unsigned int members, unsigned int msize,
-		time_t now, time_t error_timeout, time_t revive_timeout,
-		unsigned int max_errors, const struct mlfi_priv *priv)
+static struct upstream *
+upstream_set_acquire_any (struct upstream_set *set, unsigned int max_limit,
+		struct timeval *start)
 {
-	unsigned int i, alive;
 	struct upstream *cur;
-	u_char *p;
+	unsigned int i, first;
 
-	/* Recheck all upstreams */
-	p = ups;
-	alive = members;
-	for (i = 0; i < members; i++) {
-		cur = (struct upstream *) p;
-		check_upstream (cur, now, error_timeout, revive_timeout, max_errors, priv);
-		alive--;
-		p += msize;
+	first = rand () % set->members;
+
+	for (i = 0; i < set->members; i++) {
+		cur = UPSTREAM_AT (set, (first + i) % set->members);
+
+		if (!U_LOAD (cur->dead) &&
+				upstream_try_acquire (cur, max_limit, start)) {
+			return cur;
+		}
 	}
 
-	/* All upstreams are dead */
-	if (alive == 0) {
-		revive_all_upstreams (ups, members, msize, priv);
-		alive = members;
+	return NULL;
+}
+
+struct upstream *
+upstream_acquire(struct upstream *up, unsigned int max_limit,
+		unsigned int wait, struct timeval *start, const struct mlfi_priv *priv)
+{
+	struct upstream_set *set;
+	struct upstream *cur;
+	struct timespec ts;
+	struct timeval tv;
+	int r = 0;
+
+	if (upstream_try_acquire (up, max_limit, start)) {
+		return up;
 	}
 
-	msg_debug("<%s>; rescan_upstreams: %d upstreams alive", priv->mlfi_id, alive);
+	set = U_LOAD (up->set);
 
-	return (int) alive;
+	if (set == NULL) {
+		/* Cannot happen for selected upstreams */
+		upstream_start (up, start);
+		return up;
+	}
 
+	gettimeofday (&tv, NULL);
+	ts.tv_sec = tv.tv_sec + wait / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (wait % 1000) * 1000000;
+
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec ++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock (&set->mtx);
+	__sync_fetch_and_add (&set->waiters, 1);
+
+	/* Overflow to other members, then wait for a free slot */
+	while ((cur = upstream_set_acquire_any (set, max_limit, start)) == NULL &&
+			r != ETIMEDOUT) {
+		r = pthread_cond_timedwait (&set->cond, &set->mtx, &ts);
+	}
+
+	__sync_fetch_and_sub (&set->waiters, 1);
+	pthread_mutex_unlock (&set->mtx);
+
+	if (cur == NULL) {
+		msg_debug("<%s>; upstream_acquire: all upstreams are busy for %u ms",
+				priv->mlfi_id, wait);
+	}
+
+	return cur;
 }
 
-/* Return alive upstream by its number */
-static struct upstream *
-get_upstream_by_number(void *ups, unsigned int members, unsigned int msize,
-		int selected)
+void upstream_release(struct upstream *up, const struct timeval *start,
+		enum upstream_result result, unsigned int max_limit)
+{
+	struct upstream_set *set;
+	unsigned int limit, nlimit, inflight, avg, sample = 0;
+	bool ok = (result == UPSTREAM_RESULT_OK);
+
+	avg = U_LOAD (up->latency);
+	inflight = U_LOAD (up->inflight);
+
+	if (result == UPSTREAM_RESULT_CANCELLED) {
+		__sync_fetch_and_sub (&up->inflight, 1);
+	}
+	else {
+		sample = upstream_done_sample (up, start, ok);
+	}
+
+	if (max_limit > 0 && result != UPSTREAM_RESULT_CANCELLED) {
+		do {
+			limit = U_LOAD (up->limit);
+
+			if (!ok || (avg > 0 && sample / UPSTREAM_LIMIT_TOLERANCE > avg)) {
+				/* Multiplicative decrease on errors or queueing */
+				nlimit = limit - MAX (limit / 10, 1);
+
+				if (nlimit < 1) {
+					nlimit = 1;
+				}
+			}
+			else if (inflight >= limit && limit < max_limit) {
+				/* Additive increase if the limit has been reached */
+				nlimit = limit + 1;
+			}
+			else {
+				break;
+			}
+		} while (!U_CAS (up->limit, limit, nlimit));
+	}
+
+	set = U_LOAD (up->set);
+
+	if (set && U_LOAD (set->waiters) > 0) {
+		pthread_mutex_lock (&set->mtx);
+		pthread_cond_broadcast (&set->cond);
+		pthread_mutex_unlock (&set->mtx);
+	}
+}
+/*
+ * Mark all upstreams as active. This function is used when all upstreams are marked as inactive
+ */
+void revive_all_upstreams(void *ups, unsigned int members, unsigned int msize,
+		const struct mlfi_priv *priv)
 {
-	int i;
-	u_char *p, *c;
+	unsigned int i;
 	struct upstream *cur;
+	struct upstream_set *set;
+	u_char *p;
 
-	i = 0;
-	p = ups;
-	c = ups;
-	U_RLOCK ();
-	for (;;) {
-		/* Out of range, return NULL */
-		if (p > c + members * msize) {
-			break;
-		}
+	if (members == 0) {
+		return;
+	}
+
+	set = U_LOAD (((struct upstream *) ups)->set);
 
+	if (set) {
+		pthread_mutex_lock (&set->mtx);
+	}
+
+	msg_debug("<%s>; revive_all_upstreams: starting reviving all upstreams", priv->mlfi_id);
+	p = ups;
+	for (i = 0; i < members; i++) {
 		cur = (struct upstream *) p;
+		U_STORE (cur->time, 0);
+		U_STORE (cur->errors, 0);
+		U_STORE (cur->weight, cur->priority);
+		U_STORE (cur->dead, 0);
 		p += msize;
+	}
 
-		if (cur->dead) {
-			/* Skip inactive upstreams */
-			continue;
-		}
-		/* Return selected upstream */
-		if (i == selected) {
-			U_UNLOCK ();
-			return cur;
-		}
-		i++;
+	if (set) {
+		set->next_revive = 0;
+		upstream_set_reindex (set);
+		pthread_mutex_unlock (&set->mtx);
 	}
-	U_UNLOCK ();
+}
 
-	/* Error */
-	return NULL;
+void upstream_set_destroy(void *ups)
+{
+	struct upstream_set *set;
+
+	set = ((struct upstream *) ups)->set;
+
+	if (set) {
+		pthread_mutex_destroy (&set->mtx);
+		pthread_cond_destroy (&set->cond);
+		free (set->alive);
+		free (set);
+	}
+}
 
+bool upstream_attach_set(void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout, time_t revive_timeout,
+		unsigned int max_errors, const struct mlfi_priv *priv)
+{
+	return upstream_set_get (ups, members, msize, now, error_timeout,
+			revive_timeout, max_errors, priv) != NULL;
 }
 
 static uint64_t
@@ -215,42 +780,55 @@ get_hash_for_key(const unsigned char *key, unsigned int keylen)
 }
 
 /*
- * Recheck all upstreams and return random active upstream
+ * Return random active upstream
  */
 struct upstream *
 get_random_upstream(void *ups, unsigned int members, unsigned int msize,
 		time_t now, time_t error_timeout, time_t revive_timeout,
 		unsigned int max_errors, const struct mlfi_priv *priv)
 {
-	int alive, selected;
+	struct upstream_set *set;
 
-	alive = rescan_upstreams (ups, members, msize, now, error_timeout,
+	set = upstream_set_get (ups, members, msize, now, error_timeout,
 			revive_timeout, max_errors, priv);
-	selected = rand () % alive;
-	msg_debug("<%s>; get_random_upstream: return upstream with number %d of %d",
-			priv->mlfi_id, selected, alive);
 
-	return get_upstream_by_number (ups, members, msize, selected);
+	if (set == NULL) {
+		return NULL;
+	}
+
+	return upstream_set_select (set, rand (), false, priv);
 }
 
-/*
- * The key idea of this function is obtained from the following paper:
- * A Fast, Minimal Memory, Consistent Hash Algorithm
- * John Lamping, Eric Veach
- *
- * http://arxiv.org/abs/1406.2294
- */
-static uint32_t rmilter_consistent_hash(uint64_t key, uint32_t nbuckets)
+struct upstream *
+get_upstream_by_latency(void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout, time_t revive_timeout,
+		unsigned int max_errors, const struct mlfi_priv *priv)
 {
-	int64_t b = -1, j = 0;
+	struct upstream_set *set;
+	struct upstream *a, *b;
+	uint64_t ca, cb;
 
-	while (j < nbuckets) {
-		b = j;
-		key *= 2862933555777941757ULL + 1;
-		j = (b + 1) * (double) (1ULL << 31) / (double) ((key >> 33) + 1ULL);
+	set = upstream_set_get (ups, members, msize, now, error_timeout,
+			revive_timeout, max_errors, priv);
+
+	if (set == NULL) {
+		return NULL;
 	}
 
-	return b;
+	upstream_set_select_pair (set, &a, &b);
+
+	if (a == NULL || a == b) {
+		return a;
+	}
+
+	/* Upstreams without measurements yet are preferred */
+	ca = (uint64_t)U_LOAD (a->latency) * (U_LOAD (a->inflight) + 1);
+	cb = (uint64_t)U_LOAD (b->latency) * (U_LOAD (b->inflight) + 1);
+
+	msg_debug("<%s>; get_upstream_by_latency: cost %llu vs %llu",
+			priv->mlfi_id, (unsigned long long)ca, (unsigned long long)cb);
+
+	return cb < ca ? b : a;
 }
 
 /*
@@ -262,51 +840,35 @@ get_upstream_by_hash(void *ups, unsigned int members, unsigned int msize,
 		unsigned int max_errors, const unsigned char *key,
 		unsigned int keylen, const struct mlfi_priv *priv)
 {
-	int alive, i = 0, sel;
-	uint64_t h = 0;
-	char numbuf[4];
-	u_char *c, *p;
-	struct upstream *cur = NULL;
+	struct upstream_set *set;
 
-	alive = rescan_upstreams (ups, members, msize, now, error_timeout,
+	set = upstream_set_get (ups, members, msize, now, error_timeout,
 			revive_timeout, max_errors, priv);
 
-	if (alive == 0) {
+	if (set == NULL) {
 		return NULL;
 	}
 
-	h = get_hash_for_key (key, keylen);
-	sel = rmilter_consistent_hash (h, alive);
-
-	msg_debug("<%s>; get_upstream_by_hash: try to select upstream number %d of %d",
-			priv->mlfi_id, sel, alive);
-	U_RLOCK ();
-	p = ups;
-	c = ups;
+	return upstream_set_select (set, get_hash_for_key (key, keylen), true,
+			priv);
+}
 
-	for (;;) {
-		/* Out of range, return NULL */
-		if (p > c + members * msize) {
-			break;
-		}
+struct upstream *
+get_upstream_by_rendezvous(void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout, time_t revive_timeout,
+		unsigned int max_errors, const unsigned char *key,
+		unsigned int keylen, const struct mlfi_priv *priv)
+{
+	struct upstream_set *set;
 
-		cur = (struct upstream *) p;
-		p += msize;
+	set = upstream_set_get (ups, members, msize, now, error_timeout,
+			revive_timeout, max_errors, priv);
 
-		if (cur->dead) {
-			/* Skip inactive upstreams */
-			continue;
-		}
-		/* Return selected upstream */
-		if (i == sel) {
-			U_UNLOCK ();
-			return cur;
-		}
-		i++;
+	if (set == NULL) {
+		return NULL;
 	}
-	U_UNLOCK ();
 
-	return cur;
+	return upstream_set_select_hrw (set, get_hash_for_key (key, keylen), priv);
 }
 
 /*
@@ -321,33 +883,32 @@ get_upstream_round_robin(void *ups, unsigned int members, unsigned int msize,
 	struct upstream *cur, *selected = NULL;
 	u_char *p;
 
-	/* Recheck all upstreams */
-	rescan_upstreams (ups, members, msize, now, error_timeout, revive_timeout,
-			max_errors, priv);
+	/* Revive dead upstreams if needed */
+	if (upstream_set_get (ups, members, msize, now, error_timeout,
+			revive_timeout, max_errors, priv) == NULL) {
+		return NULL;
+	}
 
 	p = ups;
 	max_weight = 0;
 	selected = (struct upstream *) p;
-	U_RLOCK ();
 	for (i = 0; i < members; i++) {
 		cur = (struct upstream *) p;
-		if (!cur->dead) {
-			if ((int) max_weight < cur->weight) {
-				max_weight = cur->weight;
+		if (!U_LOAD (cur->dead)) {
+			if ((int) max_weight < U_LOAD (cur->weight)) {
+				max_weight = U_LOAD (cur->weight);
 				selected = cur;
 			}
 		}
 		p += msize;
 	}
-	U_UNLOCK ();
 
 	if (max_weight == 0) {
 		p = ups;
-		U_WLOCK ();
 		for (i = 0; i < members; i++) {
 			cur = (struct upstream *) p;
-			cur->weight = cur->priority;
-			if (!cur->dead) {
+			U_STORE (cur->weight, cur->priority);
+			if (!U_LOAD (cur->dead)) {
 				if (max_weight < cur->priority) {
 					max_weight = cur->priority;
 					selected = cur;
@@ -355,7 +916,6 @@ get_upstream_round_robin(void *ups, unsigned int members, unsigned int msize,
 			}
 			p += msize;
 		}
-		U_UNLOCK ();
 	}
 	msg_debug("<%s>; get_upstream_round_robin: selecting upstream with weight %d",
 			priv->mlfi_id, max_weight);
@@ -375,17 +935,18 @@ get_upstream_master_slave(void *ups, unsigned int members, unsigned int msize,
 	struct upstream *cur, *selected = NULL;
 	u_char *p;
 
-	/* Recheck all upstreams */
-	rescan_upstreams (ups, members, msize, now, error_timeout, revive_timeout,
-			max_errors, priv);
+	/* Revive dead upstreams if needed */
+	if (upstream_set_get (ups, members, msize, now, error_timeout,
+			revive_timeout, max_errors, priv) == NULL) {
+		return NULL;
+	}
 
 	p = ups;
 	max_weight = 0;
 	selected = (struct upstream *) p;
-	U_RLOCK ();
 	for (i = 0; i < members; i++) {
 		cur = (struct upstream *) p;
-		if (!cur->dead) {
+		if (!U_LOAD (cur->dead)) {
 			if (max_weight < cur->priority) {
 				max_weight = cur->priority;
 				selected = cur;
@@ -393,12 +954,12 @@ get_upstream_master_slave(void *ups, unsigned int members, unsigned int msize,
 		}
 		p += msize;
 	}
-	U_UNLOCK ();
 	msg_debug("<%s>; get_upstream_master_slave: selecting upstream with priority %d",
 			priv->mlfi_id, max_weight);
 
 	return selected;
 }
 
-#undef U_LOCK
-#undef U_UNLOCK
+#undef U_LOAD
+#undef U_STORE
+#undef U_CAS
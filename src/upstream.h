@@ -29,20 +29,95 @@
 
 #include "config.h"
 
+struct upstream_set;
+
+/* Balancing of requests between alive upstreams */
+enum upstream_balance {
+	BALANCE_RANDOM = 0,
+	/* The faster of two random upstreams by latency and load */
+	BALANCE_LATENCY
+};
+
+/* Mapping of keys to alive upstreams */
+enum upstream_hashing {
+	/* Jump consistent hash over alive upstreams */
+	HASHING_JUMP = 0,
+	/* Highest random weight, only keys of failed upstream are moved */
+	HASHING_RENDEZVOUS
+};
+
+/* State fields are updated atomically, `priority` is set on config load only */
 struct upstream {
 	unsigned int errors;
 	time_t time;
 	unsigned char dead;
 	unsigned char priority;
 	int16_t weight;
+	/* Index of alive members of the array this upstream belongs to */
+	struct upstream_set *set;
+	/* Moving average of request time in microseconds */
+	unsigned int latency;
+	/* Number of requests in progress */
+	unsigned int inflight;
+	/* Adaptive limit of requests in progress, 0 until the first request */
+	unsigned int limit;
+	/* Hash of server address for rendezvous hashing, 0 if not set */
+	uint64_t id;
 };
 
 struct mlfi_priv;
 
 void upstream_fail (struct upstream *up, time_t now);
 void upstream_ok (struct upstream *up, time_t now);
+/* Sets identity of upstream used by get_upstream_by_rendezvous */
+void upstream_set_id (struct upstream *up, const char *name, unsigned int port);
+/*
+ * Results of active health checks: upstream is marked dead or alive
+ * immediately regardless of errors counted on requests. Upstreams array must
+ * be attached to a set, see upstream_attach_set.
+ */
+void upstream_mark_dead (struct upstream *up, time_t now);
+void upstream_mark_alive (struct upstream *up);
+/*
+ * Call these functions around each request to maintain latency and load of
+ * upstream, `start` is the time when request has been started, latency is
+ * updated by successful requests only
+ */
+void upstream_start (struct upstream *up, struct timeval *start);
+void upstream_done (struct upstream *up, const struct timeval *start, bool ok);
+/*
+ * The same with concurrency limit adapted by AIMD: the limit is increased by
+ * one when it has been reached and requests are not slower than usual, and
+ * decreased by 10% on failed or slow requests. It never exceeds `max_limit`,
+ * 0 means no limit.
+ *
+ * upstream_try_acquire returns false if upstream is at its limit.
+ * upstream_acquire tries other alive upstreams of the same array in this case
+ * and then waits for a free slot no longer than `wait` milliseconds, it
+ * returns upstream used for request or NULL if all of them are busy.
+ * Cancelled requests change neither latency nor the limit, as their time
+ * tells nothing about upstream.
+ */
+enum upstream_result {
+	UPSTREAM_RESULT_OK = 0,
+	UPSTREAM_RESULT_FAILED,
+	UPSTREAM_RESULT_CANCELLED
+};
+
+bool upstream_try_acquire (struct upstream *up, unsigned int max_limit,
+		struct timeval *start);
+struct upstream* upstream_acquire (struct upstream *up, unsigned int max_limit,
+		unsigned int wait, struct timeval *start, const struct mlfi_priv *priv);
+void upstream_release (struct upstream *up, const struct timeval *start,
+		enum upstream_result result, unsigned int max_limit);
 void revive_all_upstreams (void *ups, unsigned int members, unsigned int msize,
 		const struct mlfi_priv *priv);
+/* Attaches index of alive upstreams to the array, it is done on selection too */
+bool upstream_attach_set (void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout, time_t revive_timeout,
+		unsigned int max_errors, const struct mlfi_priv *priv);
+/* Frees index of alive upstreams attached to the array on selection */
+void upstream_set_destroy (void *ups);
 
 struct upstream* get_random_upstream   (void *ups, unsigned int members, unsigned int msize,
 		time_t now, time_t error_timeout,
@@ -54,6 +129,26 @@ struct upstream* get_upstream_by_hash  (void *ups, unsigned int members, unsigne
 		const unsigned char *key, unsigned int keylen,
 		const struct mlfi_priv *priv);
 
+/*
+ * Returns alive upstream with the highest hash of key and upstream identity, so
+ * when an upstream dies only its keys are moved to other upstreams, and keys
+ * do not depend on the order of upstreams in configuration
+ */
+struct upstream* get_upstream_by_rendezvous (void *ups, unsigned int members,
+		unsigned int msize, time_t now, time_t error_timeout,
+		time_t revive_timeout, unsigned int max_errors,
+		const unsigned char *key, unsigned int keylen,
+		const struct mlfi_priv *priv);
+
+/*
+ * Selects two random alive upstreams and returns one with the lower product
+ * of average latency and number of requests in progress
+ */
+struct upstream* get_upstream_by_latency (void *ups, unsigned int members, unsigned int msize,
+		time_t now, time_t error_timeout,
+		time_t revive_timeout, unsigned int max_errors,
+		const struct mlfi_priv *priv);
+
 struct upstream* get_upstream_round_robin (void *ups, unsigned int members, unsigned int msize,
 		time_t now, time_t error_timeout,
 		time_t revive_timeout, unsigned int max_errors,
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Contention benchmark of upstreams: threads select upstreams from the same
+ * array, account requests and report errors as milter threads do, the
+ * throughput is printed for 1 to 64 threads.
+ *
+ * Usage: upstream_bench [iterations per thread]
+ */
+
+#include "config.h"
+#include "rmilter.h"
+#include "upstream.h"
+
+#define BENCH_UPSTREAMS 8
+#define BENCH_MAX_THREADS 64
+#define BENCH_DEFAULT_ITERATIONS 200000
+/* One request of this number fails */
+#define BENCH_FAIL_RATE 100
+
+struct bench_server {
+	struct upstream up;
+	char name[16];
+};
+
+static struct bench_server servers[BENCH_UPSTREAMS];
+static unsigned long iterations = BENCH_DEFAULT_ITERATIONS;
+
+static void *
+bench_thread (void *arg)
+{
+	struct mlfi_priv *priv = arg;
+	struct bench_server *selected;
+	struct timeval tv;
+	unsigned long i;
+	unsigned int seed = (uintptr_t)arg;
+	time_t now;
+
+	for (i = 0; i < iterations; i ++) {
+		now = time (NULL);
+		selected = (struct bench_server *)get_upstream_by_latency (servers,
+				BENCH_UPSTREAMS, sizeof (struct bench_server), now, 10, 1, 10,
+				priv);
+
+		if (selected == NULL) {
+			continue;
+		}
+
+		if (!upstream_try_acquire (&selected->up, 64, &tv)) {
+			continue;
+		}
+
+		if (rand_r (&seed) % BENCH_FAIL_RATE == 0) {
+			upstream_release (&selected->up, &tv, UPSTREAM_RESULT_FAILED, 64);
+			upstream_fail (&selected->up, now);
+		}
+		else {
+			upstream_release (&selected->up, &tv, UPSTREAM_RESULT_OK, 64);
+			upstream_ok (&selected->up, now);
+		}
+	}
+
+	return NULL;
+}
+
+static double
+bench_run (unsigned int nthreads)
+{
+	pthread_t thr[BENCH_MAX_THREADS];
+	struct mlfi_priv *privs[BENCH_MAX_THREADS];
+	struct timeval start, end;
+	unsigned int i;
+
+	for (i = 0; i < nthreads; i ++) {
+		/* Used for logging only */
+		privs[i] = calloc (1, sizeof (struct mlfi_priv));
+
+		if (privs[i] == NULL) {
+			perror ("calloc");
+			exit (EXIT_FAILURE);
+		}
+
+		snprintf (privs[i]->mlfi_id, sizeof (privs[i]->mlfi_id), "bench%u", i);
+	}
+
+	gettimeofday (&start, NULL);
+
+	for (i = 0; i < nthreads; i ++) {
+		if (pthread_create (&thr[i], NULL, bench_thread, privs[i]) != 0) {
+			perror ("pthread_create");
+			exit (EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nthreads; i ++) {
+		pthread_join (thr[i], NULL);
+		free (privs[i]);
+	}
+
+	gettimeofday (&end, NULL);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+int
+main (int argc, char **argv)
+{
+	unsigned int nthreads, i;
+	double elapsed;
+
+	if (argc > 1) {
+		iterations = strtoul (argv[1], NULL, 10);
+	}
+
+	for (i = 0; i < BENCH_UPSTREAMS; i ++) {
+		snprintf (servers[i].name, sizeof (servers[i].name), "server%u", i);
+		upstream_set_id (&servers[i].up, servers[i].name, 0);
+		servers[i].up.priority = 1;
+		servers[i].up.weight = 1;
+	}
+
+	printf ("%8s %14s %12s\n", "threads", "requests/s", "ns/request");
+
+	for (nthreads = 1; nthreads <= BENCH_MAX_THREADS; nthreads *= 2) {
+		elapsed = bench_run (nthreads);
+		printf ("%8u %14.0f %12.1f\n", nthreads,
+				nthreads * iterations / elapsed,
+				elapsed * 1e9 / (nthreads * iterations));
+	}
+
+	upstream_set_destroy (servers);
+
+	return EXIT_SUCCESS;
+}
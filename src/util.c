@@ -516,6 +516,66 @@ rmilter_encode_base64 (const u_char *in, size_t inlen, int str_len,
 	return rmilter_encode_base64_common (in, inlen, str_len, outlen, 0);
 }
 
+size_t
+rmilter_encode_hex_buf (const u_char *in, size_t inlen, char *out,
+		size_t outlen)
+{
+	static const char hexdigests[16] = "0123456789abcdef";
+	char *o = out, *end = out + outlen;
+	size_t i;
+
+	for (i = 0; i < inlen && o + 2 <= end; i ++) {
+		*o++ = hexdigests[(in[i] >> 4) & 0xF];
+		*o++ = hexdigests[in[i] & 0xF];
+	}
+
+	if (o < end) {
+		*o = '\0';
+	}
+
+	return o - out;
+}
+
+size_t
+rmilter_resp_cmdlen (const char *cmd, size_t len)
+{
+	const char *p = cmd, *end = cmd + len;
+	char *ep;
+	long nargs, arglen;
+
+	if (len < 4 || *p != '*') {
+		return 0;
+	}
+
+	nargs = strtol (p + 1, &ep, 10);
+
+	if (ep + 2 > end || *ep != '\r') {
+		return 0;
+	}
+
+	p = ep + 2;
+
+	while (nargs-- > 0) {
+		if (p >= end || *p != '$') {
+			return 0;
+		}
+
+		arglen = strtol (p + 1, &ep, 10);
+
+		if (arglen < 0 || ep + 2 > end || *ep != '\r') {
+			return 0;
+		}
+
+		p = ep + 2 + arglen + 2;
+
+		if (p > end) {
+			return 0;
+		}
+	}
+
+	return p - cmd;
+}
+
 int
 rmilter_connect_addr (const char *addr, int port, int msec,
 		const struct mlfi_priv *priv)
@@ -643,6 +703,36 @@ rmilter_poll_fd (int fd, int timeout, short events)
 	return r;
 }
 
+int
+rmilter_poll_fd_cancel (int fd, int timeout, short events, int cancel_fd)
+{
+	int r;
+	struct pollfd fds[2];
+
+	if (cancel_fd == -1) {
+		return rmilter_poll_fd (fd, timeout, events);
+	}
+
+	fds[0].fd = fd;
+	fds[0].events = events;
+	fds[0].revents = 0;
+	fds[1].fd = cancel_fd;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	while ((r = poll (fds, 2, timeout)) < 0) {
+		if (errno != EINTR)
+			break;
+	}
+
+	if (r > 0 && fds[1].revents != 0) {
+		errno = ECANCELED;
+		return -1;
+	}
+
+	return r;
+}
+
 static const unsigned char lc_map[256] = {
 		0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
@@ -972,3 +1062,61 @@ rmilter_header_value_fold (const gchar *name,
 
 	return res;
 }
+
+bool
+rmilter_thread_start (const char *name, void *(*func) (void *), void *arg)
+{
+	pthread_t thr;
+	pthread_attr_t attr;
+	int r;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	r = pthread_create (&thr, &attr, func, arg);
+	pthread_attr_destroy (&attr);
+
+	if (r != 0) {
+		msg_err ("%s: cannot start thread: %s", name, strerror (r));
+		return false;
+	}
+
+	return true;
+}
+
+struct mlfi_priv*
+rmilter_thread_priv (const char *name)
+{
+	struct mlfi_priv *priv;
+
+	priv = calloc (1, sizeof (*priv));
+
+	if (priv == NULL) {
+		msg_err ("%s: cannot allocate memory", name);
+		return NULL;
+	}
+
+	rmilter_strlcpy (priv->mlfi_id, name, sizeof (priv->mlfi_id));
+
+	return priv;
+}
+
+void
+rmilter_thread_sleep (unsigned int interval)
+{
+	if (interval == 0) {
+		interval = RMILTER_IDLE_INTERVAL;
+	}
+
+	usleep (interval * 1000);
+}
+
+void
+rmilter_stat_snapshot (void *dst, void *src, size_t size)
+{
+	uint64_t *d = dst, *s = src;
+	size_t i;
+
+	for (i = 0; i < size / sizeof (uint64_t); i ++) {
+		d[i] = __sync_fetch_and_add (&s[i], 0);
+	}
+}
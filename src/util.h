@@ -80,9 +80,34 @@ struct mlfi_priv;
 char* rmilter_encode_base64 (const u_char *in, size_t inlen, int str_len,
 		size_t *outlen);
 
+/**
+ * Encode data as lowercase hex string
+ * @param in input data
+ * @param inlen length of input
+ * @param out output buffer, zero terminated if there is space left
+ * @param outlen size of output buffer
+ * @return number of characters written
+ */
+size_t rmilter_encode_hex_buf (const u_char *in, size_t inlen, char *out,
+		size_t outlen);
+
+/**
+ * Returns length of the first command in the buffer of redis commands
+ * formatted according to the redis protocol
+ * @param cmd buffer
+ * @param len length of buffer
+ * @return length of the first command or 0 if the buffer is malformed
+ */
+size_t rmilter_resp_cmdlen (const char *cmd, size_t len);
+
 int rmilter_connect_addr (const char *addr, int port, int msec,
 		const struct mlfi_priv *priv);
 int rmilter_poll_fd (int fd, int timeout, short events);
+/**
+ * Same as `rmilter_poll_fd` but returns -1 with errno set to ECANCELED as soon
+ * as `cancel_fd` becomes readable, `cancel_fd` is ignored if it is -1
+ */
+int rmilter_poll_fd_cancel (int fd, int timeout, short events, int cancel_fd);
 
 #define msec_to_tv(msec, tv) do { (tv)->tv_sec = (msec) / 1000; (tv)->tv_usec = \
 		((msec) - (tv)->tv_sec * 1000) * 1000; \
@@ -95,6 +120,41 @@ ssize_t rmilter_atomic_write (int fd, const void *buf, size_t len);
 int rmilter_file_xopen (const char *fname, int oflags, unsigned int mode);
 void* rmilter_file_xmap (const char *fname, unsigned int mode, size_t *size);
 
+/* How often background threads recheck their interval while disabled, ms */
+#define RMILTER_IDLE_INTERVAL 1000
+
+/**
+ * Start detached background thread, failure is logged with the thread name
+ * @param name name of thread for logging
+ * @param func thread function
+ * @param arg argument of thread function
+ * @return true if thread has been started
+ */
+bool rmilter_thread_start (const char *name, void *(*func) (void *), void *arg);
+
+/**
+ * Allocate milter context for a background thread, it is used for logging
+ * and upstreams selection only
+ * @param name name used as the message id in logs
+ * @return new context or NULL if memory cannot be allocated
+ */
+struct mlfi_priv* rmilter_thread_priv (const char *name);
+
+/**
+ * Sleep for `interval` milliseconds, or for RMILTER_IDLE_INTERVAL if the
+ * interval is 0 and the thread is disabled by config
+ */
+void rmilter_thread_sleep (unsigned int interval);
+
+/**
+ * Copy statistics structure consisting of 64 bit counters that are updated
+ * atomically by other threads
+ * @param dst destination structure
+ * @param src counters
+ * @param size size of structure
+ */
+void rmilter_stat_snapshot (void *dst, void *src, size_t size);
+
 /**
  * Fold header using rfc822 rules, return new GString from the previous one
  * @param name name of header (used just for folding)